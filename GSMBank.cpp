@@ -0,0 +1,279 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include "GSMBank.h"
+
+#if !defined(GSM_NO_SMS_OUT) && !defined(GSM_NO_SMS_IN)
+
+
+GSMBank::GSMBank(GSMSIM300 **modems, uint8_t count) :
+modems(modems),
+count(count > GSM_BANK_MAX_MODEMS ? GSM_BANK_MAX_MODEMS : count),
+current(0),
+pendingHead(0),
+pendingCount(0),
+handle(0),
+nextModem(0),
+nextRead(0),
+readEnabled(false),
+clock(count ? modems[0]->getClock() : &gsmArduinoClock)
+{
+    memset(queue, 0, sizeof(queue));
+    memset(reading, 0, sizeof(reading));
+    resetCounters();
+}
+
+void GSMBank::update() {
+    for (current = 0; current < count; current++)
+        modems[current]->update();
+    updateStatus();
+    dispatch();
+    if (readEnabled)
+        updateInbox();
+}
+
+GSMBankEntry *GSMBank::queueSMS(const char *num) {
+    if (pendingCount >= GSM_BANK_QUEUE_SIZE)
+        return NULL;
+    // Entries are reused once their final status has been set
+    GSMBankEntry *entry = NULL;
+    for (uint8_t i = 0; i < GSM_BANK_QUEUE_SIZE; i++) {
+        uint8_t status = queue[i].status;
+        if (status == SMS_STATUS_NONE || status == SMS_STATUS_SENT || status == SMS_STATUS_FAILED) {
+            entry = &queue[i];
+            if (status == SMS_STATUS_NONE)
+                break;
+        }
+    }
+    if (entry == NULL) {
+#ifdef DEBUG
+        Serial.println(F("SMS bank is full"));
+#endif
+        return NULL;
+    }
+    GSMSIM300::copyField(entry->number, sizeof(entry->number), num);
+    if (++handle == 0) // 0 is used to indicate an error
+        handle = 1;
+    entry->handle = handle;
+    entry->status = SMS_STATUS_QUEUED;
+    entry->modem = GSM_BANK_NONE;
+    entry->rerouted = false;
+    pending[(pendingHead + pendingCount) % GSM_BANK_QUEUE_SIZE] = entry - queue;
+    pendingCount++;
+    return entry;
+}
+
+uint8_t GSMBank::sendSMS(const char *num, const char *mes) {
+    GSMBankEntry *entry = queueSMS(num);
+    if (entry == NULL)
+        return 0;
+    GSMSIM300::copyField(entry->message, sizeof(entry->message), mes);
+    entry->pduMode = false;
+    return entry->handle;
+}
+
+uint8_t GSMBank::sendLongSMS(const char *num, const char *text) {
+    GSMBankEntry *entry = queueSMS(num);
+    if (entry == NULL)
+        return 0;
+    entry->text = text;
+    entry->pduMode = true;
+    return entry->handle;
+}
+
+uint8_t GSMBank::getSMSStatus(uint8_t handle) {
+    for (uint8_t i = 0; i < GSM_BANK_QUEUE_SIZE; i++) {
+        if (handle != 0 && queue[i].handle == handle)
+            return queue[i].status;
+    }
+    return SMS_STATUS_NONE;
+}
+
+uint8_t GSMBank::getSMSModem(uint8_t handle) {
+    for (uint8_t i = 0; i < GSM_BANK_QUEUE_SIZE; i++) {
+        if (handle != 0 && queue[i].handle == handle)
+            return queue[i].modem;
+    }
+    return GSM_BANK_NONE;
+}
+
+void GSMBank::updateStatus() {
+    for (uint8_t i = 0; i < GSM_BANK_QUEUE_SIZE; i++) {
+        GSMBankEntry *entry = &queue[i];
+        if (entry->modem == GSM_BANK_NONE || (entry->status != SMS_STATUS_QUEUED && entry->status != SMS_STATUS_SENDING))
+            continue;
+        GSMSIM300 *modem = modems[entry->modem];
+        uint8_t status = modem->getSMSStatus(entry->modemHandle);
+        if (status == SMS_STATUS_NONE) // The modem has reused the handle, so the outcome is unknown and it is handled like a failure
+            status = SMS_STATUS_FAILED;
+        if (status == SMS_STATUS_SENT)
+            sent[entry->modem]++;
+        else if (status == SMS_STATUS_FAILED) {
+            if (!entry->rerouted && (modem->getState() != GSM_RUNNING || modem->getRecoveryTier() != GSM_RECOVERY_NONE)) {
+                // The message was not rejected, the modem failed to send it, so another modem is given a chance
+#ifdef DEBUG
+                Serial.print(F("Rerouting SMS from modem "));
+                Serial.println(entry->modem);
+#endif
+                entry->rerouted = true;
+                entry->modem = GSM_BANK_NONE;
+                entry->status = SMS_STATUS_QUEUED;
+                pending[(pendingHead + pendingCount) % GSM_BANK_QUEUE_SIZE] = i;
+                pendingCount++;
+                continue;
+            }
+            failed[entry->modem]++;
+        }
+        entry->status = status;
+    }
+}
+
+void GSMBank::dispatch() {
+    while (pendingCount > 0) {
+        uint8_t i = pickModem();
+        if (i == GSM_BANK_NONE)
+            return;
+        GSMBankEntry *entry = &queue[pending[pendingHead]];
+        uint8_t modemHandle = entry->pduMode ? modems[i]->sendLongSMS(entry->number, entry->text) : modems[i]->sendSMS(entry->number, entry->message);
+        if (modemHandle == 0) { // The message can not be sent by any modem, i.e. it is too long
+            entry->status = SMS_STATUS_FAILED;
+            failed[i]++;
+        } else {
+            entry->modem = i;
+            entry->modemHandle = modemHandle;
+        }
+        pendingHead = (pendingHead + 1) % GSM_BANK_QUEUE_SIZE;
+        pendingCount--;
+        nextModem = (i + 1) % count;
+    }
+}
+
+uint8_t GSMBank::pickModem() {
+    // The load is the number of queued messages, while a modem reading its messages counts as half a message
+    uint8_t best = GSM_BANK_NONE, bestLoad = 0xFF;
+    for (uint8_t n = 0; n < count; n++) {
+        uint8_t i = (nextModem + n) % count;
+        GSMSIM300 *modem = modems[i];
+        if (modem->getState() != GSM_RUNNING || !modem->isRegistered() || modem->getSMSQueueCount() >= GSM_BANK_MODEM_DEPTH)
+            continue; // A modem that has lost the network would hold the message
+        uint8_t load = modem->getSMSQueueCount() * 2 + (modem->inboxBusy() ? 1 : 0);
+        if (load < bestLoad) {
+            best = i;
+            bestLoad = load;
+        }
+    }
+    return best;
+}
+
+void GSMBank::setSMSCallback(SMSCallback callback) {
+    for (uint8_t i = 0; i < count; i++)
+        modems[i]->setSMSCallback(callback);
+    readEnabled = callback != NULL;
+}
+
+void GSMBank::updateInbox() {
+    for (uint8_t i = 0; i < count; i++) {
+        if (reading[i] && !modems[i]->inboxBusy()) {
+            received[i] += modems[i]->getInboxCount();
+            reading[i] = false;
+        }
+    }
+    // Only one modem starts reading per update, so the modems do not all read at the same time after a burst of messages
+    for (uint8_t n = 0; n < count; n++) {
+        uint8_t i = (nextRead + n) % count;
+        GSMSIM300 *modem = modems[i];
+        if (modem->getState() == GSM_RUNNING && modem->newSMS() && !modem->inboxBusy() && modem->drainSMS()) {
+            reading[i] = true;
+            nextRead = (i + 1) % count;
+            return;
+        }
+    }
+}
+
+uint8_t GSMBank::getRunningCount() {
+    uint8_t running = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (modems[i]->getState() == GSM_RUNNING)
+            running++;
+    }
+    return running;
+}
+
+uint32_t GSMBank::getSentCount(uint8_t modem /*= GSM_BANK_NONE*/) {
+    if (modem != GSM_BANK_NONE)
+        return modem < count ? sent[modem] : 0;
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < count; i++)
+        total += sent[i];
+    return total;
+}
+
+uint32_t GSMBank::getFailedCount(uint8_t modem /*= GSM_BANK_NONE*/) {
+    if (modem != GSM_BANK_NONE)
+        return modem < count ? failed[modem] : 0;
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < count; i++)
+        total += failed[i];
+    return total;
+}
+
+uint32_t GSMBank::getReceivedCount(uint8_t modem /*= GSM_BANK_NONE*/) {
+    if (modem != GSM_BANK_NONE)
+        return modem < count ? received[modem] : 0;
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < count; i++)
+        total += received[i];
+    return total;
+}
+
+float GSMBank::getThroughput() {
+    uint32_t time = clock->millis() - startTime;
+    if (time == 0)
+        return 0;
+    return getSentCount() * 1000.0f / time;
+}
+
+void GSMBank::resetCounters() {
+    memset(sent, 0, sizeof(sent));
+    memset(failed, 0, sizeof(failed));
+    memset(received, 0, sizeof(received));
+    startTime = clock->millis();
+}
+
+void GSMBank::printStats() {
+    for (uint8_t i = 0; i < count; i++) {
+        Serial.print(F("Modem "));
+        Serial.print(i);
+        Serial.print(F(": state "));
+        Serial.print(modems[i]->getState());
+        Serial.print(F(" queued "));
+        Serial.print(modems[i]->getSMSQueueCount());
+        Serial.print(F(" sent "));
+        Serial.print(sent[i]);
+        Serial.print(F(" failed "));
+        Serial.print(failed[i]);
+        Serial.print(F(" received "));
+        Serial.println(received[i]);
+    }
+    Serial.print(F("Waiting in the bank: "));
+    Serial.print(pendingCount);
+    Serial.print(F(" Throughput: "));
+    Serial.print(getThroughput());
+    Serial.println(F(" SMS/s"));
+}
+
+#endif
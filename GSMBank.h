@@ -0,0 +1,204 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _gsmbank_h_
+#define _gsmbank_h_
+
+#include "GSMSIM300.h"
+
+// The bank both sends and reads messages, so it is not available if any of the two is removed
+#if !defined(GSM_NO_SMS_OUT) && !defined(GSM_NO_SMS_IN)
+
+/** Maximum number of modems in a bank. */
+#ifndef GSM_BANK_MAX_MODEMS
+#define GSM_BANK_MAX_MODEMS       4
+#endif
+
+/** Number of messages that can be queued by GSMBank::sendSMS() and GSMBank::sendLongSMS(). Every entry uses GSM_NUMBER_SIZE + GSM_MESSAGE_SIZE + 6 bytes of RAM. */
+#ifndef GSM_BANK_QUEUE_SIZE
+#define GSM_BANK_QUEUE_SIZE       4
+#endif
+
+/** Number of messages handed to a modem at a time. The other messages wait in the bank, so they can be sent by another modem if it stops running. */
+#ifndef GSM_BANK_MODEM_DEPTH
+#define GSM_BANK_MODEM_DEPTH      1
+#endif
+
+/** Used as the modem of a message that has not been handed to a modem yet. */
+#define GSM_BANK_NONE             0xFF
+
+/** Entry in the message queue of the bank. */
+struct GSMBankEntry {
+	char number[GSM_NUMBER_SIZE];
+	union {
+		/** Copy of the message queued by GSMBank::sendSMS(). */
+		char message[GSM_MESSAGE_SIZE];
+		/** Text queued by GSMBank::sendLongSMS(). It is not copied. */
+		const char *text;
+	};
+	/** Handle returned by GSMBank::sendSMS() or GSMBank::sendLongSMS(). */
+	uint8_t handle;
+	/** One of the SMS_STATUS_* values. */
+	uint8_t status;
+	/** Index of the modem sending the message and its handle on that modem. The modem is GSM_BANK_NONE while the message waits in the bank. */
+	uint8_t modem, modemHandle;
+	/** True if the message is sent in PDU mode. */
+	bool pduMode;
+	/** True if the message has been moved away from a modem that failed it while recovering. */
+	bool rerouted;
+};
+
+/**
+ * Used to drive several GSMSIM300 instances as one. Outgoing messages are sent by the least loaded modem in GSM_RUNNING,
+ * received messages are read from one modem at a time and messages are moved away from a modem that is recovering.
+ * Nothing blocks, so a slow modem never stalls the others.
+ */
+class GSMBank {
+public:
+	/**
+	 * Constructor for the bank.
+	 * @param modems Modems in the bank. The array is not copied.
+	 * @param count  Number of modems. Up to GSM_BANK_MAX_MODEMS is supported.
+	 */
+	GSMBank(GSMSIM300 **modems, uint8_t count);
+
+	/** Used to update every modem and dispatch the queued messages. Call this as often as possible. */
+	void update();
+
+	/**
+	 * Used to queue a message. It is handed to a modem once one is running and has room for it.
+	 * @param  num Number to send the message to.
+	 * @param  mes Message to send. It is copied, so it does not need to be kept.
+	 * @return     Returns a handle used to get the status of the message or 0 if the queue is full.
+	 */
+	uint8_t sendSMS(const char *num, const char *mes);
+
+	/**
+	 * Used to queue a message in PDU mode, see GSMSIM300::sendLongSMS().
+	 * @param  num  Number to send the message to.
+	 * @param  text UTF-8 text to send. It is not copied, so it must not be changed until the message is sent.
+	 * @return      Returns a handle used to get the status of the message or 0 if the queue is full.
+	 */
+	uint8_t sendLongSMS(const char *num, const char *text);
+
+	/**
+	 * Used to get the status of a queued message.
+	 * @param  handle Handle returned by sendSMS() or sendLongSMS().
+	 * @return        Returns one of the SMS_STATUS_* values.
+	 */
+	uint8_t getSMSStatus(uint8_t handle);
+
+	/**
+	 * Used to get the modem sending a message.
+	 * @param  handle Handle returned by sendSMS() or sendLongSMS().
+	 * @return        Returns the index of the modem or GSM_BANK_NONE if the message is waiting in the bank.
+	 */
+	uint8_t getSMSModem(uint8_t handle);
+
+	/**
+	 * Used to set the callback for received messages on every modem. Once set, new messages are drained from one modem at a time.
+	 * @param callback Function called for every message. Use getCurrentModem() to get the modem that received it.
+	 */
+	void setSMSCallback(SMSCallback callback);
+
+	/**
+	 * Used to get the modem being updated.
+	 * @return Returns the index of the modem that called the SMS callback.
+	 */
+	uint8_t getCurrentModem() {
+		return current;
+	};
+
+	/**
+	 * Used to get the number of modems in GSM_RUNNING.
+	 * @return Returns the number of modems that can send messages.
+	 */
+	uint8_t getRunningCount();
+
+	/**
+	 * Used to get the number of messages sent, failed and received since the counters were reset.
+	 * @param  modem Index of the modem or GSM_BANK_NONE for the whole bank.
+	 * @return       Returns the number of messages.
+	 */
+	uint32_t getSentCount(uint8_t modem = GSM_BANK_NONE);
+	uint32_t getFailedCount(uint8_t modem = GSM_BANK_NONE);
+	uint32_t getReceivedCount(uint8_t modem = GSM_BANK_NONE);
+
+	/**
+	 * Used to get the number of messages sent per second by the whole bank since the counters were reset.
+	 * @return Returns the throughput in messages per second.
+	 */
+	float getThroughput();
+
+	/** Used to reset the counters and the time the throughput is measured from. */
+	void resetCounters();
+
+	/** Used to print the state and counters of every modem and the throughput of the bank. */
+	void printStats();
+
+private:
+	/**
+	 * Used to queue a message in the bank.
+	 * @param  num Number to send the message to.
+	 * @return     Returns the new entry or NULL if the queue is full.
+	 */
+	GSMBankEntry *queueSMS(const char *num);
+
+	/** Used to update the status of the messages handed to the modems. */
+	void updateStatus();
+
+	/** Used to hand the oldest queued messages to the least loaded modems. */
+	void dispatch();
+
+	/**
+	 * Used to find the least loaded modem that can take a message.
+	 * @return Returns the index of the modem or GSM_BANK_NONE if every modem is busy or not running.
+	 */
+	uint8_t pickModem();
+
+	/** Used to start draining the messages received by one of the modems. */
+	void updateInbox();
+
+	GSMSIM300 **modems;
+	uint8_t count;
+
+	/** Index of the modem being updated. */
+	uint8_t current;
+
+	/** Queued messages and the indices of the messages waiting in the bank in the order they were queued. */
+	GSMBankEntry queue[GSM_BANK_QUEUE_SIZE];
+	uint8_t pending[GSM_BANK_QUEUE_SIZE];
+	uint8_t pendingHead, pendingCount;
+	uint8_t handle;
+
+	/** Modem to try first, so modems with the same load take turns. */
+	uint8_t nextModem, nextRead;
+
+	/** True if the modem is draining its messages. */
+	bool reading[GSM_BANK_MAX_MODEMS];
+	bool readEnabled;
+
+	uint32_t sent[GSM_BANK_MAX_MODEMS], failed[GSM_BANK_MAX_MODEMS], received[GSM_BANK_MAX_MODEMS];
+
+	/** Clock of the first modem, which the throughput is measured with. */
+	GSMClock *clock;
+	uint32_t startTime;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include "GSMCapture.h"
+
+static void putLong(uint8_t *buffer, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++)
+        buffer[i] = value >> (i * 8);
+}
+
+GSMCapture::GSMCapture(Stream *stream) :
+stream(stream),
+modem(NULL),
+clock(&gsmArduinoClock),
+recording(true)
+{
+    clear();
+}
+
+void GSMCapture::setModem(GSMSIM300 *gsm) {
+    modem = gsm;
+    clock = gsm ? gsm->getClock() : &gsmArduinoClock;
+    clear();
+}
+
+void GSMCapture::clear() {
+    head = count = 0;
+    dropped = 0;
+    startTime = lastTime = clock->millis();
+    startStates = states = modem ? modem->getStates() : 0;
+}
+
+void GSMCapture::mark(uint8_t event) {
+    if (!recording)
+        return;
+    checkStates();
+    record(GSM_CAPTURE_EVENT | GSM_CAPTURE_MARK << 3, 0x07, event);
+}
+
+void GSMCapture::record(uint8_t type, uint8_t maxDelta, uint8_t data) {
+    uint32_t now = clock->millis();
+    uint32_t delta = now - lastTime;
+    lastTime = now;
+    while (delta > maxDelta) {
+        uint16_t time = delta > 0x3FFF ? 0x3FFF : delta;
+        push(GSM_CAPTURE_TIME | time >> 8, time);
+        delta -= time;
+    }
+    push(type | delta, data);
+}
+
+void GSMCapture::push(uint8_t header, uint8_t data) {
+    if (count == GSM_CAPTURE_SIZE) {
+        // The time and the states of the oldest entry are kept, so the remaining entries can still be replayed
+        uint8_t oldHeader = entries[head][0], oldData = entries[head][1];
+        if ((oldHeader & 0xC0) == GSM_CAPTURE_TIME)
+            startTime += (uint16_t)(oldHeader & 0x3F) << 8 | oldData;
+        else if ((oldHeader & 0xC0) == GSM_CAPTURE_EVENT) {
+            startTime += oldHeader & 0x07;
+            uint8_t kind = (oldHeader >> 3) & 0x07;
+            if (kind != GSM_CAPTURE_MARK)
+                startStates = (startStates & ~(0xFFUL << (kind * 8))) | (uint32_t)oldData << (kind * 8);
+        } else
+            startTime += oldHeader & 0x3F;
+        head = (head + 1) % GSM_CAPTURE_SIZE;
+        count--;
+        dropped++;
+    }
+    uint16_t i = (head + count) % GSM_CAPTURE_SIZE;
+    entries[i][0] = header;
+    entries[i][1] = data;
+    count++;
+}
+
+void GSMCapture::checkStates() {
+    if (modem == NULL)
+        return;
+    uint32_t newStates = modem->getStates();
+    if (newStates == states)
+        return;
+    for (uint8_t kind = GSM_CAPTURE_GSM_STATE; kind <= GSM_CAPTURE_INBOX_STATE; kind++) {
+        uint8_t state = newStates >> (kind * 8);
+        if (state != (uint8_t)(states >> (kind * 8)))
+            record(GSM_CAPTURE_EVENT | kind << 3, 0x07, state);
+    }
+    states = newStates;
+}
+
+void GSMCapture::dump(Print *out) {
+    uint8_t header[GSM_CAPTURE_HEADER_SIZE] = { 'G', 'S', 'M', 'C', GSM_CAPTURE_VERSION, modem != NULL };
+    putLong(header + 6, startTime);
+    putLong(header + 10, startStates);
+    putLong(header + 14, dropped);
+    header[18] = count;
+    header[19] = count >> 8;
+    out->write(header, sizeof(header));
+    for (uint16_t i = 0; i < count; i++)
+        out->write(entries[(head + i) % GSM_CAPTURE_SIZE], 2);
+}
+
+size_t GSMCapture::write(uint8_t c) {
+    if (recording) {
+        checkStates();
+        record(GSM_CAPTURE_TX, 0x3F, c);
+    }
+    return stream->write(c);
+}
+
+size_t GSMCapture::write(const uint8_t *buffer, size_t size) {
+    if (recording) {
+        checkStates();
+        for (size_t i = 0; i < size; i++)
+            record(GSM_CAPTURE_TX, 0x3F, buffer[i]);
+    }
+    return stream->write(buffer, size); // The bytes are passed on at once, so a buffered serial port still writes them in one batch
+}
+
+int GSMCapture::available() {
+    if (recording)
+        checkStates();
+    return stream->available();
+}
+
+int GSMCapture::read() {
+    if (recording)
+        checkStates();
+    int c = stream->read();
+    if (c != -1 && recording)
+        record(GSM_CAPTURE_RX, 0x3F, c);
+    return c;
+}
+
+int GSMCapture::peek() {
+    return stream->peek();
+}
+
+void GSMCapture::flush() {
+    stream->flush();
+}
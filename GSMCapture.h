@@ -0,0 +1,157 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _gsmcapture_h_
+#define _gsmcapture_h_
+
+#include "GSMSIM300.h"
+
+/** Number of entries kept in the ring buffer. Every entry uses 2 bytes of RAM. The oldest entries are overwritten when it is full. Maximum is 32767. */
+#ifndef GSM_CAPTURE_SIZE
+#define GSM_CAPTURE_SIZE          128
+#endif
+
+/** Version of the format written by GSMCapture::dump(). */
+#define GSM_CAPTURE_VERSION       1
+
+/** Size of the header written by GSMCapture::dump() before the entries. */
+#define GSM_CAPTURE_HEADER_SIZE   20
+
+/**
+ * Type in the upper two bits of the first byte of an entry. The second byte is the data.
+ * GSM_CAPTURE_RX and GSM_CAPTURE_TX: the lower 6 bits are the time in ms since the previous entry and the data is the byte.
+ * GSM_CAPTURE_TIME: the lower 6 bits and the data are the upper and lower byte of the time in ms since the previous entry.
+ * GSM_CAPTURE_EVENT: bit 3-5 is one of the GSM_CAPTURE_* kinds, the lower 3 bits are the time in ms since the previous entry and the data is the new state or the mark.
+ */
+#define GSM_CAPTURE_RX            0x00 // Byte received from the GSM module
+#define GSM_CAPTURE_TX            0x40 // Byte sent to the GSM module
+#define GSM_CAPTURE_TIME          0x80
+#define GSM_CAPTURE_EVENT         0xC0
+
+/** Kind of a GSM_CAPTURE_EVENT entry. The states are only recorded if GSMCapture::setModem() is used. */
+#define GSM_CAPTURE_GSM_STATE     0
+#define GSM_CAPTURE_SMS_STATE     1
+#define GSM_CAPTURE_CALL_STATE    2
+#define GSM_CAPTURE_INBOX_STATE   3
+#define GSM_CAPTURE_MARK          4 // Set by GSMCapture::mark()
+
+/**
+ * Stream placed between the library and the serial port that records every byte received and sent with a timestamp.
+ * The bytes are kept in a ring buffer of GSM_CAPTURE_SIZE entries of 2 bytes, and the time is stored as the difference to the previous entry.
+ * The state transitions of the library and marks set by the sketch are recorded as well, so the capture can be replayed
+ * by the harness in extras/host. dump() writes the header followed by the entries from the oldest to the newest:
+ * "GSMC", version, 1 if the states are recorded, the time in ms of the oldest entry, the states of the library before the oldest entry,
+ * the number of entries overwritten and the number of entries. Every number is little-endian and the times and states are 4 bytes,
+ * while the number of entries is 2 bytes.
+ */
+class GSMCapture : public Stream {
+public:
+	/**
+	 * Constructor for the capture. It starts recording right away.
+	 * @param stream Serial instance connected to the GSM module.
+	 */
+	GSMCapture(Stream *stream);
+
+	/**
+	 * Used to record the state transitions of the library as well. Call it before the first call to update().
+	 * The capture is cleared, so the states before the oldest entry are known. The timestamps are taken from the clock of the library from now on.
+	 * @param gsm Instance using this capture as its Stream or NULL to only record the bytes.
+	 */
+	void setModem(GSMSIM300 *gsm);
+
+	/**
+	 * Used to record an event of the sketch, i.e. the request made by a command read from the serial monitor.
+	 * The harness in extras/host makes the same request when the mark is replayed.
+	 * @param event Value of the mark.
+	 */
+	void mark(uint8_t event);
+
+	/**
+	 * Used to stop or continue the recording, i.e. to keep the entries leading up to a fault from being overwritten.
+	 * @param enable True to record and false to stop.
+	 */
+	void setRecording(bool enable) {
+		recording = enable;
+	};
+
+	/** Used to remove every entry. */
+	void clear();
+
+	/**
+	 * Used to get the number of entries in the ring buffer.
+	 * @return Returns the number of entries.
+	 */
+	uint16_t getCount() {
+		return count;
+	};
+
+	/**
+	 * Used to get the number of entries overwritten since the capture was cleared.
+	 * @return Returns the number of entries.
+	 */
+	uint32_t getDropped() {
+		return dropped;
+	};
+
+	/**
+	 * Used to write the capture in the binary format described above, i.e. to Serial or to a file on an SD card.
+	 * @param out Where to write the capture.
+	 */
+	void dump(Print *out);
+
+	/** Stream implementation. The bytes are passed on to the serial instance. */
+	using Print::write;
+	size_t write(uint8_t c);
+	size_t write(const uint8_t *buffer, size_t size);
+	int available();
+	int read();
+	int peek();
+	void flush();
+
+private:
+	/**
+	 * Used to add an entry, preceded by GSM_CAPTURE_TIME entries if the time since the previous entry does not fit.
+	 * @param type     GSM_CAPTURE_RX, GSM_CAPTURE_TX or GSM_CAPTURE_EVENT with the kind.
+	 * @param maxDelta Highest time that fits in the entry.
+	 * @param data     Data of the entry.
+	 */
+	void record(uint8_t type, uint8_t maxDelta, uint8_t data);
+
+	/** Used to add an entry to the ring buffer. The oldest entry is overwritten if it is full. */
+	void push(uint8_t header, uint8_t data);
+
+	/** Used to record the state machines that changed since the last call. */
+	void checkStates();
+
+	Stream *stream;
+	GSMSIM300 *modem;
+	GSMClock *clock;
+
+	uint8_t entries[GSM_CAPTURE_SIZE][2];
+	uint16_t head, count;
+	uint32_t dropped;
+
+	/** Time of the oldest entry and of the newest entry. */
+	uint32_t startTime, lastTime;
+
+	/** States of the library before the oldest entry and after the newest entry. */
+	uint32_t startStates, states;
+
+	bool recording;
+};
+
+#endif
@@ -0,0 +1,378 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include "GSMOutbox.h"
+
+#ifndef GSM_NO_SMS_OUT
+
+// Layout of a record: checksum, sequence number, message reference, state and the number and message terminated by '\0'
+#define RECORD_CRC                0
+#define RECORD_SEQUENCE           2
+#define RECORD_REFERENCE          4
+#define RECORD_STATE              5
+#define RECORD_NUMBER             6
+
+// The state byte of a record that has not been acknowledged, so an erased EEPROM does not need to be written
+#define RECORD_PENDING            0xFF
+
+GSMOutbox::GSMOutbox(GSMSIM300 *gsm, GSMLogStorage *storage) :
+replayed(0),
+retries(0),
+sent(0),
+records(0),
+acknowledgements(0),
+commits(0),
+gsm(gsm),
+storage(storage),
+stagedCount(0),
+sending(GSM_OUTBOX_NONE),
+nextSlot(0),
+nextSequence(1),
+changeTime(0)
+{
+    memset(slots, 0, sizeof(slots));
+}
+
+bool GSMOutbox::begin() {
+    if (storage->size() < (uint32_t)GSM_OUTBOX_SLOTS * GSM_OUTBOX_SLOT_SIZE)
+        return false;
+
+    // The sequence numbers wrap around, so the newest record is found by comparing the differences
+    char number[GSM_NUMBER_SIZE], message[GSM_MESSAGE_SIZE];
+    bool found = false;
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        GSMOutboxSlot *slot = &slots[i];
+        uint8_t state;
+        memset(slot, 0, sizeof(GSMOutboxSlot));
+        if (!readRecord(i, number, message, &state))
+            continue; // Never written or only partly written before a reset
+        if (!found || (int16_t)(slot->sequence - nextSequence) >= 0) {
+            nextSequence = slot->sequence + 1;
+            nextSlot = (i + 1) % GSM_OUTBOX_SLOTS;
+            found = true;
+        }
+        if (state == RECORD_PENDING) {
+            slot->state = OUTBOX_PENDING;
+            replayed++;
+        } else
+            slot->state = state == OUTBOX_FAILED ? OUTBOX_FAILED : OUTBOX_SENT;
+    }
+    if (nextSequence == 0) // 0 is used to indicate an error
+        nextSequence = 1;
+#ifdef DEBUG
+    Serial.print(F("Outbox messages replayed: "));
+    Serial.println(replayed);
+#endif
+    return true;
+}
+
+void GSMOutbox::update() {
+    gsm->update();
+    dispatch();
+    if (flushDeadline() == 0)
+        flush();
+}
+
+uint16_t GSMOutbox::sendSMS(const char *num, const char *mes) {
+    if (stagedCount >= GSM_OUTBOX_BATCH)
+        return 0;
+    // A slot can be reused once its message has been sent or given up. Slots with an acknowledgement that has not been written yet are only used if there are no others.
+    uint8_t index = GSM_OUTBOX_NONE;
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        uint8_t next = (nextSlot + i) % GSM_OUTBOX_SLOTS;
+        GSMOutboxSlot *slot = &slots[next];
+        if (slot->state != OUTBOX_FREE && slot->state != OUTBOX_SENT && slot->state != OUTBOX_FAILED)
+            continue;
+        if (index == GSM_OUTBOX_NONE || slots[index].dirty)
+            index = next;
+        if (!slot->dirty)
+            break;
+    }
+    if (index == GSM_OUTBOX_NONE) {
+#ifdef DEBUG
+        Serial.println(F("Outbox is full"));
+#endif
+        return 0;
+    }
+    // The acknowledgement is written first, as the message would be sent again if the MCU is reset before the new record is written
+    if (slots[index].dirty && !flush())
+        return 0;
+    nextSlot = (index + 1) % GSM_OUTBOX_SLOTS;
+    if (flushDeadline() == GSM_NO_DEADLINE) // The first change of a new batch
+        changeTime = gsm->getClock()->millis();
+
+    GSMOutboxEntry *entry = &staged[stagedCount++];
+    entry->slot = index;
+    GSMSIM300::copyField(entry->number, sizeof(entry->number), num);
+    GSMSIM300::copyField(entry->message, sizeof(entry->message), mes);
+
+    GSMOutboxSlot *slot = &slots[index];
+    memset(slot, 0, sizeof(GSMOutboxSlot));
+    slot->sequence = nextSequence;
+    slot->state = OUTBOX_STAGED;
+    if (++nextSequence == 0)
+        nextSequence = 1;
+    return slot->sequence;
+}
+
+uint8_t GSMOutbox::getSMSStatus(uint16_t sequence) {
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        if (sequence == 0 || slots[i].sequence != sequence)
+            continue;
+        switch (slots[i].state) {
+            case OUTBOX_STAGED:
+            case OUTBOX_PENDING:
+                return SMS_STATUS_QUEUED;
+            case OUTBOX_SENDING:
+                return SMS_STATUS_SENDING;
+            case OUTBOX_SENT:
+                return SMS_STATUS_SENT;
+            case OUTBOX_FAILED:
+                return SMS_STATUS_FAILED;
+        }
+    }
+    return SMS_STATUS_NONE;
+}
+
+int16_t GSMOutbox::getSMSReference(uint16_t sequence) {
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        if (sequence != 0 && slots[i].sequence == sequence)
+            return slots[i].state == OUTBOX_SENT ? slots[i].reference : -1;
+    }
+    return -1;
+}
+
+uint8_t GSMOutbox::getQueueCount() {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        if (slots[i].state == OUTBOX_STAGED || slots[i].state == OUTBOX_PENDING || slots[i].state == OUTBOX_SENDING)
+            count++;
+    }
+    return count;
+}
+
+void GSMOutbox::dispatch() {
+    if (sending != GSM_OUTBOX_NONE) {
+        GSMOutboxSlot *slot = &slots[sending];
+        uint8_t status = gsm->getSMSStatus(slot->handle);
+        if (status == SMS_STATUS_QUEUED || status == SMS_STATUS_SENDING)
+            return;
+        if (slot->attempts < 0xFF && status != SMS_STATUS_SENT)
+            slot->attempts++;
+        if (status == SMS_STATUS_SENT) {
+            slot->state = OUTBOX_SENT;
+            slot->reference = gsm->getSMSReference(slot->handle);
+            sent++;
+        }
+#if GSM_OUTBOX_ATTEMPTS > 0
+        else if (slot->attempts >= GSM_OUTBOX_ATTEMPTS) {
+#ifdef DEBUG
+            Serial.println(F("Outbox message given up"));
+#endif
+            slot->state = OUTBOX_FAILED;
+        }
+#endif
+        else {
+            uint32_t backoff = GSM_OUTBOX_RETRY_MIN;
+            for (uint8_t i = 1; i < slot->attempts && backoff < GSM_OUTBOX_RETRY_MAX; i++)
+                backoff *= 2;
+            if (backoff > GSM_OUTBOX_RETRY_MAX)
+                backoff = GSM_OUTBOX_RETRY_MAX;
+            slot->state = OUTBOX_PENDING;
+            slot->retryTime = gsm->getClock()->millis() + backoff;
+            retries++;
+#ifdef DEBUG
+            Serial.print(F("Outbox message retried in ms: "));
+            Serial.println(backoff);
+#endif
+            sending = GSM_OUTBOX_NONE;
+            return;
+        }
+        // The acknowledgement is written with the next batch
+        if (flushDeadline() == GSM_NO_DEADLINE)
+            changeTime = gsm->getClock()->millis();
+        slot->dirty = true;
+        sending = GSM_OUTBOX_NONE;
+    }
+
+    // The oldest message that is not waiting for its backoff is sent first, one at a time
+    if (gsm->getState() != GSM_RUNNING || !gsm->isRegistered() || gsm->getSMSQueueCount() >= SMS_QUEUE_SIZE)
+        return;
+    uint8_t next = GSM_OUTBOX_NONE;
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        GSMOutboxSlot *slot = &slots[i];
+        if (slot->state != OUTBOX_PENDING || (slot->attempts > 0 && (int32_t)(gsm->getClock()->millis() - slot->retryTime) < 0))
+            continue;
+        if (next == GSM_OUTBOX_NONE || (int16_t)(slot->sequence - slots[next].sequence) < 0)
+            next = i;
+    }
+    if (next == GSM_OUTBOX_NONE)
+        return;
+
+    char number[GSM_NUMBER_SIZE], message[GSM_MESSAGE_SIZE];
+    uint8_t state;
+    GSMOutboxSlot *slot = &slots[next];
+    if (!readRecord(next, number, message, &state)) { // The storage has been changed by something else
+        slot->state = OUTBOX_FREE;
+        return;
+    }
+    slot->handle = gsm->sendSMS(number, message);
+    if (slot->handle == 0)
+        return;
+    slot->state = OUTBOX_SENDING;
+    sending = next;
+}
+
+uint32_t GSMOutbox::flushDeadline() {
+    bool changed = stagedCount > 0;
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS && !changed; i++)
+        changed = slots[i].dirty;
+    if (!changed)
+        return GSM_NO_DEADLINE;
+    // A full batch is written straight away, as sendSMS() can not stage more messages
+    if (stagedCount >= GSM_OUTBOX_BATCH)
+        return 0;
+    uint32_t elapsed = gsm->getClock()->millis() - changeTime;
+    return elapsed >= GSM_OUTBOX_FLUSH_DELAY ? 0 : GSM_OUTBOX_FLUSH_DELAY - elapsed;
+}
+
+bool GSMOutbox::flush() {
+    bool success = true;
+    for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+        GSMOutboxSlot *slot = &slots[i];
+        if (slot->dirty) {
+            if (!writeAcknowledgement(i))
+                success = false;
+            slot->dirty = false;
+        }
+    }
+    // A staged message replaces the acknowledgement of the message that used its slot before
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < stagedCount; i++) {
+        GSMOutboxEntry *entry = &staged[i];
+        if (writeRecord(entry))
+            slots[entry->slot].state = OUTBOX_PENDING;
+        else {
+            success = false;
+            if (count != i)
+                memcpy(&staged[count], entry, sizeof(GSMOutboxEntry));
+            count++; // It is written with the next batch
+        }
+    }
+    stagedCount = count;
+    if (!storage->commit())
+        success = false;
+    commits++;
+    changeTime = gsm->getClock()->millis();
+#ifdef DEBUG
+    if (!success)
+        Serial.println(F("Outbox could not be written"));
+#endif
+    return success;
+}
+
+uint32_t GSMOutbox::getNextDeadline() {
+    uint32_t deadline = gsm->getNextDeadline();
+    uint32_t wait = flushDeadline();
+    if (wait < deadline)
+        deadline = wait;
+    if (sending == GSM_OUTBOX_NONE && gsm->getState() == GSM_RUNNING && gsm->isRegistered() && gsm->getSMSQueueCount() < SMS_QUEUE_SIZE) {
+        for (uint8_t i = 0; i < GSM_OUTBOX_SLOTS; i++) {
+            GSMOutboxSlot *slot = &slots[i];
+            if (slot->state != OUTBOX_PENDING)
+                continue;
+            int32_t remaining = slot->attempts > 0 ? (int32_t)(slot->retryTime - gsm->getClock()->millis()) : 0;
+            wait = remaining > 0 ? remaining : 0;
+            if (wait < deadline)
+                deadline = wait;
+        }
+    }
+    return deadline;
+}
+
+bool GSMOutbox::readRecord(uint8_t slot, char *number, char *message, uint8_t *state) {
+    uint32_t address = (uint32_t)slot * GSM_OUTBOX_SLOT_SIZE;
+    uint8_t header[RECORD_NUMBER];
+    if (!storage->read(address, header, sizeof(header)) || !storage->read(address + RECORD_NUMBER, (uint8_t *)number, GSM_NUMBER_SIZE))
+        return false;
+    uint8_t *end = (uint8_t *)memchr(number, '\0', GSM_NUMBER_SIZE);
+    if (end == NULL)
+        return false;
+    uint8_t numberLength = end - (uint8_t *)number + 1;
+    if (!storage->read(address + RECORD_NUMBER + numberLength, (uint8_t *)message, GSM_MESSAGE_SIZE) || memchr(message, '\0', GSM_MESSAGE_SIZE) == NULL)
+        return false;
+
+    uint16_t crc = crc16(0xFFFF, header + RECORD_SEQUENCE, 2);
+    crc = crc16(crc, (const uint8_t *)number, numberLength);
+    crc = crc16(crc, (const uint8_t *)message, strlen(message) + 1);
+    uint16_t sequence = header[RECORD_SEQUENCE] | (header[RECORD_SEQUENCE + 1] << 8);
+    if (sequence == 0 || crc != (header[RECORD_CRC] | (header[RECORD_CRC + 1] << 8)))
+        return false;
+    slots[slot].sequence = sequence;
+    slots[slot].reference = header[RECORD_REFERENCE];
+    *state = header[RECORD_STATE];
+    return true;
+}
+
+bool GSMOutbox::writeRecord(GSMOutboxEntry *entry) {
+    GSMOutboxSlot *slot = &slots[entry->slot];
+    uint32_t address = (uint32_t)entry->slot * GSM_OUTBOX_SLOT_SIZE;
+    uint8_t numberLength = strlen(entry->number) + 1;
+    uint8_t messageLength = strlen(entry->message) + 1;
+    uint8_t header[RECORD_NUMBER];
+    header[RECORD_SEQUENCE] = slot->sequence & 0xFF;
+    header[RECORD_SEQUENCE + 1] = slot->sequence >> 8;
+    header[RECORD_REFERENCE] = 0xFF;
+    header[RECORD_STATE] = RECORD_PENDING;
+    uint16_t crc = crc16(0xFFFF, header + RECORD_SEQUENCE, 2);
+    crc = crc16(crc, (const uint8_t *)entry->number, numberLength);
+    crc = crc16(crc, (const uint8_t *)entry->message, messageLength);
+
+    // The inverted checksum makes the slot invalid until the whole record has been written
+    header[RECORD_CRC] = ~crc & 0xFF;
+    header[RECORD_CRC + 1] = ~crc >> 8;
+    if (!storage->write(address, header, sizeof(header)) ||
+        !storage->write(address + RECORD_NUMBER, (const uint8_t *)entry->number, numberLength) ||
+        !storage->write(address + RECORD_NUMBER + numberLength, (const uint8_t *)entry->message, messageLength))
+        return false;
+    header[RECORD_CRC] = crc & 0xFF;
+    header[RECORD_CRC + 1] = crc >> 8;
+    if (!storage->write(address + RECORD_CRC, header + RECORD_CRC, 2))
+        return false;
+    records++;
+    return true;
+}
+
+bool GSMOutbox::writeAcknowledgement(uint8_t slot) {
+    uint32_t address = (uint32_t)slot * GSM_OUTBOX_SLOT_SIZE;
+    uint8_t state = slots[slot].state;
+    if (!storage->write(address + RECORD_REFERENCE, &slots[slot].reference, 1) || !storage->write(address + RECORD_STATE, &state, 1))
+        return false;
+    acknowledgements++;
+    return true;
+}
+
+uint16_t GSMOutbox::crc16(uint16_t crc, const uint8_t *data, uint16_t length) {
+    while (length--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+#endif
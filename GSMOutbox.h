@@ -0,0 +1,297 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _gsmoutbox_h_
+#define _gsmoutbox_h_
+
+#include "GSMSIM300.h"
+
+#ifndef GSM_NO_SMS_OUT
+
+#ifdef __AVR__
+#include <avr/eeprom.h>
+#endif
+
+/** Number of messages kept in the log. Every slot uses GSM_OUTBOX_SLOT_SIZE bytes of storage and 11 bytes of RAM. */
+#ifndef GSM_OUTBOX_SLOTS
+#define GSM_OUTBOX_SLOTS          4
+#endif
+
+/** Number of new messages kept in RAM until they are written to the log. Every entry uses GSM_NUMBER_SIZE + GSM_MESSAGE_SIZE + 1 bytes of RAM. */
+#ifndef GSM_OUTBOX_BATCH
+#define GSM_OUTBOX_BATCH          2
+#endif
+
+/** Maximum time in ms a change waits in RAM, so changes made close together are written at once. A new message is not sent before it is written. */
+#ifndef GSM_OUTBOX_FLUSH_DELAY
+#define GSM_OUTBOX_FLUSH_DELAY    2000UL
+#endif
+
+/** Time in ms before a failed message is sent again. It is doubled after every attempt up to GSM_OUTBOX_RETRY_MAX. */
+#ifndef GSM_OUTBOX_RETRY_MIN
+#define GSM_OUTBOX_RETRY_MIN      5000UL
+#endif
+#ifndef GSM_OUTBOX_RETRY_MAX
+#define GSM_OUTBOX_RETRY_MAX      300000UL
+#endif
+
+/** Number of times a message is sent before it is given up. Set to 0 to retry until it is sent. */
+#ifndef GSM_OUTBOX_ATTEMPTS
+#define GSM_OUTBOX_ATTEMPTS       10
+#endif
+
+/** Bytes of storage used by a slot: checksum, sequence number, message reference, state, number and message. */
+#define GSM_OUTBOX_SLOT_SIZE      (6 + GSM_NUMBER_SIZE + GSM_MESSAGE_SIZE)
+
+/** Used as the slot of a message that is not being sent. */
+#define GSM_OUTBOX_NONE           0xFF
+
+/** State of a slot in the log */
+#define OUTBOX_FREE               0
+#define OUTBOX_STAGED             1 // Waiting in RAM to be written
+#define OUTBOX_PENDING            2 // Written and waiting to be sent
+#define OUTBOX_SENDING            3
+#define OUTBOX_SENT               4
+#define OUTBOX_FAILED             5
+
+/**
+ * Storage used by GSMOutbox, i.e. the EEPROM, a flash page or a file.
+ * Writes do not need to be atomic, as a record that is only partly written is detected by its checksum.
+ */
+class GSMLogStorage {
+public:
+	/**
+	 * Used to get the size of the storage.
+	 * @return Returns the number of bytes that can be used.
+	 */
+	virtual uint32_t size() = 0;
+
+	/**
+	 * Used to read from the storage.
+	 * @param  address Offset of the first byte.
+	 * @param  data    Buffer for the bytes.
+	 * @param  length  Number of bytes to read.
+	 * @return         Returns true if the bytes were read.
+	 */
+	virtual bool read(uint32_t address, uint8_t *data, uint16_t length) = 0;
+
+	/**
+	 * Used to write to the storage.
+	 * @param  address Offset of the first byte.
+	 * @param  data    Bytes to write.
+	 * @param  length  Number of bytes to write.
+	 * @return         Returns true if the bytes were written.
+	 */
+	virtual bool write(uint32_t address, const uint8_t *data, uint16_t length) = 0;
+
+	/**
+	 * Used to make the writes since the last call durable, i.e. fsync() of a file. It is called once for every batch of writes.
+	 * @return Returns true if the writes are durable.
+	 */
+	virtual bool commit() {
+		return true;
+	};
+};
+
+#ifdef __AVR__
+/** Storage in the internal EEPROM of an AVR. Bytes that already have the right value are not written again. */
+class GSMEEPROMStorage : public GSMLogStorage {
+public:
+	/**
+	 * Constructor for the storage.
+	 * @param offset First byte of the EEPROM used by the log.
+	 * @param length Number of bytes used by the log.
+	 */
+	GSMEEPROMStorage(uint16_t offset = 0, uint16_t length = E2END + 1) : offset(offset), length(length) {};
+
+	uint32_t size() {
+		return length;
+	};
+	bool read(uint32_t address, uint8_t *data, uint16_t count) {
+		eeprom_read_block(data, (const void *)(uintptr_t)(offset + address), count);
+		return true;
+	};
+	bool write(uint32_t address, const uint8_t *data, uint16_t count) {
+		eeprom_update_block(data, (void *)(uintptr_t)(offset + address), count);
+		return true;
+	};
+
+private:
+	uint16_t offset, length;
+};
+#endif
+
+/** State of a slot in the log kept in RAM. */
+struct GSMOutboxSlot {
+	/** Sequence number returned by GSMOutbox::sendSMS(). */
+	uint16_t sequence;
+	/** One of the OUTBOX_* values. */
+	uint8_t state;
+	/** Handle of the message in the modem while it is being sent. */
+	uint8_t handle;
+	/** Number of times sending has failed. */
+	uint8_t attempts;
+	/** Message reference given by the network. */
+	uint8_t reference;
+	/** True if the message has been sent or given up, but it is not written to the log yet. */
+	bool dirty;
+	/** Time in ms the message can be sent again. */
+	uint32_t retryTime;
+};
+
+/** Message waiting in RAM to be written to the log. */
+struct GSMOutboxEntry {
+	uint8_t slot;
+	char number[GSM_NUMBER_SIZE];
+	char message[GSM_MESSAGE_SIZE];
+};
+
+/**
+ * Used to send messages that survive a reset of the MCU. Every message is written to an append-only log of sequence numbered
+ * records before it is handed to the modem, and it is marked as sent once the network has accepted it with "+CMGS: <mr>".
+ * The messages that are not marked as sent are read back by begin() and sent again. A failed message is retried with an
+ * exponential backoff. New messages and acknowledgements are written in batches, so the storage is only committed once for several changes.
+ * A message is sent again after a reset if it was accepted by the network less than GSM_OUTBOX_FLUSH_DELAY ms before the reset,
+ * and a message queued less than GSM_OUTBOX_FLUSH_DELAY ms before the reset is lost unless flush() has been called.
+ */
+class GSMOutbox {
+public:
+	/**
+	 * Constructor for the outbox.
+	 * @param gsm     Modem used to send the messages.
+	 * @param storage Storage of the log. It must have room for GSM_OUTBOX_SLOTS * GSM_OUTBOX_SLOT_SIZE bytes.
+	 */
+	GSMOutbox(GSMSIM300 *gsm, GSMLogStorage *storage);
+
+	/**
+	 * Used to read the log. The messages that were not sent before the reset are queued again.
+	 * @return Returns false if the storage is too small.
+	 */
+	bool begin();
+
+	/** Used to update the modem, send the logged messages and write the changes to the log. Call this instead of GSMSIM300::update(). */
+	void update();
+
+	/**
+	 * Used to queue a message. It is written to the log before it is sent.
+	 * @param  num Number to send the message to.
+	 * @param  mes Message to send. Maximum is GSM_MESSAGE_SIZE - 1 characters.
+	 * @return     Returns the sequence number of the message or 0 if the log is full.
+	 */
+	uint16_t sendSMS(const char *num, const char *mes);
+
+	/**
+	 * Used to get the status of a message.
+	 * @param  sequence Sequence number returned by sendSMS().
+	 * @return          Returns one of the SMS_STATUS_* values. SMS_STATUS_NONE is returned if the slot has been reused by a newer message.
+	 */
+	uint8_t getSMSStatus(uint16_t sequence);
+
+	/**
+	 * Used to get the reference the network gave a sent message.
+	 * @param  sequence Sequence number returned by sendSMS().
+	 * @return          Returns the message reference or -1 if the message has not been sent.
+	 */
+	int16_t getSMSReference(uint16_t sequence);
+
+	/**
+	 * Used to get the number of messages that have not been sent or given up.
+	 * @return Returns the number of messages.
+	 */
+	uint8_t getQueueCount();
+
+	/**
+	 * Used to write the changes waiting in RAM to the log, i.e. before the power is removed.
+	 * @return Returns false if the storage failed.
+	 */
+	bool flush();
+
+	/**
+	 * Used to get the time until update() needs to be called, see GSMSIM300::getNextDeadline().
+	 * @return Returns the time in ms, 0 if update() has more to do right away or GSM_NO_DEADLINE if it is only waiting for the GSM module.
+	 */
+	uint32_t getNextDeadline();
+
+	/** Number of messages read back by begin(), retried after a failure and sent. */
+	uint16_t replayed, retries, sent;
+	/** Number of records and acknowledgements written and the number of times the storage was committed. */
+	uint16_t records, acknowledgements, commits;
+
+private:
+	/** Used to check the message being sent and hand the next one to the modem. */
+	void dispatch();
+
+	/**
+	 * Used to check if the changes waiting in RAM should be written.
+	 * @return Returns the time in ms until they should be written, 0 if they should be written now or GSM_NO_DEADLINE if there are none.
+	 */
+	uint32_t flushDeadline();
+
+	/**
+	 * Used to read a record and check its checksum.
+	 * @param  slot    Slot to read.
+	 * @param  number  Buffer of GSM_NUMBER_SIZE bytes for the number.
+	 * @param  message Buffer of GSM_MESSAGE_SIZE bytes for the message.
+	 * @param  state   Set to the state byte of the record.
+	 * @return         Returns true if the record is valid.
+	 */
+	bool readRecord(uint8_t slot, char *number, char *message, uint8_t *state);
+
+	/**
+	 * Used to write a new message to the log. The checksum is written last, so a record that is only partly written is invalid.
+	 * @param  entry Message waiting in RAM.
+	 * @return       Returns true if the record was written.
+	 */
+	bool writeRecord(GSMOutboxEntry *entry);
+
+	/**
+	 * Used to mark a message as sent or given up in the log. The message reference is written before the state byte.
+	 * @param  slot Slot of the message.
+	 * @return      Returns true if the acknowledgement was written.
+	 */
+	bool writeAcknowledgement(uint8_t slot);
+
+	/**
+	 * Used to update a CRC-16-CCITT checksum.
+	 * @param  crc    Checksum so far.
+	 * @param  data   Bytes to add.
+	 * @param  length Number of bytes.
+	 * @return        Returns the new checksum.
+	 */
+	static uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t length);
+
+	GSMSIM300 *gsm;
+	GSMLogStorage *storage;
+
+	GSMOutboxSlot slots[GSM_OUTBOX_SLOTS];
+	GSMOutboxEntry staged[GSM_OUTBOX_BATCH];
+	uint8_t stagedCount;
+
+	/** Slot of the message being sent or GSM_OUTBOX_NONE. */
+	uint8_t sending;
+
+	/** Slot tried first by sendSMS(), so the slots are used in turn. */
+	uint8_t nextSlot;
+	uint16_t nextSequence;
+
+	/** Time in ms the oldest change waiting in RAM was made. */
+	uint32_t changeTime;
+};
+
+#endif
+
+#endif
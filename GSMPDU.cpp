@@ -0,0 +1,444 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+#include "GSMPDU.h"
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#endif
+
+// GSM 03.38 default alphabet - the Unicode character of every septet
+static const uint16_t gsm7ToUnicode[128] PROGMEM = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x001B, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0
+};
+
+// Septet of every ASCII character - 0xFF if it can not be encoded and bit 7 is set if it is in the extension table
+static const uint8_t asciiToGSM7[128] PROGMEM = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x0A, 0xFF, 0x8A, 0x0D, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x20, 0x21, 0x22, 0x23, 0x02, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x00, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0xBC, 0xAF, 0xBE, 0x94, 0x11,
+    0xFF, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0xA8, 0xC0, 0xA9, 0xBD, 0xFF
+};
+
+// GSM 03.38 extension table, which is used after the escape septet 0x1B
+#define GSM7_ESCAPE 0x1B
+#define GSM7_EXTENSIONS 10
+static const uint8_t gsm7Extension[GSM7_EXTENSIONS] PROGMEM = { 0x0A, 0x14, 0x28, 0x29, 0x2F, 0x3C, 0x3D, 0x3E, 0x40, 0x65 };
+static const uint16_t gsm7ExtensionUnicode[GSM7_EXTENSIONS] PROGMEM = { 0x000C, 0x005E, 0x007B, 0x007D, 0x005C, 0x005B, 0x007E, 0x005D, 0x007C, 0x20AC };
+
+// Decodes a single UTF-8 character - characters outside the Basic Multilingual Plane and invalid sequences are returned as U+FFFD
+uint16_t GSMPDU::readChar(const char *text, uint16_t *pos) {
+    uint8_t c = text[(*pos)++];
+    if (c < 0x80)
+        return c;
+    uint8_t length = (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : 0;
+    uint16_t value = c & (0x3F >> length);
+    for (uint8_t i = 0; i < length; i++) {
+        c = text[*pos];
+        if ((c & 0xC0) != 0x80)
+            return 0xFFFD;
+        (*pos)++;
+        value = (value << 6) | (c & 0x3F);
+    }
+    return length == 0 || length == 3 ? 0xFFFD : value;
+}
+
+// Returns the septet, the septet with bit 8 set if it is in the extension table or -1 if it can not be encoded
+int16_t GSMPDU::toGSM7(uint16_t c) {
+    if (c < 0x80) {
+        uint8_t septet = pgm_read_byte(&asciiToGSM7[c]);
+        if (septet == 0xFF)
+            return -1;
+        return septet & 0x80 ? 0x100 | (septet & 0x7F) : septet;
+    }
+    for (uint8_t i = 0; i < 128; i++) {
+        if (pgm_read_word(&gsm7ToUnicode[i]) == c)
+            return i;
+    }
+    for (uint8_t i = 0; i < GSM7_EXTENSIONS; i++) {
+        if (pgm_read_word(&gsm7ExtensionUnicode[i]) == c)
+            return 0x100 | pgm_read_byte(&gsm7Extension[i]);
+    }
+    return -1;
+}
+
+uint16_t GSMPDU::fromGSM7(uint8_t septet, bool escape) {
+    if (escape) {
+        for (uint8_t i = 0; i < GSM7_EXTENSIONS; i++) {
+            if (pgm_read_byte(&gsm7Extension[i]) == septet)
+                return pgm_read_word(&gsm7ExtensionUnicode[i]);
+        }
+        // Unknown extensions are shown as the character of the default alphabet
+    }
+    return pgm_read_word(&gsm7ToUnicode[septet & 0x7F]);
+}
+
+bool GSMPDU::isGSM7(const char *text) {
+    uint16_t pos = 0;
+    while (text[pos] != '\0') {
+        if (toGSM7(readChar(text, &pos)) < 0)
+            return false;
+    }
+    return true;
+}
+
+uint16_t GSMPDU::findSegment(const char *text, uint16_t start, bool ucs2, bool concatenated, uint8_t *units) {
+    uint8_t maxUnits = ucs2 ? (concatenated ? PDU_UCS2_SEGMENT : PDU_UCS2_SINGLE) : (concatenated ? PDU_GSM7_SEGMENT : PDU_GSM7_SINGLE);
+    uint16_t pos = start;
+    *units = 0;
+    while (text[pos] != '\0') {
+        uint16_t next = pos;
+        uint16_t c = readChar(text, &next);
+        uint8_t size = ucs2 || toGSM7(c) < 0x100 ? 1 : 2; // Characters in the extension table use two septets
+        if (*units + size > maxUnits)
+            break;
+        *units += size;
+        pos = next;
+    }
+    return pos;
+}
+
+uint8_t GSMPDU::countSegments(const char *text, bool ucs2) {
+    uint8_t units;
+    if (text[findSegment(text, 0, ucs2, false, &units)] == '\0')
+        return 1;
+    uint16_t pos = 0;
+    uint8_t segments = 0;
+    while (text[pos] != '\0') {
+        if (segments == 255)
+            return 0;
+        pos = findSegment(text, pos, ucs2, true, &units);
+        segments++;
+    }
+    return segments;
+}
+
+uint8_t GSMPDU::submitLength(const char *number, bool ucs2, bool concatenated, uint8_t units) {
+    uint8_t digits = 0;
+    for (const char *p = number; *p != '\0'; p++) {
+        if (*p >= '0' && *p <= '9')
+            digits++;
+    }
+    uint16_t udl = ucs2 ? units * 2 + (concatenated ? 6 : 0) : units + (concatenated ? 7 : 0);
+    uint16_t udOctets = ucs2 ? udl : (udl * 7 + 7) / 8;
+    return 7 + (digits + 1) / 2 + udOctets; // First octet, message reference, address length and type, PID, DCS and UDL
+}
+
+void GSMPDU::writeOctet(Print *out, uint8_t octet) {
+    static const char hexChars[] = "0123456789ABCDEF";
+    out->write(hexChars[octet >> 4]);
+    out->write(hexChars[octet & 0x0F]);
+}
+
+void GSMPDU::writeSubmit(Print *out, const char *number, const char *text, uint16_t start, uint16_t end, uint8_t units, bool ucs2, uint8_t reference, uint8_t segment, uint8_t segments) {
+    bool concatenated = segments > 1;
+    writeOctet(out, 0x00); // Use the service centre address stored on the SIM card
+    writeOctet(out, concatenated ? 0x41 : 0x01); // SMS-SUBMIT with the user data header indicator set for concatenated messages
+    writeOctet(out, 0x00); // The message reference is set by the module
+
+    // The destination address is written as swapped BCD digits padded with 0xF
+    uint8_t digits = 0;
+    for (const char *p = number; *p != '\0'; p++) {
+        if (*p >= '0' && *p <= '9')
+            digits++;
+    }
+    writeOctet(out, digits);
+    writeOctet(out, number[0] == '+' ? 0x91 : 0x81); // International or unknown type of number
+    uint8_t octet = 0;
+    bool high = false;
+    for (const char *p = number; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9')
+            continue;
+        if (high)
+            writeOctet(out, octet | ((*p - '0') << 4));
+        else
+            octet = *p - '0';
+        high = !high;
+    }
+    if (high)
+        writeOctet(out, octet | 0xF0);
+
+    writeOctet(out, 0x00); // Protocol identifier
+    writeOctet(out, ucs2 ? 0x08 : 0x00); // Data coding scheme
+    writeOctet(out, ucs2 ? units * 2 + (concatenated ? 6 : 0) : units + (concatenated ? 7 : 0)); // User data length
+
+    if (concatenated) { // Concatenated short message with an 8-bit reference number
+        writeOctet(out, 0x05);
+        writeOctet(out, 0x00);
+        writeOctet(out, 0x03);
+        writeOctet(out, reference);
+        writeOctet(out, segments);
+        writeOctet(out, segment);
+    }
+
+    uint16_t pos = start;
+    if (ucs2) {
+        while (pos < end) {
+            uint16_t c = readChar(text, &pos);
+            writeOctet(out, c >> 8);
+            writeOctet(out, c & 0xFF);
+        }
+        return;
+    }
+
+    // The septets are packed into octets while they are written
+    uint16_t bits = 0;
+    uint8_t count = concatenated ? 1 : 0; // The user data header is followed by a fill bit, so the septets start at a septet boundary
+    while (pos < end) {
+        int16_t septet = toGSM7(readChar(text, &pos));
+        for (uint8_t i = septet & 0x100 ? 0 : 1; i < 2; i++) {
+            uint8_t value = i == 0 ? GSM7_ESCAPE : septet & 0x7F;
+            bits |= (uint16_t)value << count;
+            count += 7;
+            if (count >= 8) {
+                writeOctet(out, bits & 0xFF);
+                bits >>= 8;
+                count -= 8;
+            }
+        }
+    }
+    if (count > 0)
+        writeOctet(out, bits & 0xFF);
+}
+
+int16_t GSMPDU::readOctet(const char *hex, uint16_t index) {
+    int16_t value = 0;
+    for (uint8_t i = 0; i < 2; i++) {
+        char c = hex[index * 2 + i];
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+uint8_t GSMPDU::readSeptet(const char *hex, uint16_t index, uint16_t septet) {
+    uint16_t bit = septet * 7;
+    uint16_t value = readOctet(hex, index + bit / 8);
+    if (bit % 8 > 1)
+        value |= readOctet(hex, index + bit / 8 + 1) << 8;
+    return (value >> (bit % 8)) & 0x7F;
+}
+
+uint16_t GSMPDU::writeUTF8(uint16_t c, char *text, uint16_t length, uint16_t size) {
+    uint8_t bytes = c < 0x80 ? 1 : c < 0x800 ? 2 : 3;
+    if (length + bytes >= size)
+        return length; // Truncate without splitting the character
+    if (bytes == 1)
+        text[length++] = c;
+    else if (bytes == 2) {
+        text[length++] = 0xC0 | (c >> 6);
+        text[length++] = 0x80 | (c & 0x3F);
+    } else {
+        text[length++] = 0xE0 | (c >> 12);
+        text[length++] = 0x80 | ((c >> 6) & 0x3F);
+        text[length++] = 0x80 | (c & 0x3F);
+    }
+    return length;
+}
+
+bool GSMPDU::decodeDeliver(const char *hex, PDUMessage *message, char *text, uint16_t size) {
+    uint16_t length = strlen(hex) / 2;
+    uint16_t index = 0;
+    int16_t smscLength = readOctet(hex, index);
+    if (smscLength < 0)
+        return false;
+    index += smscLength + 1;
+    if (index + 2 > length)
+        return false;
+
+    uint8_t first = readOctet(hex, index++);
+    if ((first & 0x03) != 0x00) // Only SMS-DELIVER is supported
+        return false;
+
+    // Originating address
+    uint8_t digits = readOctet(hex, index++);
+    uint8_t type = readOctet(hex, index++);
+    uint8_t addressOctets = (digits + 1) / 2;
+    if (index + addressOctets + 10 > length)
+        return false;
+    uint8_t n = 0;
+    if ((type & 0x70) == 0x50) { // Alphanumeric address packed as GSM 7-bit
+        uint8_t septets = digits * 4 / 7;
+        for (uint8_t i = 0; i < septets && n < sizeof(message->number) - 1; i++)
+            n = writeUTF8(fromGSM7(readSeptet(hex, index, i), false), message->number, n, sizeof(message->number));
+    } else {
+        if (type == 0x91)
+            message->number[n++] = '+';
+        for (uint8_t i = 0; i < digits && n < sizeof(message->number) - 1; i++) {
+            uint8_t octet = readOctet(hex, index + i / 2);
+            message->number[n++] = '0' + (i & 1 ? octet >> 4 : octet & 0x0F);
+        }
+    }
+    message->number[n] = '\0';
+    index += addressOctets;
+
+    index++; // Protocol identifier
+    uint8_t dcs = readOctet(hex, index++);
+    uint8_t alphabet = (dcs & 0xC0) == 0x00 ? (dcs >> 2) & 0x03 : (dcs & 0xF0) == 0xF0 ? (dcs >> 2) & 0x01 : 0;
+    message->ucs2 = alphabet == 2;
+
+    // Service centre time stamp as swapped BCD digits
+    static const char separators[] = "//,::";
+    n = 0;
+    for (uint8_t i = 0; i < 7; i++) {
+        uint8_t octet = readOctet(hex, index++);
+        if (i == 6) {
+            message->timestamp[n++] = octet & 0x08 ? '-' : '+';
+            octet &= ~0x08;
+        }
+        message->timestamp[n++] = '0' + (octet & 0x0F);
+        message->timestamp[n++] = '0' + (octet >> 4);
+        if (i < 5)
+            message->timestamp[n++] = separators[i];
+    }
+    message->timestamp[n] = '\0';
+
+    uint8_t udl = readOctet(hex, index++);
+    uint16_t dataOctets = alphabet == 0 ? (udl * 7 + 7) / 8 : udl;
+    if (index + dataOctets > length)
+        return false;
+    uint16_t udhOctets = 0;
+    message->reference = 0;
+    message->segment = 0;
+    message->segments = 0;
+    if (first & 0x40) { // User data header
+        if (dataOctets == 0)
+            return false;
+        uint8_t udhl = readOctet(hex, index);
+        udhOctets = udhl + 1;
+        if (udhOctets > dataOctets) // The header does not fit in the user data
+            return false;
+        uint16_t end = index + udhOctets;
+        for (uint16_t i = index + 1; i < end;) {
+            if (i + 2 > end) // Every information element has an identifier and a length
+                return false;
+            uint8_t iei = readOctet(hex, i);
+            uint8_t iel = readOctet(hex, i + 1);
+            if (i + 2 + iel > end)
+                return false;
+            if (iei == 0x00 && iel == 3) {
+                message->reference = readOctet(hex, i + 2);
+                message->segments = readOctet(hex, i + 3);
+                message->segment = readOctet(hex, i + 4);
+            } else if (iei == 0x08 && iel == 4) {
+                message->reference = (readOctet(hex, i + 2) << 8) | readOctet(hex, i + 3);
+                message->segments = readOctet(hex, i + 4);
+                message->segment = readOctet(hex, i + 5);
+            }
+            i += iel + 2;
+        }
+    }
+
+    n = 0;
+    uint16_t textLength = 0;
+    if (alphabet == 0) {
+        uint16_t first = (udhOctets * 8 + 6) / 7; // The user data header and fill bits
+        bool escape = false;
+        for (uint16_t i = first; i < udl; i++) {
+            uint8_t septet = readSeptet(hex, index, i);
+            if (septet == GSM7_ESCAPE && !escape) {
+                escape = true;
+                continue;
+            }
+            textLength = writeUTF8(fromGSM7(septet, escape), text, textLength, size);
+            escape = false;
+        }
+    } else {
+        for (uint16_t i = udhOctets; i + (alphabet == 2 ? 1 : 0) < udl; i += alphabet == 2 ? 2 : 1) { // An odd octet of UCS2 is ignored
+            uint16_t c = readOctet(hex, index + i);
+            if (alphabet == 2)
+                c = (c << 8) | readOctet(hex, index + i + 1);
+            textLength = writeUTF8(c >= 0xD800 && c < 0xE000 ? 0xFFFD : c, text, textLength, size);
+        }
+    }
+    if (size > 0)
+        text[textLength] = '\0';
+    return true;
+}
+
+SMSReassembler::SMSReassembler(char *buffer, uint16_t slotSize, uint8_t maxSegments) :
+buffer(buffer),
+slotSize(slotSize),
+maxSegments(maxSegments > 32 ? 32 : maxSegments) {
+    reset();
+}
+
+void SMSReassembler::reset() {
+    segments = 0;
+    received = 0;
+}
+
+bool SMSReassembler::add(const PDUMessage *message, const char *text) {
+    uint8_t total = message->segments ? message->segments : 1;
+    uint8_t segment = message->segments ? message->segment : 1;
+    if (total > maxSegments || segment == 0 || segment > total)
+        return false;
+    if (segments != total || reference != message->reference) { // Start over on a new message
+        reset();
+        segments = total;
+        reference = message->reference;
+    }
+    char *slot = buffer + (segment - 1) * slotSize;
+    uint16_t i = 0;
+    while (i < slotSize - 1 && text[i] != '\0') {
+        slot[i] = text[i];
+        i++;
+    }
+    slot[i] = '\0';
+    received |= 1UL << (segment - 1);
+    return received == (segments == 32 ? 0xFFFFFFFFUL : (1UL << segments) - 1);
+}
+
+uint16_t SMSReassembler::read(char *text, uint16_t size) {
+    uint16_t length = 0;
+    for (uint8_t i = 0; i < segments; i++) {
+        if (!(received & (1UL << i)))
+            continue;
+        for (const char *p = buffer + i * slotSize; *p != '\0' && length < size - 1; p++)
+            text[length++] = *p;
+    }
+    if (size > 0)
+        text[length] = '\0';
+    return length;
+}
@@ -0,0 +1,167 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+#ifndef _gsmpdu_h_
+#define _gsmpdu_h_
+
+#if defined(ARDUINO) && ARDUINO >=100
+#include "Arduino.h"
+#else
+#include <WProgram.h>
+#endif
+
+/** Maximum number of septets or UCS2 characters in a single message and in every segment of a concatenated message. */
+#define PDU_GSM7_SINGLE           160
+#define PDU_GSM7_SEGMENT          153
+#define PDU_UCS2_SINGLE           70
+#define PDU_UCS2_SEGMENT          67
+
+/** Header fields of a received SMS-DELIVER PDU. */
+struct PDUMessage {
+	/** Number or alphanumeric name of the sender. */
+	char number[21];
+	/** Time the message was received in the same format as text mode, i.e. "13/06/16,15:01:58+08". */
+	char timestamp[21];
+	/** True if the message was sent as UCS2. */
+	bool ucs2;
+	/** Reference number, segment number and number of segments of a concatenated message. segments is 0 if the message is not concatenated. */
+	uint16_t reference;
+	uint8_t segment, segments;
+};
+
+/**
+ * Used to encode and decode messages in PDU mode.
+ * The text is UTF-8. It is sent using the GSM 7-bit default alphabet if possible and UCS2 otherwise.
+ * Messages that do not fit in a single message are split into concatenated segments.
+ */
+class GSMPDU {
+public:
+	/**
+	 * Used to check if a text can be encoded using the GSM 7-bit default alphabet and its extension table.
+	 * @param  text Text to check.
+	 * @return      Returns true if it can be sent as GSM 7-bit or false if UCS2 is needed.
+	 */
+	static bool isGSM7(const char *text);
+
+	/**
+	 * Used to count the number of messages needed to send a text.
+	 * @param  text Text to send.
+	 * @param  ucs2 True if the text is sent as UCS2.
+	 * @return      Returns the number of messages or 0 if more than 255 messages are needed.
+	 */
+	static uint8_t countSegments(const char *text, bool ucs2);
+
+	/**
+	 * Used to find the end of the message starting at a specific position. Escape sequences and characters are never split.
+	 * @param  text         Text to send.
+	 * @param  start        Offset of the first byte of the message.
+	 * @param  ucs2         True if the text is sent as UCS2.
+	 * @param  concatenated True if the message is a segment of a concatenated message.
+	 * @param  units        Returns the number of septets or UCS2 characters in the message.
+	 * @return              Returns the offset after the last byte of the message.
+	 */
+	static uint16_t findSegment(const char *text, uint16_t start, bool ucs2, bool concatenated, uint8_t *units);
+
+	/**
+	 * Used to calculate the length used by AT+CMGS in PDU mode. The service centre address is not included.
+	 * @param  number       Number to send the message to.
+	 * @param  ucs2         True if the text is sent as UCS2.
+	 * @param  concatenated True if the message is a segment of a concatenated message.
+	 * @param  units        Number of septets or UCS2 characters returned by findSegment().
+	 * @return              Returns the length in octets.
+	 */
+	static uint8_t submitLength(const char *number, bool ucs2, bool concatenated, uint8_t units);
+
+	/**
+	 * Used to write a SMS-SUBMIT PDU as hexadecimal characters. The text is encoded while it is written, so no buffer is needed.
+	 * @param out       Where to write the PDU.
+	 * @param number    Number to send the message to.
+	 * @param text      Text to send.
+	 * @param start     Offset of the first byte of the message.
+	 * @param end       Offset returned by findSegment().
+	 * @param units     Number of septets or UCS2 characters returned by findSegment().
+	 * @param ucs2      True if the text is sent as UCS2.
+	 * @param reference Reference number of a concatenated message.
+	 * @param segment   Segment number starting from 1.
+	 * @param segments  Number of segments. Set this to 1 if the message is not concatenated.
+	 */
+	static void writeSubmit(Print *out, const char *number, const char *text, uint16_t start, uint16_t end, uint8_t units, bool ucs2, uint8_t reference, uint8_t segment, uint8_t segments);
+
+	/**
+	 * Used to decode a SMS-DELIVER PDU received using AT+CMGR or AT+CMGL in PDU mode.
+	 * @param  hex     The PDU as hexadecimal characters including the service centre address.
+	 * @param  message Returns the header fields.
+	 * @param  text    Buffer for the content as UTF-8. It is truncated if it is too large.
+	 * @param  size    Size of the buffer.
+	 * @return         Returns true if the PDU was decoded.
+	 */
+	static bool decodeDeliver(const char *hex, PDUMessage *message, char *text, uint16_t size);
+
+private:
+	static uint16_t readChar(const char *text, uint16_t *pos);
+	static int16_t toGSM7(uint16_t c);
+	static uint16_t fromGSM7(uint8_t septet, bool escape);
+	static int16_t readOctet(const char *hex, uint16_t index);
+	static uint8_t readSeptet(const char *hex, uint16_t index, uint16_t septet);
+	static void writeOctet(Print *out, uint8_t octet);
+	static uint16_t writeUTF8(uint16_t c, char *text, uint16_t length, uint16_t size);
+};
+
+/**
+ * Used to reassemble concatenated messages. Every segment is stored in its own slot of the buffer, so they can arrive in any order.
+ * Only one message is reassembled at a time. A segment from another message starts over.
+ */
+class SMSReassembler {
+public:
+	/**
+	 * Constructor for the reassembler.
+	 * @param buffer      Buffer of slotSize * maxSegments bytes.
+	 * @param slotSize    Size of every slot. A segment can use up to 3 bytes per character as UTF-8, but 160 bytes is enough for plain text.
+	 * @param maxSegments Maximum number of segments. Up to 32 is supported.
+	 */
+	SMSReassembler(char *buffer, uint16_t slotSize, uint8_t maxSegments);
+
+	/**
+	 * Used to add a segment decoded by GSMPDU::decodeDeliver().
+	 * @param  message Header fields of the segment.
+	 * @param  text    Content of the segment.
+	 * @return         Returns true if all segments of the message have been received.
+	 */
+	bool add(const PDUMessage *message, const char *text);
+
+	/**
+	 * Used to copy the complete message into a buffer.
+	 * @param  text Buffer to copy into.
+	 * @param  size Size of the buffer.
+	 * @return      Returns the length of the message.
+	 */
+	uint16_t read(char *text, uint16_t size);
+
+	/** Used to discard the segments received so far. */
+	void reset();
+
+private:
+	char *buffer;
+	uint16_t slotSize;
+	uint8_t maxSegments;
+	uint16_t reference;
+	uint8_t segments;
+	uint32_t received;
+};
+
+#endif
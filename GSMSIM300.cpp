@@ -17,175 +17,437 @@
 
 #include "GSMSIM300.h"
 
-const char *GSMSIM300::receiveSmsString = "+CMTI: \"SM\","; // +CMTI: "SM",index\r\n
-const char *GSMSIM300::incomingCallString = "RING";
-const char *GSMSIM300::hangupCallString = "NO CARRIER";
-const char *GSMSIM300::powerDownString = "NORMAL POWER DOWN";
-const char *GSMSIM300::errorString = "+CME ERROR:"; // +CME ERROR: <err>
+// Unsolicited result codes and responses that complete a command in the same order as the URC_* events
+// +CMTI: "SM",index\r\n - RING - NORMAL POWER DOWN - the prompt for the content of a message - Call Ready
+#define URC_CODES "+CMTI: \"SM\",", "RING", "NORMAL POWER DOWN", ">", "Call Ready"
 
-// TODO: Remove all delays
+// They are matched directly from flash, so they take no RAM
+const char GSMSIM300::urcStrings[URC_COUNT][URC_SIZE] PROGMEM = { URC_CODES };
 
-GSMSIM300::GSMSIM300(Stream *p, const char *pinCode, uint8_t powerPin /*= 4*/, bool running /*= false*/) :
+// The codes are matched by an Aho-Corasick automaton, so every byte is only compared with the next character of the code being matched.
+// As the codes start with different characters, the trie is a chain per code and a state is the code and the number of characters matched.
+// The state to fall back to on a mismatch is the longest suffix of the characters matched that is a prefix of a code.
+// It is calculated by the compiler from this copy, which is only used at compile time.
+static constexpr char urcCodes[URC_COUNT][URC_SIZE] = { URC_CODES };
+
+static constexpr uint8_t urcLength(uint8_t code, uint8_t length = 0) {
+    return urcCodes[code][length] == '\0' ? length : urcLength(code, length + 1);
+}
+
+// True if the first length characters of the code are the characters at pos of the other code
+static constexpr bool urcEqual(uint8_t code, uint8_t other, uint8_t pos, uint8_t length) {
+    return length == 0 || (urcCodes[code][length - 1] == urcCodes[other][pos + length - 1] && urcEqual(code, other, pos, length - 1));
+}
+
+// The code starting with the character or URC_COUNT if there is none
+static constexpr uint8_t urcFind(char c, uint8_t code = 0) {
+    return code == URC_COUNT || urcCodes[code][0] == c ? code : urcFind(c, code + 1);
+}
+
+static constexpr bool urcContains(uint8_t code, uint8_t other, uint8_t pos = 0) {
+    return pos + urcLength(other) <= urcLength(code) && (urcEqual(other, code, pos, urcLength(other)) || urcContains(code, other, pos + 1));
+}
+
+// Every pair of codes must start with different characters and no code must contain another, as only the state of the code being matched is checked for a match
+static constexpr bool urcValid(uint8_t code = 0, uint8_t other = 0) {
+    return code == URC_COUNT || (other == URC_COUNT ? urcValid(code + 1, 0) : (code == other || (urcCodes[code][0] != urcCodes[other][0] && !urcContains(code, other))) && urcValid(code, other + 1));
+}
+
+static_assert(URC_COUNT <= 8 && URC_SIZE <= 32, "The state is stored in a single byte");
+static_assert(urcValid(), "The codes must start with different characters and must not contain each other");
+
+// Longest suffix of the first matched characters of the code, which is a prefix of a code, starting from the given length
+static constexpr uint8_t urcFallback(uint8_t code, uint8_t matched, uint8_t length) {
+    return length == 0 ? 0 :
+        urcFind(urcCodes[code][matched - length]) < URC_COUNT && urcEqual(urcFind(urcCodes[code][matched - length]), code, matched - length, length) ?
+        urcFind(urcCodes[code][matched - length]) << 5 | length : urcFallback(code, matched, length - 1);
+}
+
+static constexpr uint8_t urcFailState(uint8_t code, uint8_t matched) {
+    return matched <= 1 || matched > urcLength(code) ? 0 : urcFallback(code, matched, matched - 1);
+}
+
+#define URC_FAIL_ROW(code) { urcFailState(code, 0), urcFailState(code, 1), urcFailState(code, 2), urcFailState(code, 3), urcFailState(code, 4), \
+    urcFailState(code, 5), urcFailState(code, 6), urcFailState(code, 7), urcFailState(code, 8), urcFailState(code, 9), urcFailState(code, 10), \
+    urcFailState(code, 11), urcFailState(code, 12), urcFailState(code, 13), urcFailState(code, 14), urcFailState(code, 15), urcFailState(code, 16), \
+    urcFailState(code, 17) }
+
+static_assert(URC_SIZE == 18 && URC_COUNT == 5, "URC_FAIL_ROW has an entry for every position and urcFail has a row for every code");
+const uint8_t GSMSIM300::urcFail[URC_COUNT][URC_SIZE] PROGMEM = { URC_FAIL_ROW(0), URC_FAIL_ROW(1), URC_FAIL_ROW(2), URC_FAIL_ROW(3), URC_FAIL_ROW(4) };
+
+// Lower bound, initial value and upper bound in ms of the timeout of every GSM_WAIT_* class
+// The network is only waited for after the module has responded to the command, so a dead module is detected by the short timeouts,
+// while the lower bound of GSM_WAIT_NETWORK allows for a slow network
+static const uint16_t timeoutLimits[GSM_WAIT_COUNT][3] = {
+    { 250, 2000, 10000 }, // GSM_WAIT_COMMAND
+    { 500, 5000, 20000 }, // GSM_WAIT_SIM
+    { 20000, 60000, 60000 }, // GSM_WAIT_NETWORK
+    { 5000, 30000, 60000 }, // GSM_WAIT_BOOT
+};
+
+GSMArduinoClock gsmArduinoClock;
+
+GSMSIM300::GSMSIM300(Stream *p, const char *pinCode, uint8_t powerPin /*= 4*/, bool running /*= false*/, GSMClock *clock /*= NULL*/) :
 gsm(p),
+clock(clock ? clock : &gsmArduinoClock),
+out(p),
 pinCode(pinCode),
 powerPin(powerPin),
-pReceiveSmsString((char*)receiveSmsString),
-pIncomingCallString((char*)incomingCallString),
-pHangupCallString((char*)hangupCallString),
-pPowerDownString((char*)powerDownString),
-pErrorString((char*)errorString),
-pGsmString(gsmString),
-pOutString(outString),
+urcState(0),
+urcEvent(URC_NONE),
+commandHead(0),
+commandCount(0),
+commandActive(false),
+commandError(0),
+commandErrorCms(false),
+commandBody(false),
+simReady(false),
+registration(GSM_REG_UNKNOWN),
+signalQuality(GSM_SIGNAL_UNKNOWN),
+signalTimer(0),
+powerWait(0),
+updateBusy(true),
+modemConfig(0),
+skippedCommands(0),
+recoveryTier(GSM_RECOVERY_NONE),
+resumeState(GSM_RUNNING),
+baudCallback(NULL),
+baudInitial(0),
+baudTarget(0),
+baudRate(0),
+baudChecks(0),
+baudFailed(false),
+lineLength(0),
+lineComplete(false),
+#ifndef GSM_NO_SMS_OUT
+smsHead(0),
+smsCount(0),
+smsHandle(0),
+pduReference(0),
+#endif
+#ifndef GSM_NO_SMS_IN
+inboxState(INBOX_IDLE),
+inboxCount(0),
+listType(NULL),
+inboxDrain(false),
+directSMS(false),
+directPDU(false),
+directResume(INBOX_IDLE),
+directAck(NULL),
+smsCallback(NULL),
+headerCallback(NULL),
+bodyCallback(NULL),
+bodyBreaks(0),
+bodyPartial(false),
 readIndex(false),
-newSms(false) {
+newSms(false),
+#endif
+#ifndef GSM_NO_CALLS
+callCallback(NULL),
+#endif
+rxMaxBytes(GSM_RX_MAX_BYTES),
+rxMaxTime(GSM_RX_MAX_TIME),
+rxBufferSize(GSM_RX_BUFFER_SIZE),
+rxOverruns(0)
+#ifdef GSM_STATS
+, statsPrint(p, &stats.txBytes)
+#endif
+{
+#ifdef LATENCYDEBUG
+    memset(gsmLatency, 0, sizeof(gsmLatency));
+#ifndef GSM_NO_SMS_OUT
+    memset(smsLatency, 0, sizeof(smsLatency));
+#endif
+#ifndef GSM_NO_CALLS
+    memset(callLatency, 0, sizeof(callLatency));
+#endif
+#endif
+    memset(srtt, 0, sizeof(srtt));
+    memset(rttvar, 0, sizeof(rttvar));
+    for (uint8_t i = 0; i < GSM_WAIT_COUNT; i++)
+        timeout[i] = timeoutLimits[i][1];
+    memset(commandQueue, 0, sizeof(commandQueue));
+#ifndef GSM_NO_SMS_OUT
+    memset(smsQueue, 0, sizeof(smsQueue));
+#endif
+#ifndef GSM_NO_SMS_IN
+    lastIndex[0] = indexIn[0] = '\0';
+#endif
+#ifdef GSM_STATS
+    out = &statsPrint; // Count the bytes sent
+    resetStats();
+#endif
+
     pinMode(powerPin,OUTPUT);
     digitalWrite(powerPin,HIGH);
 
-    if (running)
+    if (running) {
         gsmState = GSM_RUNNING;
-    else
+        signalTimer = this->clock->millis() - GSM_SIGNAL_INTERVAL; // The registration is unknown, so it is polled straight away
+    } else
         gsmState = GSM_POWER_ON;
 
+#ifndef GSM_NO_SMS_OUT
     smsState = SMS_IDLE;
+#endif
+#ifndef GSM_NO_CALLS
     callState = CALL_IDLE;
+#endif
 }
 
 void GSMSIM300::update() {
-    incomingChar = gsm->read();
+    uint32_t startTime = clock->micros();
+    uint32_t lastStates = packStates();
+    uint8_t lastCommandCount = commandCount;
+#ifdef LATENCYDEBUG
+    uint8_t lastGsmState = gsmState;
+#ifndef GSM_NO_SMS_OUT
+    uint8_t lastSmsState = smsState;
+#endif
+#ifndef GSM_NO_CALLS
+    uint8_t lastCallState = callState;
+#endif
+#endif
+    powerWait = 0;
+    if (gsm->available() >= rxBufferSize - 1) // The receive buffer is full, so incoming bytes are being dropped
+        rxOverruns++;
+
+    // Process every byte that is available, so the receive buffer does not overflow between calls
+    // The state machines are always updated at least once, so the timed states are updated even when no byte is received
+    uint8_t count = 0;
+    do {
+        incomingChar = gsm->read();
+        updateGSM();
+#ifdef GSM_STATS
+        if (gsmState != statsState)
+            updateStateTime();
+#endif
+    } while (incomingChar >= 0 && ++count < rxMaxBytes && (rxMaxTime == 0 || clock->micros() - startTime < rxMaxTime));
+#ifdef GSM_STATS
+    stats.rxBytes += count;
+#endif
+    // A state machine might be able to continue right away after a state change, so the caller should not sleep
+    updateBusy = incomingChar >= 0 || packStates() != lastStates || commandCount != lastCommandCount;
+
+#ifdef LATENCYDEBUG
+    uint16_t latency = clock->micros() - startTime;
+    if (latency > gsmLatency[lastGsmState])
+        gsmLatency[lastGsmState] = latency;
+#ifndef GSM_NO_SMS_OUT
+    if (latency > smsLatency[lastSmsState])
+        smsLatency[lastSmsState] = latency;
+#endif
+#ifndef GSM_NO_CALLS
+    if (latency > callLatency[lastCallState])
+        callLatency[lastCallState] = latency;
+#endif
+#endif
+}
+
+uint32_t GSMSIM300::packStates() {
+    uint32_t states = gsmState;
+#ifndef GSM_NO_SMS_OUT
+    states |= (uint32_t)smsState << 8;
+#endif
+#ifndef GSM_NO_CALLS
+    states |= (uint32_t)callState << 16;
+#endif
+#ifndef GSM_NO_SMS_IN
+    states |= (uint32_t)inboxState << 24;
+#endif
+    return states;
+}
+
+void GSMSIM300::setRxBudget(uint8_t maxBytes, uint16_t maxTime /*= GSM_RX_MAX_TIME*/) {
+    rxMaxBytes = maxBytes ? maxBytes : 1;
+    rxMaxTime = maxTime;
+}
+
+void GSMSIM300::setBaudRate(uint32_t initial, uint32_t target, BaudCallback callback) {
+    baudCallback = callback;
+    baudInitial = initial;
+    baudTarget = target;
+    baudRate = initial;
+    baudFailed = false;
+}
+
+void GSMSIM300::changeBaud(uint32_t baud) {
+    if (baudCallback == NULL || baud == baudRate)
+        return;
+    gsm->flush();
+    baudCallback(baud);
+    baudRate = baud;
+#ifdef DEBUG
+    Serial.print(F("Baud rate: "));
+    Serial.println(baud);
+#endif
+}
+
+void GSMSIM300::updateGSM() {
 #ifdef EXTRADEBUG
-    if (incomingChar != -1)
+    if (incomingChar >= 0)
         Serial.write(incomingChar);
 #endif
-    if (checkString(incomingChar,powerDownString,&pPowerDownString)) {
-#ifdef DEBUG
-        Serial.println(F("GSM module turned off"));
+    // Every string the library is looking for is advanced by this byte in a single pass
+    urcEvent = matchURC(incomingChar);
+    lineComplete = assembleLine(incomingChar);
+#ifdef GSM_STATS
+    if (lineComplete)
+        updateStats();
 #endif
-        gsmState = GSM_POWER_ON;
-    }
-    if (checkString(incomingChar,errorString,&pErrorString)) {
+
+    // Checked before the commands, as the response to AT+CPOWD=1 moves the state on to GSM_POWER_OFF_PULSE
+    if (urcEvent == URC_POWER_DOWN && gsmState != GSM_POWER_OFF_WAIT) { // Unless we are the ones turning it off
 #ifdef DEBUG
-        char error[5];
-        uint8_t i = 0;
-        while (i < sizeof(error)-1) { // TODO: Check time
-            error[i] = gsm->read();
-            if (error[i] == '\r' || error[i] == '\n' || error[i] == '\0')
-                break;
-            else if (error[i] != -1 && error[i] != ' ')
-                i++;
-        }
-        error[i] = '\0';
-        Serial.print(F("The GSM module returned the following error: "));
-        Serial.println(error);
+        Serial.println(F("GSM module turned off"));
 #endif
         gsmState = GSM_POWER_ON;
     }
 
+    updateCommands(); // The responses are matched before the state machines run, so they see the result of their commands
+    if (lineComplete)
+        checkNetwork();
+
     switch(gsmState) {
+        // The power on sequence is split into timed states, so update() never blocks while the module boots
+        // The transaction engine is flushed, so the commands without a response can be written directly
         case GSM_POWER_ON:
-            delay(1000);
-            gsm->print(F("AT+CPOWD=0\r")); // Turn off the module if it's already on
-#ifdef DEBUG
-            Serial.println(F("GSM PowerOn"));
+#ifdef GSM_STATS
+            if (stats.powerCycles < 0xFFFF)
+                stats.powerCycles++;
 #endif
-            delay(1000);
-            powerOn();
-#ifdef DEBUG
-            Serial.println(F("GSM check state"));
+            digitalWrite(powerPin,HIGH); // Release the power pin in case a power off sequence was interrupted
+            flushCommands();
+            restartRequests(true); // Queued requests are sent once the module is running again
+            modemConfig = 0; // The configuration is lost when the module is turned off
+#ifndef GSM_NO_SMS_IN
+            directAck = NULL; // The module has forgotten the message, so the network delivers it again
 #endif
-            gsm->print(F("AT\r"));
-            delay(500);
-            gsm->print(F("AT\r"));
-            setGsmWaitingString("OK");
-            gsmState = GSM_POWER_ON_WAIT;
+            registration = GSM_REG_UNKNOWN;
+            signalQuality = GSM_SIGNAL_UNKNOWN;
+            powerTimer = clock->millis();
+            gsmState = GSM_POWER_ON_SHUTDOWN;
             break;
 
-        case GSM_POWER_ON_WAIT:
-            if (checkWaitingString(incomingChar,gsmString,&pGsmString)) {
-#ifdef DEBUG
-                Serial.println(F("GSM Module is powered on\r\nChecking SIM Card"));
-#endif
-                if (pinCode) {
-                    gsm->print(F("AT+CPIN="));
-                    gsm->print(pinCode); // Set pin
-                    gsm->print(F("\r"));
-                    setGsmWaitingString("Call Ready");
-                    gsmState = GSM_SET_PIN;
-                } else { // Do not use a pin code
-                    gsm->print(F("AT+CPIN?\r"));
-                    setGsmWaitingString("+CPIN: READY");
-                    gsmState = GSM_SET_PIN;
+        case GSM_POWER_ON_SHUTDOWN:
+            if (powerDelay(1000)) {
+                startCommand(GSM_COMMAND_AT);
+                if (baudCallback && baudTarget != baudInitial) { // The module is still at the higher rate if only the Arduino was reset
+                    changeBaud(baudTarget);
+                    out->print(F("AT+CPOWD=0\r"));
                 }
+                changeBaud(baudInitial); // The module detects the rate from the first AT after it is turned on
+                out->print(F("AT+CPOWD=0\r")); // Turn off the module if it's already on
+#ifdef DEBUG
+                Serial.println(F("GSM PowerOn"));
+#endif
+                gsmState = GSM_POWER_ON_PULSE;
             }
             break;
 
-      	case GSM_SET_PIN:
-            if (checkWaitingString(incomingChar,gsmString,&pGsmString)) {
+        case GSM_POWER_ON_PULSE:
+            if (powerDelay(1000)) {
+                digitalWrite(powerPin,LOW);
+                gsmState = GSM_POWER_ON_RELEASE;
+            }
+            break;
+
+        case GSM_POWER_ON_RELEASE:
+            if (powerDelay(4000)) {
+                digitalWrite(powerPin,HIGH);
+                gsmState = GSM_POWER_ON_SETTLE;
+            }
+            break;
+
+        case GSM_POWER_ON_SETTLE:
+            if (powerDelay(2000)) {
 #ifdef DEBUG
-                Serial.println(F("SIM Card ready"));
-                Serial.print(F("Waiting for GSM to get ready"));
+                Serial.println(F("GSM check state"));
 #endif
-                gsmState = GSM_CHECK_CONNECTION;
+                startCommand(GSM_COMMAND_AT);
+                out->print(F("AT\r"));
+                gsmState = GSM_POWER_ON_SYNC;
             }
             break;
 
+        case GSM_POWER_ON_SYNC:
+            // The module has had time to boot, so a missing response is retried quickly
+            if (powerDelay(500) && queueCommand(GSM_COMMAND_AT, GSM_WAIT_COMMAND, F("AT"), NULL, URC_NONE, &GSMSIM300::gsmResponse, true))
+                gsmState = GSM_POWER_ON_WAIT;
+            break;
+
+        case GSM_BAUD_SETTLE:
+            // The first check is delayed, so the module has switched to the new rate
+            if (powerDelay(100) && queueCommand(GSM_COMMAND_AT, GSM_WAIT_COMMAND, F("AT"), NULL, URC_NONE, &GSMSIM300::gsmResponse, true))
+                gsmState = GSM_BAUD_VERIFY;
+            break;
+
+      	case GSM_SET_PIN:
+            if (lineComplete && checkLine(F("+CPIN: READY")))
+                simReady = true;
+            break;
+
         case GSM_CHECK_CONNECTION:
 #if defined(DEBUG) && !defined(EXTRADEBUG)
             Serial.print(F("."));
 #elif defined(EXTRADEBUG)
             Serial.print(F("\r\nChecking Connection"));
 #endif
-            gsm->print(F("AT+CREG?\r"));
-            setGsmWaitingString("+CREG: 0,");
-            gsmState = GSM_CHECK_CONNECTION_WAIT;
+            if (!(modemConfig & CONFIG_REGISTRATION_URC)) { // The module tells when it registers, so it only has to be polled once
+                if (queueCommand(GSM_COMMAND_CREG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeRegistrationURC, URC_NONE, &GSMSIM300::gsmResponse, true))
+                    gsmState = GSM_CHECK_CONNECTION_URC;
+            } else if (queueCommand(GSM_COMMAND_CREG, GSM_WAIT_COMMAND, F("AT+CREG?"), NULL, URC_NONE, &GSMSIM300::gsmResponse, true))
+                gsmState = GSM_CHECK_CONNECTION_WAIT;
             break;
 
         case GSM_CHECK_CONNECTION_WAIT:
-            if (checkWaitingString(incomingChar,gsmString,&pGsmString))
-                gsmState = GSM_CONNECTION_RESPONSE;
-            break;
-
-        case GSM_CONNECTION_RESPONSE:
-            if (incomingChar != -1) {
+            // The registration is parsed from +CREG: <n>,<stat> by checkNetwork()
+            if (lineComplete && checkLine(F("+CREG:"))) {
 #ifdef EXTRADEBUG
                 Serial.print(F("\r\nConnection response: "));
-                Serial.print(incomingChar);
-#endif
-                if (incomingChar != '1' && incomingChar != '5') {
-                    delay(1000);
-                    gsmState = GSM_CHECK_CONNECTION;
-                } else {
-#ifdef DEBUG
-                    Serial.println(F("\r\nGSM module is up and running!\r\n"));
+                Serial.print(registration);
 #endif
-                    gsmState = GSM_RUNNING;
-                }
+                if (isRegistered())
+                    gsmState = GSM_CONNECTION_RESPONSE; // The module is running once the final response is received
             }
             break;
 
+        case GSM_CHECK_CONNECTION_DELAY:
+            if (isRegistered() || powerDelay(5000)) // The +CREG URC is normally received first, so the module is only polled in case it is lost
+                gsmState = GSM_CHECK_CONNECTION;
+            break;
+
         case GSM_RUNNING:
+            updateNetwork();
+#ifndef GSM_NO_SMS_OUT
             updateSMS();
+#endif
+#ifndef GSM_NO_CALLS
             updateCall();
+#endif
+#ifndef GSM_NO_SMS_IN
+            updateInbox();
             checkSMS(); // Check if a new SMS is received
-            if (checkString(incomingChar,incomingCallString,&pIncomingCallString)) {
-#ifdef DEBUG
-                Serial.println(F("Incoming Call"));
 #endif
-                answer();
-            }
             break;
 
         case GSM_POWER_OFF:
 #ifdef DEBUG
             Serial.println(F("Shutting down GSM module"));
 #endif
-            gsm->print(F("AT+CPOWD=1\r")); // Turn off the module if it's already on
-            setGsmWaitingString(powerDownString);
-            gsmState = GSM_POWER_OFF_WAIT;
+            if (queueCommand(GSM_COMMAND_AT, GSM_WAIT_BOOT, F("AT+CPOWD=1"), NULL, URC_POWER_DOWN, &GSMSIM300::gsmResponse, true))
+                gsmState = GSM_POWER_OFF_WAIT;
             break;
 
-        case GSM_POWER_OFF_WAIT:
-            if (checkWaitingString(incomingChar,gsmString,&pGsmString)) {
-                powerOff();
+        case GSM_POWER_OFF_PULSE:
+            if (powerDelay(800)) {
+                digitalWrite(powerPin,HIGH);
+                gsmState = GSM_POWER_OFF_RELEASE;
+            }
+            break;
+
+        case GSM_POWER_OFF_RELEASE:
+            if (powerDelay(6000)) {
 #ifdef DEBUG
                 Serial.println(F("GSM PowerOff"));
 #endif
@@ -193,417 +455,1644 @@ void GSMSIM300::update() {
             }
             break;
 
-        default:
+        // The module is checked using AT before the command that failed is sent again
+        case GSM_RESYNC:
+            if (queueCommand(GSM_COMMAND_AT, GSM_WAIT_COMMAND, F("AT"), NULL, URC_NONE, &GSMSIM300::gsmResponse, true))
+                gsmState = GSM_RESYNC_WAIT;
+            break;
+
+        case GSM_RESET:
+#ifdef DEBUG
+            Serial.println(F("Resetting GSM module"));
+#endif
+            startCommand(GSM_COMMAND_AT);
+            out->print(F("AT+CFUN=1,1\r")); // The module restarts, so it is synchronised like after the power on sequence
+            changeBaud(baudInitial); // The rate set by AT+IPR is not kept
+            modemConfig = 0;
+            registration = GSM_REG_UNKNOWN;
+            signalQuality = GSM_SIGNAL_UNKNOWN;
+            powerTimer = clock->millis();
+            gsmState = GSM_POWER_ON_SETTLE;
+            break;
+
+        default: // The other states wait for gsmResponse()
             break;
     }
 }
 
-void GSMSIM300::checkSMS() {
-    if (incomingChar == -1)
-        return;
-    if (readIndex) {
-        if (incomingChar == '\r') { // End of index
-            lastIndex[indexCounter] = '\0';
-            readIndex = false;
-            newSms = true;
+void GSMSIM300::gsmResponse(uint8_t result) {
+    if (result != GSM_RESULT_OK) {
+        if (gsmState == GSM_SET_PIN && commandError == 3) // The pin code has already been entered
+            gsmState = GSM_CHECK_CONNECTION;
+        else if (gsmState == GSM_SET_PIN && commandError == 16) { // Wrong pin code
 #ifdef DEBUG
-            Serial.print(F("Received SMS at index: "));
-            Serial.println(lastIndex);
+            Serial.println(F("Wrong pin code"));
 #endif
-        } else if (indexCounter < sizeof(lastIndex)-1)
-            lastIndex[indexCounter++] = incomingChar;
-        else {
+            gsmState = GSM_SIM_ERROR;
+        } else if (gsmState == GSM_BAUD) { // The module does not support the rate, so the initial rate is kept
 #ifdef DEBUG
-            Serial.println(F("Index is too long"));
+            Serial.println(F("Baud rate not supported"));
 #endif
-            readIndex = false;
-        }
-    } else if (checkString(incomingChar,receiveSmsString,&pReceiveSmsString)) {
-        readIndex = true;
-        indexCounter = 0;
+            baudFailed = true;
+            startSIM();
+        } else
+            recover(GSM_RECOVERY_RETRY);
+        return;
     }
-}
-
-// I know this might seem confusing, but in order to change the pointer I have to create a pointer to a pointer
-// **pString will get the value of the original pointer, while
-// *pString will get the address of the original pointer
-bool GSMSIM300::checkString(char input, const char *cmpString, char **pString) {
-    if (input == -1)
-        return false;
-    if (input == **pString) {
-        (*pString)++;
-        if (**pString == '\0') {
-            *pString = (char*)cmpString; // Reset pointer to start of string
-            return true;
-        }
-    } else
-        *pString = (char*)cmpString; // Reset pointer to start of string
-    return false;
-}
-
-// TODO: Check if updateSMS or updateCall is caught in a loop
-void GSMSIM300::updateSMS() {
-    switch(smsState) {
-        case SMS_IDLE:
-            break;
 
-        case SMS_MODE:
+    switch(gsmState) {
+        case GSM_POWER_ON_WAIT:
 #ifdef DEBUG
-            Serial.println(F("SMS setting text mode"));
+            Serial.println(F("GSM Module is powered on"));
 #endif
-            setSMSTextMode();
-            setOutWaitingString("OK");
-            smsState = SMS_ALPHABET;
+            if (baudCallback && baudTarget != baudRate && !baudFailed) {
+                if (queueCommand(GSM_COMMAND_AT, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeBaudRate, URC_NONE, &GSMSIM300::gsmResponse, true))
+                    gsmState = GSM_BAUD;
+            } else
+                startSIM();
             break;
 
-        case SMS_ALPHABET:
-            if (checkWaitingString(incomingChar,outString,&pOutString)) {
-#ifdef DEBUG
-                Serial.println(F("SMS setting alphabet"));
-#endif
-                gsm->print(F("AT+CSCS=\"GSM\"\r")); // GSM default alphabet
-                setOutWaitingString("OK");
-                smsState = SMS_NUMBER;
-            }
+        case GSM_BAUD: // The module answers at the old rate and switches afterwards
+            changeBaud(baudTarget);
+            baudChecks = 0;
+            powerTimer = clock->millis();
+            gsmState = GSM_BAUD_SETTLE;
             break;
 
-        case SMS_NUMBER:
-            if (checkWaitingString(incomingChar,outString,&pOutString)) {
-#ifdef DEBUG
-                Serial.print(F("Number: "));
-                Serial.println(numberOut);
-#endif
-                gsm->print(F("AT+CMGS=\""));
-                gsm->print(numberOut);
-                gsm->print(F("\"\r"));
-                setOutWaitingString(">");
-                smsState = SMS_CONTENT;
-            }
+        case GSM_BAUD_VERIFY:
+            if (++baudChecks < GSM_BAUD_CHECKS)
+                queueCommand(GSM_COMMAND_AT, GSM_WAIT_COMMAND, F("AT"), NULL, URC_NONE, &GSMSIM300::gsmResponse, true);
+            else
+                startSIM();
             break;
 
-        case SMS_CONTENT:
-            if (checkWaitingString(incomingChar,outString,&pOutString)) {
-#ifdef DEBUG
-                Serial.print(F("Message: \""));
-                Serial.print(messageOut);
-                Serial.println("\"");
-#endif
-                gsm->print(messageOut);
-                gsm->write(26); // CTRL-Z
-                setOutWaitingString("OK");
-                smsState = SMS_WAIT;
+        case GSM_SET_PIN:
+            if (!pinCode && !simReady) { // The SIM card is not ready yet
+                recover(GSM_RECOVERY_RETRY);
+                break;
             }
-            break;
-
-        case SMS_WAIT:
-            if (checkWaitingString(incomingChar,outString,&pOutString)) {
 #ifdef DEBUG
-                Serial.println(F("SMS is sent"));
+            Serial.println(F("SIM Card ready"));
+            Serial.print(F("Waiting for GSM to get ready"));
 #endif
-                smsState = SMS_IDLE;
-            }
+            gsmState = GSM_CHECK_CONNECTION;
             break;
 
-        default:
+        case GSM_CHECK_CONNECTION_URC:
+            gsmState = GSM_CHECK_CONNECTION;
             break;
-    }
-}
 
-void GSMSIM300::updateCall() {
-    switch(callState) {
-        case CALL_IDLE:
+        case GSM_CHECK_CONNECTION_WAIT: // Not registered yet
+            powerTimer = clock->millis();
+            gsmState = GSM_CHECK_CONNECTION_DELAY; // Wait for the +CREG URC
             break;
 
-        case CALL_NUMBER:
-#ifdef DEBUG
-            Serial.print(F("Calling: "));
-            Serial.println(numberOut);
-#endif
-            gsm->print(F("ATD")); // Dial
-            gsm->print(numberOut);
-            gsm->print(F(";\r"));
-            callState = CALL_SETUP;
+        case GSM_CONNECTION_RESPONSE:
 #ifdef DEBUG
-            Serial.print(F("Waiting for connection"));
+            Serial.println(F("\r\nGSM module is up and running!\r\n"));
 #endif
+            recoveryTier = GSM_RECOVERY_NONE;
+            signalTimer = clock->millis() - GSM_SIGNAL_INTERVAL; // Sample the signal quality straight away
+            gsmState = GSM_RUNNING;
             break;
 
-        case CALL_SETUP:
-#if defined(DEBUG) && !defined(EXTRADEBUG)
-            Serial.print(F("."));
-#elif defined(EXTRADEBUG)
-            Serial.print(F("\r\nChecking response"));
-#endif
-            gsm->print(F("AT+CLCC\r"));
-            setOutWaitingString("+CLCC: 1,0,");
-            callState = CALL_SETUP_WAIT;
+        case GSM_POWER_OFF_WAIT:
+            digitalWrite(powerPin,LOW);
+            powerTimer = clock->millis();
+            gsmState = GSM_POWER_OFF_PULSE;
             break;
 
-        case CALL_SETUP_WAIT:
-            if (checkWaitingString(incomingChar,outString,&pOutString)) {
-#ifdef EXTRADEBUG
-                Serial.print(F("\r\nGot first response"));
-#endif
-                callState = CALL_RESPONSE;
-            }
+        case GSM_RESYNC_WAIT:
+            powerTimer = clock->millis();
+            gsmState = resumeState;
             break;
 
-        case CALL_RESPONSE:
-            if (incomingChar != -1) {
-#ifdef EXTRADEBUG
-                Serial.print(F("\r\nConnection response: "));
-                Serial.print(incomingChar);
-#endif
-                if (incomingChar != '0') {
-                    delay(1000);
-                    callState = CALL_SETUP;
-                } else {
-#ifdef DEBUG
-                    Serial.println(F("\r\nCall active"));
-#endif
-                    callState = CALL_ACTIVE;
-                }
-            }
+        default:
             break;
+    }
+}
 
-        case CALL_ACTIVE:
-            if (checkString(incomingChar,hangupCallString,&pHangupCallString)) {
+void GSMSIM300::startSIM() {
 #ifdef DEBUG
-                Serial.println(F("Call hangup"));
+    Serial.println(F("Checking SIM Card"));
 #endif
-                callState = CALL_IDLE;
-            }
-            break;
+    simReady = false;
+    if (pinCode) // The module is ready once it has found the network after the pin code is entered
+        queueCommand(GSM_COMMAND_CPIN, GSM_WAIT_BOOT, NULL, &GSMSIM300::writePin, URC_CALL_READY, &GSMSIM300::gsmResponse, true);
+    else // Do not use a pin code
+        queueCommand(GSM_COMMAND_CPIN, GSM_WAIT_BOOT, F("AT+CPIN?"), NULL, URC_NONE, &GSMSIM300::gsmResponse, true);
+    gsmState = GSM_SET_PIN;
+}
 
-        default:
-            break;
-    }
+void GSMSIM300::checkNetwork() {
+    // The URC is returned as +CREG: <stat>, while AT+CREG? returns +CREG: <n>,<stat>
+    char *str, *fields[2];
+    if ((str = checkLine(F("+CREG:")))) {
+        uint8_t count = splitFields(str, fields, 2);
+        uint8_t stat = atoi(fields[count - 1]);
+#ifdef DEBUG
+        if (stat != registration && gsmState == GSM_RUNNING) {
+            Serial.print(F("Network registration: "));
+            Serial.println(stat);
+        }
+#endif
+        registration = stat;
+    } else if ((str = checkLine(F("+CSQ:")))) // Returned as: +CSQ: <rssi>,<ber>
+        signalQuality = atoi(str);
 }
 
-void GSMSIM300::setGsmWaitingString(const char *str) {
-    strcpy(gsmString,str);
-    pGsmString = gsmString;
-    gsmTimer = millis();
+void GSMSIM300::updateNetwork() {
+#if GSM_SIGNAL_INTERVAL != 0
+    if (commandCount > 0 || clock->millis() - signalTimer < GSM_SIGNAL_INTERVAL)
+        return; // The samples never delay a request
+    signalTimer = clock->millis();
+    if (!(modemConfig & CONFIG_REGISTRATION_URC)) // The setting is unknown after an error, so it is set again
+        queueCommand(GSM_COMMAND_CREG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeRegistrationURC, URC_NONE, &GSMSIM300::networkResponse);
+    if (!isRegistered())
+        queueCommand(GSM_COMMAND_CREG, GSM_WAIT_COMMAND, F("AT+CREG?"), NULL, URC_NONE, &GSMSIM300::networkResponse);
+    queueCommand(GSM_COMMAND_CSQ, GSM_WAIT_COMMAND, F("AT+CSQ"), NULL, URC_NONE, &GSMSIM300::networkResponse);
+#endif
 }
 
-void GSMSIM300::setOutWaitingString(const char *str) {
-    strcpy(outString,str);
-    pOutString = outString;
-    gsmTimer = millis();
+void GSMSIM300::networkResponse(uint8_t result) {
+    (void)result; // A sample that is rejected is not retried, as the module has responded
 }
 
-bool GSMSIM300::checkWaitingString(char input, const char *str, char **pStr) {
-    if (checkString(input,str,&(*pStr))) {
-#ifdef EXTRADEBUG
-        Serial.print(F("\r\nResponse success: "));
-        Serial.write(str);
-        Serial.println();
-#endif
-        return true;
-    }
-    if (millis() - gsmTimer > 10000) { // Only wait 10s for response
-#ifdef DEBUG
-        Serial.println("\r\nNo response from GSM module\r\nResetting...");
-#endif
-        gsmState = GSM_POWER_ON;
-        smsState = SMS_IDLE;
-        callState = CALL_IDLE;
+bool GSMSIM300::writeRegistrationURC() {
+    if (modemConfig & CONFIG_REGISTRATION_URC) {
+        skippedCommands++;
+        return false;
     }
-    return false;
+    out->print(F("AT+CREG=1\r")); // Send +CREG: <stat> when the registration changes
+    modemConfig |= CONFIG_REGISTRATION_URC;
+    return true;
 }
 
-void GSMSIM300::call(const char *num) {
-    strcpy(numberOut,num);
-    callState = CALL_NUMBER;
+bool GSMSIM300::writePin() {
+    out->print(F("AT+CPIN="));
+    out->print(pinCode); // Set pin
+    out->print(F("\r"));
+    return true;
 }
 
-void GSMSIM300::hangup() {
-    gsm->print(F("ATH\r")); // Response: 'OK'
-#ifdef DEBUG
-    Serial.println(F("Call hangup"));
-#endif
-    callState = CALL_IDLE;
+bool GSMSIM300::writeBaudRate() {
+    out->print(F("AT+IPR="));
+    out->print(baudTarget);
+    out->print(F("\r"));
+    return true;
 }
 
-void GSMSIM300::answer() {
-    gsm->print(F("ATA\r"));
-    callState = CALL_ACTIVE;
+GSMCommand *GSMSIM300::queueCommand(uint8_t type, uint8_t wait, const __FlashStringHelper *request, bool (GSMSIM300::*write)(), uint8_t response, void (GSMSIM300::*callback)(uint8_t), bool urgent /*= false*/) {
+    if (commandCount >= GSM_COMMAND_QUEUE_SIZE - (urgent ? 0 : 1)) { // The last entry is reserved, so an exchange can always be continued
 #ifdef DEBUG
-    Serial.println(F("\r\nCall active"));
+        Serial.println(F("Command queue is full"));
 #endif
+        return NULL;
+    }
+    uint8_t i;
+    if (!urgent)
+        i = (commandHead + commandCount) % GSM_COMMAND_QUEUE_SIZE;
+    else {
+        commandHead = (commandHead + GSM_COMMAND_QUEUE_SIZE - 1) % GSM_COMMAND_QUEUE_SIZE;
+        i = commandHead;
+        if (commandActive) { // Keep the command being sent at the head
+            commandQueue[commandHead] = commandQueue[(commandHead + 1) % GSM_COMMAND_QUEUE_SIZE];
+            i = (commandHead + 1) % GSM_COMMAND_QUEUE_SIZE;
+        }
+    }
+    commandCount++;
+    GSMCommand *command = &commandQueue[i];
+    command->type = type;
+    command->wait = wait;
+    command->request = request;
+    command->write = write;
+    command->response = response;
+    command->callback = callback;
+    command->arg[0] = '\0';
+    command->text = NULL;
+    return command;
 }
 
-void GSMSIM300::listSMS(const char *type) {
-    setSMSTextMode();
-    gsm->print(F("AT+CMGL=\""));
-    gsm->print(type);
-    gsm->print(F("\"\r"));
-
+void GSMSIM300::updateCommands() {
+#ifndef GSM_NO_SMS_IN
+    // The acknowledgement is queued as soon as there is room, as the network delivers the message again if it is not acknowledged
+    if (directAck && queueCommand(GSM_COMMAND_CNMA, GSM_WAIT_COMMAND, directAck, NULL, URC_NONE, NULL, true))
+        directAck = NULL;
+#endif
+    if (commandActive) {
+        GSMCommand *command = &commandQueue[commandHead];
+        if (command->response != URC_NONE && urcEvent == command->response) {
+            completeCommand(GSM_RESULT_OK);
+        } else if (lineComplete && commandBody) {
+            commandBody = false; // The content of a message is never a final response
+        } else if (lineComplete) { // The error code is parsed from the assembled line, so the other state machines are never blocked
+            char *str;
+            if (isLine(F("OK"))) {
+                if (command->response == URC_NONE) // The final response is ignored if it is followed by the expected response
+                    completeCommand(GSM_RESULT_OK);
+            } else if (isLine(F("ERROR"))) {
+                commandError = 0;
+                commandErrorCms = false;
+                handleError(GSM_RECOVERY_NONE);
+            } else if ((str = checkLine(F("+CME ERROR:")))) {
+                commandError = atoi(str);
+                commandErrorCms = false;
+                handleError(errorTier(commandError, false));
+            } else if ((str = checkLine(F("+CMS ERROR:")))) {
+                commandError = atoi(str);
+                commandErrorCms = true;
+                handleError(errorTier(commandError, true));
+            }
+#ifndef GSM_NO_CALLS
+            else if ((command->type == GSM_COMMAND_ATD || command->type == GSM_COMMAND_ATA) && callResult() != CALL_EVENT_NONE)
+                completeCommand(GSM_RESULT_ERROR); // BUSY, NO ANSWER, NO DIALTONE and NO CARRIER are final responses as well
+#endif
+        } else if (clock->millis() - commandTimer > commandTimeout) {
 #ifdef DEBUG
-    // Returned as:
-    // +CMGL: 1,"REC READ","number",,"13/06/16,15:01:58+08"
-    // Content
-
-    uint32_t startTime;
-    const char *header = "+CMGL:";
-    char *pHeader = (char*)header;
-
-    while (1) {
-        startTime = millis();
-        while (!checkString(gsm->read(),header,&pHeader)) {
-            if (millis() - startTime > 1000)
-                return;
+            Serial.print(F("\r\nNo response from GSM module within "));
+            Serial.print(commandTimeout);
+            Serial.println(F(" ms"));
+#endif
+            // Back off, so a slow response is not mistaken for a dead module again
+            uint8_t wait = command->wait;
+            timeout[wait] = timeout[wait] > timeoutLimits[wait][2] / 2 ? timeoutLimits[wait][2] : timeout[wait] * 2;
+#ifdef GSM_STATS
+            if (stats.timeouts < 0xFFFF)
+                stats.timeouts++;
+            statsCommand = GSM_COMMAND_NONE;
+#endif
+            if (command->callback)
+                recover(GSM_RECOVERY_RETRY);
+            else { // Nobody waits for the result, so the command is dropped
+                commandActive = false;
+                commandHead = (commandHead + 1) % GSM_COMMAND_QUEUE_SIZE;
+                commandCount--;
+            }
         }
-        while (gsm->read() != ',') {
-            if (millis() - startTime > 1000)
-                return;
+    } else if (lineComplete && (isLine(F("ERROR")) || checkLine(F("+CME ERROR:")) || checkLine(F("+CMS ERROR:"))))
+        modemConfig = 0; // The configuration is unknown if an error is received at any time
+
+    // Send the next command. A command that does not need to be sent completes at once.
+    while (!commandActive && commandCount > 0) {
+        GSMCommand *command = &commandQueue[commandHead];
+        if (gsmState != GSM_RUNNING && command->callback != &GSMSIM300::gsmResponse)
+            break; // Only the GSM state machine sends commands while the module is not running
+        if (command->write) {
+            if (!(this->*command->write)()) {
+                completeCommand(GSM_RESULT_OK);
+                continue;
+            }
+        } else {
+            out->print(command->request);
+            out->print(F("\r"));
         }
-
-        if (extractContent(numberIn, sizeof(numberIn), ',', '"', 1) && extractContent(messageIn, sizeof(messageIn), '\n', '\r', 0)) { // TODO: Take care of new line in a message
-            Serial.print(F("Received: \""));
-            Serial.print(messageIn);
-            Serial.print(F("\" From: "));
-            Serial.println(numberIn);
-        } else
-            return;
+        startCommand(command->type);
+        commandActive = true;
+        commandBody = false;
+        commandTimer = clock->millis();
+        commandTimeout = timeout[command->wait];
     }
-#endif
 }
 
-void GSMSIM300::deleteSMSAll(const char *type) {
-    setSMSTextMode();
-    gsm->print(F("AT+CMGDA=\""));
-    gsm->print(type);
-    gsm->print(F("\"\r"));
-
-#ifdef DEBUG
-    Serial.print(F("Deleted all messages of the following type: "));
-    Serial.println(type);
+void GSMSIM300::completeCommand(uint8_t result) {
+    GSMCommand *command = &commandQueue[commandHead];
+    if (result == GSM_RESULT_OK && commandActive) { // Commands that were not sent have no response time
+#ifdef EXTRADEBUG
+        Serial.print(F("\r\nResponse success: "));
+        Serial.println(command->response != URC_NONE ? reinterpret_cast<const __FlashStringHelper *>(urcStrings[command->response - 1]) : F("OK"));
 #endif
+        updateTimeout(command->wait, clock->millis() - commandTimer);
+        if (gsmState == GSM_RUNNING) // The module works again, so an isolated error later on starts from the lowest tier. The AT of GSM_RESYNC does not count.
+            recoveryTier = GSM_RECOVERY_NONE;
+    }
+    void (GSMSIM300::*callback)(uint8_t) = command->callback;
+    // The command is removed before the callback, so the callback can queue the next command of the exchange
+    commandActive = false;
+    commandHead = (commandHead + 1) % GSM_COMMAND_QUEUE_SIZE;
+    commandCount--;
+    if (callback)
+        (this->*callback)(result);
 }
 
-void GSMSIM300::deleteSMS(char *index) {
-    if (index == NULL) {
-        if (strlen(lastIndex) == 0) {
-#ifdef DEBUG
-            Serial.println(F("No index was set"));
-#endif
-            return;
-        }
-        index = lastIndex;
+void GSMSIM300::flushCommands() {
+    if (commandActive) {
+        commandActive = false;
+        commandHead = (commandHead + 1) % GSM_COMMAND_QUEUE_SIZE;
+        commandCount--;
+    }
+    // Only the commands nobody waits for are kept, i.e. messages to delete
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < commandCount; i++) {
+        GSMCommand *command = &commandQueue[(commandHead + i) % GSM_COMMAND_QUEUE_SIZE];
+        if (!command->callback)
+            commandQueue[(commandHead + count++) % GSM_COMMAND_QUEUE_SIZE] = *command;
     }
-    setSMSTextMode();
-    gsm->print(F("AT+CMGD="));
-    gsm->print(index);
-    gsm->print(F("\r"));
+    commandCount = count;
+}
 
+void GSMSIM300::handleError(uint8_t tier) {
 #ifdef DEBUG
-    Serial.print(F("Deleted SMS at index: "));
-    Serial.println(index);
+    Serial.print(F("The GSM module returned the following error: "));
+    Serial.println(lineBuffer);
 #endif
+    modemConfig = 0; // The command that failed might have been one of the configuration commands
+    if (gsmState == GSM_RUNNING && commandQueue[commandHead].callback && commandError == (commandErrorCms ? 331 : 30)) {
+        // No network service, so the requests are held until the module is registered again instead of recovering the module
+        registration = GSM_REG_SEARCHING;
+        signalTimer = clock->millis() - GSM_SIGNAL_INTERVAL; // Poll the registration in case the network is already back
+        flushCommands();
+        restartRequests(false);
+    } else if (commandQueue[commandHead].callback && tier != GSM_RECOVERY_NONE)
+        recover(tier);
+    else // Only the command failed, the module itself is fine
+        completeCommand(GSM_RESULT_ERROR);
 }
 
-//gsm->print(F("ATS0=001\r")); // Activate auto answer - 'RING' will be received on an incoming call
-//gsm->print(F("AT+CSQ\r")); // Check signal strength - response: 'OK' and then the information
-
-void GSMSIM300::sendSMS(const char *num, const char *mes) {
-    strcpy(numberOut,num);
-    strcpy(messageOut,mes);
-    smsState = SMS_MODE;
+uint8_t GSMSIM300::errorTier(uint16_t code, bool cms) {
+    if (cms) {
+        if (code >= 310 && code <= 315) // SIM errors use the same codes as +CME ERROR plus 300
+            code -= 300;
+        else if (code == 331 || code == 332) // No network service and network timeout
+            code -= 301;
+        else
+            return GSM_RECOVERY_NONE; // The message was rejected
+    }
+    switch (code) {
+        case 14: // SIM busy
+        case 30: // No network service
+        case 31: // Network timeout
+        case 100: // Unknown
+            return GSM_RECOVERY_RETRY;
+        case 10: // SIM not inserted
+        case 11: // SIM PIN required - the module has restarted
+        case 13: // SIM failure
+        case 15: // SIM wrong
+            return GSM_RECOVERY_RESET;
+        default: // The command itself was not allowed or not supported
+            return GSM_RECOVERY_NONE;
+    }
 }
 
-bool GSMSIM300::readSMS(char *index) {
+void GSMSIM300::recover(uint8_t tier) {
+    if (gsmState == GSM_BAUD_SETTLE || gsmState == GSM_BAUD_VERIFY) {
+        // The link is unreliable at the higher rate, so the module is turned off to get it back to autobaud
+#ifdef DEBUG
+        Serial.println(F("Baud rate is unreliable"));
+#endif
+#ifdef GSM_STATS
+        if (stats.baudFallbacks < 0xFFFF)
+            stats.baudFallbacks++;
+#endif
+        baudFailed = true;
+        tier = GSM_RECOVERY_POWER;
+    }
+    if (tier <= recoveryTier) // The last recovery did not help
+        tier = recoveryTier + 1;
+    if (tier > GSM_RECOVERY_RETRY && gsmState != GSM_RUNNING && gsmState != GSM_RESYNC_WAIT)
+        tier = GSM_RECOVERY_POWER; // The module did not boot properly, so it is turned off and on again
+    if (tier > GSM_RECOVERY_POWER)
+        tier = GSM_RECOVERY_POWER;
+    recoveryTier = tier;
+#ifdef DEBUG
+    Serial.print(F("Recovery tier: "));
+    Serial.println(tier);
+#endif
+#ifdef GSM_STATS
+    if (stats.recoveries[tier] < 0xFFFF)
+        stats.recoveries[tier]++;
+#endif
+    modemConfig = 0;
+    flushCommands();
+    restartRequests(tier >= GSM_RECOVERY_RESET);
+
+    // The state that sends the failed command again
+    uint8_t retryState;
+    if (gsmState == GSM_RESYNC_WAIT)
+        retryState = resumeState;
+    else if (gsmState == GSM_RUNNING)
+        retryState = GSM_RUNNING;
+    else if (gsmState >= GSM_CHECK_CONNECTION && gsmState < GSM_RUNNING)
+        retryState = GSM_CHECK_CONNECTION;
+    else if (gsmState >= GSM_POWER_ON_SYNC && gsmState < GSM_RUNNING)
+        retryState = GSM_POWER_ON_SYNC;
+    else
+        retryState = GSM_POWER_ON; // The power off sequence is not retried
+    powerTimer = clock->millis();
+    signalTimer = clock->millis() - GSM_SIGNAL_INTERVAL; // A sample that failed is taken again straight away once the module is running
+
+    if (tier == GSM_RECOVERY_RETRY)
+        gsmState = retryState;
+    else if (tier == GSM_RECOVERY_RESYNC) {
+        resumeState = retryState;
+        gsmState = GSM_RESYNC;
+    } else if (tier == GSM_RECOVERY_RESET)
+        gsmState = GSM_RESET;
+    else
+        gsmState = GSM_POWER_ON;
+}
+
+void GSMSIM300::restartRequests(bool reset) {
+#ifndef GSM_NO_SMS_OUT
+    if (smsState > SMS_MODE && smsCount > 0) {
+        SMSQueueEntry *entry = &smsQueue[smsHead];
+        if (++entry->attempts >= GSM_SMS_ATTEMPTS) {
+#ifdef DEBUG
+            Serial.println(F("SMS could not be sent"));
+#endif
+            finishSMS(SMS_STATUS_FAILED);
+        } else
+            entry->status = SMS_STATUS_QUEUED; // The segment being sent is sent again, so the recipient might receive it twice
+    }
+    smsState = SMS_IDLE;
+#endif
+
+#ifndef GSM_NO_CALLS
+    if (callState == CALL_DIAL)
+        callState = CALL_NUMBER; // Dial again
+    else if (callState == CALL_INCOMING)
+        callState = CALL_IDLE; // Answered again on the next RING
+    else if (reset && callState != CALL_IDLE && callState != CALL_NUMBER)
+        callEvent(CALL_IDLE, CALL_EVENT_ENDED); // The call is lost when the module is reset, so it has to be placed again
+#else
+    (void)reset;
+#endif
+
+#ifndef GSM_NO_SMS_IN
+    if (inboxState == INBOX_MESSAGE || (inboxState == INBOX_DIRECT && !directPDU))
+        finishBody(false);
+    if (inboxState == INBOX_DIRECT)
+        inboxState = directResume; // It is not acknowledged, so the network delivers it again
+    if (inboxState == INBOX_DELETE)
+        inboxState = INBOX_CLEAR;
+    else if (inboxState == INBOX_MODE || inboxState == INBOX_HEADER || inboxState == INBOX_MESSAGE)
+        inboxState = listType == NULL ? INBOX_READ : INBOX_LIST; // The messages are read again from the start
+#endif
+}
+
+bool GSMSIM300::powerDelay(uint16_t ms) {
+    if (clock->millis() - powerTimer < ms) {
+        powerWait = ms;
+        return false;
+    }
+    powerTimer = clock->millis();
+    return true;
+}
+
+uint32_t GSMSIM300::getNextDeadline() {
+    if (updateBusy)
+        return 0;
+    uint32_t now = clock->millis(), wait = GSM_NO_DEADLINE;
+    if (powerWait) {
+        uint32_t elapsed = now - powerTimer;
+        wait = elapsed >= powerWait ? 0 : powerWait - elapsed;
+    }
+    if (commandActive) { // The command times out once the timeout has been exceeded
+        uint32_t elapsed = now - commandTimer;
+        uint32_t commandWait = elapsed > commandTimeout ? 0 : commandTimeout - elapsed + 1;
+        if (commandWait < wait)
+            wait = commandWait;
+    }
+#if GSM_SIGNAL_INTERVAL != 0
+    if (gsmState == GSM_RUNNING && commandCount == 0) { // The next sample of the signal quality
+        uint32_t elapsed = now - signalTimer;
+        uint32_t signalWait = elapsed >= GSM_SIGNAL_INTERVAL ? 0 : GSM_SIGNAL_INTERVAL - elapsed;
+        if (signalWait < wait)
+            wait = signalWait;
+    }
+#endif
+    return wait;
+}
+
+#ifdef LATENCYDEBUG
+void GSMSIM300::printLatency() {
+    Serial.println(F("Worst-case update() time in us for every GSM, SMS and call state:"));
+    for (uint8_t i = 0; i < GSM_STATE_COUNT; i++) {
+        Serial.print(F("GSM "));
+        Serial.print(i);
+        Serial.print(F(": "));
+        Serial.println(gsmLatency[i]);
+    }
+#ifndef GSM_NO_SMS_OUT
+    for (uint8_t i = 0; i < SMS_STATE_COUNT; i++) {
+        Serial.print(F("SMS "));
+        Serial.print(i);
+        Serial.print(F(": "));
+        Serial.println(smsLatency[i]);
+    }
+#endif
+#ifndef GSM_NO_CALLS
+    for (uint8_t i = 0; i < CALL_STATE_COUNT; i++) {
+        Serial.print(F("Call "));
+        Serial.print(i);
+        Serial.print(F(": "));
+        Serial.println(callLatency[i]);
+    }
+#endif
+}
+#endif
+
+#ifdef GSM_STATS
+void GSMSIM300::startCommand(uint8_t command) {
+    // Commands are often sent as soon as the response is matched, before the end of the line is received,
+    // so the line is handled now and skipped once it is complete
+    statsSkipLine = false;
+    if (lineLength > 0 && lineLength < sizeof(lineBuffer)) {
+        lineBuffer[lineLength] = '\0';
+        updateStats();
+        statsSkipLine = true;
+    }
+    statsCommand = command;
+    statsCommandTime = clock->millis();
+}
+
+void GSMSIM300::updateStats() {
+    if (statsSkipLine) { // The line was handled when the command was sent
+        statsSkipLine = false;
+        return;
+    }
+
+    // The latency is recorded when the final response of the last command is received
+    bool final = isLine(F("OK")) || isLine(F("ERROR"));
+    char *str;
+    if ((str = checkLine(F("+CME ERROR:")))) {
+        if (stats.cmeErrors < 0xFFFF)
+            stats.cmeErrors++;
+        stats.lastCmeError = atoi(str);
+        final = true;
+    } else if ((str = checkLine(F("+CMS ERROR:")))) {
+        if (stats.cmsErrors < 0xFFFF)
+            stats.cmsErrors++;
+        stats.lastCmsError = atoi(str);
+        final = true;
+    }
+    if (!final || statsCommand == GSM_COMMAND_NONE)
+        return;
+
+    uint32_t latency = clock->millis() - statsCommandTime;
+    uint8_t bucket = 0;
+    while (bucket < GSM_STATS_BUCKETS - 1 && latency >= (16UL << bucket))
+        bucket++;
+    if (stats.latency[statsCommand][bucket] < 0xFFFF)
+        stats.latency[statsCommand][bucket]++;
+    if (latency > stats.maxLatency[statsCommand])
+        stats.maxLatency[statsCommand] = latency > 0xFFFF ? 0xFFFF : latency;
+    statsCommand = GSM_COMMAND_NONE;
+}
+
+void GSMSIM300::updateStateTime() {
+    uint32_t now = clock->millis();
+    stats.stateTime[statsState] += now - statsStateTime;
+    statsState = gsmState;
+    statsStateTime = now;
+}
+
+const GSMStats &GSMSIM300::getStats() {
+    updateStateTime(); // Include the time spent in the current state
+    stats.baudRate = baudRate;
+    return stats;
+}
+
+void GSMSIM300::resetStats() {
+    memset(&stats, 0, sizeof(stats));
+    statsCommand = GSM_COMMAND_NONE;
+    statsSkipLine = false;
+    statsState = gsmState;
+    statsStateTime = clock->millis();
+}
+
+void GSMSIM300::printStats() {
+    static const char *const commandNames[GSM_COMMAND_COUNT] = { "AT", "AT+CPIN", "AT+CREG", "AT+CMGF/CSCS", "AT+CMGS", "AT+CMGR", "AT+CMGL", "AT+CMGD", "ATD", "AT+CLCC", "ATH", "ATA", "AT+CSQ", "AT+CNMA" };
+    getStats();
+    Serial.print(F("Latency histogram in buckets of less than 16, 32, 64 ... ms:"));
+    for (uint8_t i = 0; i < GSM_COMMAND_COUNT; i++) {
+        Serial.print(F("\r\n"));
+        Serial.print(commandNames[i]);
+        Serial.print(F(":"));
+        for (uint8_t j = 0; j < GSM_STATS_BUCKETS; j++) {
+            Serial.print(F(" "));
+            Serial.print(stats.latency[i][j]);
+        }
+        Serial.print(F(" max: "));
+        Serial.print(stats.maxLatency[i]);
+    }
+    Serial.print(F("\r\nTimeouts: "));
+    Serial.print(stats.timeouts);
+    Serial.print(F(" CME errors: "));
+    Serial.print(stats.cmeErrors);
+    Serial.print(F(" (last: "));
+    Serial.print(stats.lastCmeError);
+    Serial.print(F(") CMS errors: "));
+    Serial.print(stats.cmsErrors);
+    Serial.print(F(" (last: "));
+    Serial.print(stats.lastCmsError);
+    Serial.print(F(") Power cycles: "));
+    Serial.println(stats.powerCycles);
+    Serial.print(F("Recoveries (retry, resync, reset, power):"));
+    for (uint8_t i = GSM_RECOVERY_RETRY; i < GSM_RECOVERY_COUNT; i++) {
+        Serial.print(F(" "));
+        Serial.print(stats.recoveries[i]);
+    }
+    Serial.println();
+    Serial.print(F("RX: "));
+    Serial.print(stats.rxBytes);
+    Serial.print(F(" TX: "));
+    Serial.print(stats.txBytes);
+    Serial.print(F(" Dropped: "));
+    Serial.print(stats.droppedBytes);
+    Serial.print(F(" Overruns: "));
+    Serial.println(rxOverruns);
+    uint32_t time = 0;
+    for (uint8_t i = 0; i < GSM_STATE_COUNT; i++)
+        time += stats.stateTime[i];
+    Serial.print(F("Baud rate: "));
+    Serial.print(stats.baudRate);
+    Serial.print(F(" Fallbacks: "));
+    Serial.print(stats.baudFallbacks);
+    Serial.print(F(" Effective: "));
+    Serial.print(time ? (stats.rxBytes + stats.txBytes) * 1000.0f / time : 0);
+    Serial.println(F(" bytes/s"));
+    Serial.println(F("Time in ms spent in every GSM state:"));
+    for (uint8_t i = 0; i < GSM_STATE_COUNT; i++) {
+        Serial.print(i);
+        Serial.print(F(": "));
+        Serial.println(stats.stateTime[i]);
+    }
+}
+#endif
+
+#ifndef GSM_NO_SMS_IN
+void GSMSIM300::checkSMS() {
+    if (incomingChar < 0)
+        return;
+    if (readIndex) {
+        if (incomingChar == '\r') { // End of index
+            lastIndex[indexCounter] = '\0';
+            readIndex = false;
+            newSms = true;
+#ifdef DEBUG
+            Serial.print(F("Received SMS at index: "));
+            Serial.println(lastIndex);
+#endif
+        } else if (indexCounter < sizeof(lastIndex)-1)
+            lastIndex[indexCounter++] = (char)incomingChar;
+        else {
+#ifdef DEBUG
+            Serial.println(F("Index is too long"));
+#endif
+            readIndex = false;
+        }
+    } else if (urcEvent == URC_RECEIVE_SMS) {
+        readIndex = true;
+        indexCounter = 0;
+    }
+}
+
+#endif
+
+uint8_t GSMSIM300::matchURC(int input) {
+    if (input < 0)
+        return URC_NONE;
+    uint8_t state = urcState;
+    while (true) {
+        if (state == 0) { // Nothing is matched, so the byte can only start a code
+            for (uint8_t code = 0; code < URC_COUNT; code++) {
+                if (pgm_read_byte(&urcStrings[code][0]) == (uint8_t)input) {
+                    state = code << 5 | 1;
+                    break;
+                }
+            }
+            break;
+        }
+        uint8_t code = state >> 5, matched = state & 0x1F;
+        uint8_t next = pgm_read_byte(&urcStrings[code][matched]);
+        if (next != '\0' && next == (uint8_t)input) {
+            state++;
+            break;
+        }
+        state = pgm_read_byte(&urcFail[code][matched]); // The byte is tested again against the longest suffix that is still a prefix
+    }
+    urcState = state;
+    if (state != 0 && pgm_read_byte(&urcStrings[state >> 5][state & 0x1F]) == '\0')
+        return (state >> 5) + 1;
+    return URC_NONE;
+}
+
+#ifndef GSM_NO_SMS_OUT
+// updateSMS() and updateCall() can not get stuck: every state that waits does so on a queued command, which always completes with its response, an error or
+// a timeout. The next command of an exchange is queued as urgent from the callback, so it always fits, and the recovery restarts or ends the exchange of both state machines.
+void GSMSIM300::updateSMS() {
+    switch(smsState) {
+        case SMS_IDLE:
+            if (smsCount > 0 && isRegistered()) // Start sending the next message in the queue once the module is registered
+                smsState = SMS_MODE;
+            break;
+
+        case SMS_MODE:
+            if (channelFree())
+                configureSMS(false);
+            break;
+
+        case SMS_WAIT: // The message reference is received before the final response
+        {
+            char *str;
+            if (lineComplete && (str = checkLine(F("+CMGS:"))))
+                smsQueue[smsHead].messageReference = atoi(str);
+            break;
+        }
+
+        default: // The other states wait for smsResponse()
+            break;
+    }
+}
+
+void GSMSIM300::smsResponse(uint8_t result) {
+    if (result != GSM_RESULT_OK) { // The message was rejected
+#ifdef DEBUG
+        Serial.println(F("SMS could not be sent"));
+#endif
+        finishSMS(SMS_STATUS_FAILED);
+        smsState = SMS_IDLE;
+        return;
+    }
+
+    switch(smsState) {
+        case SMS_ALPHABET:
+            sendSMSAlphabet();
+            break;
+
+        case SMS_NUMBER:
+            sendSMSNumber();
+            break;
+
+        case SMS_CONTENT: // The content is written as soon as the prompt is received
+            queueCommand(GSM_COMMAND_CMGS, GSM_WAIT_NETWORK, NULL, &GSMSIM300::writeSMSContent, URC_NONE, &GSMSIM300::smsResponse, true);
+            smsState = SMS_WAIT;
+            break;
+
+        case SMS_WAIT:
+        {
+            SMSQueueEntry *entry = &smsQueue[smsHead];
+            if (entry->pduMode && entry->pdu.segment < entry->pdu.segments) { // Send the next segment straight away
+                entry->pdu.start = entry->pdu.end;
+                entry->pdu.segment++;
+                entry->pdu.end = GSMPDU::findSegment(entry->pdu.text, entry->pdu.start, entry->pdu.ucs2, true, &entry->pdu.units);
+                sendSMSNumber();
+                break;
+            }
+#ifdef DEBUG
+            Serial.println(F("SMS is sent"));
+#endif
+            finishSMS(SMS_STATUS_SENT);
+            if (smsCount == 0 || !configureSMS(true)) // The next message is sent straight away
+                smsState = SMS_IDLE;
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+// The text mode and alphabet are only sent if the modem is not already configured
+bool GSMSIM300::configureSMS(bool urgent) {
+    if (!queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, smsQueue[smsHead].pduMode ? &GSMSIM300::writePDUMode : &GSMSIM300::writeTextMode, URC_NONE, &GSMSIM300::smsResponse, urgent))
+        return false;
+    smsState = SMS_ALPHABET;
+    return true;
+}
+
+void GSMSIM300::sendSMSAlphabet() {
+    if (smsQueue[smsHead].pduMode) { // The alphabet is given by the data coding scheme of the PDU
+        sendSMSNumber();
+        return;
+    }
+    queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeAlphabet, URC_NONE, &GSMSIM300::smsResponse, true);
+    smsState = SMS_NUMBER;
+}
+
+void GSMSIM300::sendSMSNumber() {
+    queueCommand(GSM_COMMAND_CMGS, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeSMSNumber, URC_PROMPT, &GSMSIM300::smsResponse, true);
+    smsState = SMS_CONTENT;
+}
+
+#endif
+
+#if !defined(GSM_NO_SMS_IN) || !defined(GSM_NO_SMS_OUT)
+bool GSMSIM300::writeTextMode() {
+    if (modemConfig & CONFIG_TEXT_MODE) {
+        skippedCommands++;
+        return false;
+    }
+#ifdef DEBUG
+    Serial.println(F("SMS setting text mode"));
+#endif
+    out->print(F("AT+CMGF=1\r")); // Set SMS type to text mode
+    modemConfig = (modemConfig & ~CONFIG_PDU_MODE) | CONFIG_TEXT_MODE;
+    return true;
+}
+
+#endif
+
+#ifndef GSM_NO_SMS_OUT
+bool GSMSIM300::writePDUMode() {
+    if (modemConfig & CONFIG_PDU_MODE) {
+        skippedCommands++;
+        return false;
+    }
+#ifdef DEBUG
+    Serial.println(F("SMS setting PDU mode"));
+#endif
+    out->print(F("AT+CMGF=0\r")); // Set SMS type to PDU mode
+    modemConfig = (modemConfig & ~CONFIG_TEXT_MODE) | CONFIG_PDU_MODE;
+    return true;
+}
+
+bool GSMSIM300::writeAlphabet() {
+    if (modemConfig & CONFIG_GSM_ALPHABET) {
+        skippedCommands++;
+        return false;
+    }
+#ifdef DEBUG
+    Serial.println(F("SMS setting alphabet"));
+#endif
+    out->print(F("AT+CSCS=\"GSM\"\r")); // GSM default alphabet
+    modemConfig |= CONFIG_GSM_ALPHABET;
+    return true;
+}
+
+bool GSMSIM300::writeSMSNumber() {
+    SMSQueueEntry *entry = &smsQueue[smsHead];
+#ifdef DEBUG
+    Serial.print(F("Number: "));
+    Serial.println(entry->number);
+#endif
+    if (entry->pduMode) {
+        out->print(F("AT+CMGS="));
+        out->print(GSMPDU::submitLength(entry->number, entry->pdu.ucs2, entry->pdu.segments > 1, entry->pdu.units));
+        out->print(F("\r"));
+    } else {
+        out->print(F("AT+CMGS=\""));
+        out->print(entry->number);
+        out->print(F("\"\r"));
+    }
+    entry->status = SMS_STATUS_SENDING;
+    return true;
+}
+
+bool GSMSIM300::writeSMSContent() {
+    SMSQueueEntry *entry = &smsQueue[smsHead];
+    if (entry->pduMode) { // The PDU is encoded while it is written, so the text is never copied
+#ifdef DEBUG
+        Serial.print(F("Segment: "));
+        Serial.print(entry->pdu.segment);
+        Serial.print(F("/"));
+        Serial.println(entry->pdu.segments);
+#endif
+        GSMPDU::writeSubmit(out, entry->number, entry->pdu.text, entry->pdu.start, entry->pdu.end, entry->pdu.units, entry->pdu.ucs2, entry->pdu.reference, entry->pdu.segment, entry->pdu.segments);
+    } else {
+#ifdef DEBUG
+        Serial.print(F("Message: \""));
+        Serial.print(entry->message);
+        Serial.println(F("\""));
+#endif
+        out->print(entry->message);
+    }
+    out->write(26); // CTRL-Z
+    return true;
+}
+
+void GSMSIM300::finishSMS(uint8_t status) {
+    smsQueue[smsHead].status = status; // The status is kept until the entry is reused
+    smsHead = (smsHead + 1) % SMS_QUEUE_SIZE;
+    smsCount--;
+}
+
+#endif
+
+#ifndef GSM_NO_CALLS
+void GSMSIM300::updateCall() {
+    // The call is tracked from the +CLCC URCs and the final result codes, so the module is never polled
+    if (callState == CALL_NUMBER) {
+        if (!isRegistered())
+            return; // Wait for the network
+#ifdef DEBUG
+        Serial.print(F("Calling: "));
+        Serial.println(numberOut);
+#endif
+        queueCommand(GSM_COMMAND_CLCC, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeCallURC, URC_NONE, NULL);
+        if (queueCommand(GSM_COMMAND_ATD, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeDial, URC_NONE, &GSMSIM300::callResponse))
+            callState = CALL_DIAL;
+    } else if (urcEvent == URC_INCOMING_CALL) {
+        if (callState == CALL_IDLE) { // RING is repeated until the call is answered
+            numberOut[0] = '\0'; // Unknown unless +CLCC was received first
+            answer();
+        }
+    } else if (lineComplete) {
+        char *str;
+        uint8_t event;
+        if ((str = checkLine(F("+CLCC:"))))
+            parseCall(str);
+        else if (callState >= CALL_DIAL && callState < CALL_ACTIVE && checkLine(F("+COLP:")))
+            callEvent(CALL_ACTIVE, CALL_EVENT_CONNECTED); // Only sent if AT+COLP=1 has been set by the user
+        else if (callState >= CALL_DIAL && (event = callResult()) != CALL_EVENT_NONE)
+            callEvent(CALL_IDLE, event);
+    } else if (callState == CALL_IDLE && !(modemConfig & CONFIG_CALL_URC) && commandCount == 0)
+        queueCommand(GSM_COMMAND_CLCC, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeCallURC, URC_NONE, NULL); // Enabled again after an error, so incoming calls are reported with their number
+}
+
+void GSMSIM300::parseCall(char *str) {
+    // Returned as: +CLCC: <id>,<dir>,<stat>,<mode>,<mpty>,"number",<type>
+    char *fields[6];
+    uint8_t count = splitFields(str, fields, 6);
+    if (count < 3)
+        return;
+    uint8_t stat = atoi(fields[2]);
+#ifdef EXTRADEBUG
+    Serial.print(F("\r\nCall status: "));
+    Serial.print(stat);
+#endif
+    if (callState == CALL_IDLE) {
+        if (stat == 4 && atoi(fields[1]) == 1) { // Incoming
+            if (count == 6)
+                copyField(numberOut, sizeof(numberOut), fields[5]);
+            else
+                numberOut[0] = '\0';
+            answer();
+        }
+    } else if (stat == 0) { // Active
+        if (callState != CALL_ACTIVE)
+            callEvent(CALL_ACTIVE, CALL_EVENT_CONNECTED);
+    } else if (stat == 3) { // Alerting
+        if (callState == CALL_DIAL || callState == CALL_SETUP)
+            callEvent(CALL_ALERTING, CALL_EVENT_RINGING);
+    }
+    // A disconnected call is followed by a final result code telling why, so it ends on that instead
+}
+
+uint8_t GSMSIM300::callResult() {
+    if (isLine(F("BUSY")))
+        return CALL_EVENT_BUSY;
+    if (isLine(F("NO ANSWER")))
+        return CALL_EVENT_NO_ANSWER;
+    if (isLine(F("NO DIALTONE")))
+        return CALL_EVENT_FAILED;
+    if (isLine(F("NO CARRIER")))
+        return CALL_EVENT_ENDED;
+    return CALL_EVENT_NONE;
+}
+
+void GSMSIM300::callEvent(uint8_t newState, uint8_t event) {
+#ifdef DEBUG
+    Serial.print(F("Call event: "));
+    Serial.println(event);
+#endif
+    callState = newState;
+    if (callCallback)
+        callCallback(event, numberOut);
+}
+
+void GSMSIM300::callResponse(uint8_t result) {
+    if (result != GSM_RESULT_OK) {
+        if (callState == CALL_DIAL || callState == CALL_INCOMING) { // Otherwise the call has already ended
+            uint8_t event = callResult();
+            callEvent(CALL_IDLE, event == CALL_EVENT_NONE ? CALL_EVENT_FAILED : event);
+        }
+        return;
+    }
+
+    if (callState == CALL_DIAL) // The +CLCC URCs might have been received first
+        callState = CALL_SETUP;
+    else if (callState == CALL_INCOMING)
+        callEvent(CALL_ACTIVE, CALL_EVENT_CONNECTED);
+}
+
+bool GSMSIM300::writeCallURC() {
+    if (modemConfig & CONFIG_CALL_URC) {
+        skippedCommands++;
+        return false;
+    }
+    out->print(F("AT+CLCC=1\r")); // Send +CLCC: <id>,<dir>,<stat>,... when the state of a call changes
+    modemConfig |= CONFIG_CALL_URC;
+    return true;
+}
+
+bool GSMSIM300::writeDial() {
+    out->print(F("ATD")); // Dial
+    out->print(numberOut);
+    out->print(F(";\r"));
+    return true;
+}
+
+#endif
+
+void GSMSIM300::updateTimeout(uint8_t wait, uint32_t rtt) {
+    // The smoothed response time and variation are calculated like the retransmission timeout of TCP in RFC 6298
+    if (rtt == 0)
+        rtt = 1; // 0 is used to indicate that no response has been received yet
+    if (srtt[wait] == 0) {
+        srtt[wait] = rtt << 3;
+        rttvar[wait] = rtt << 1;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(srtt[wait] >> 3);
+        srtt[wait] += delta; // srtt = 7/8 srtt + 1/8 rtt
+        if (delta < 0)
+            delta = -delta;
+        rttvar[wait] += delta - (int32_t)(rttvar[wait] >> 2); // rttvar = 3/4 rttvar + 1/4 |srtt - rtt|
+    }
+    uint32_t rto = (srtt[wait] >> 3) + rttvar[wait]; // srtt + 4 * rttvar
+    if (rto < timeoutLimits[wait][0])
+        rto = timeoutLimits[wait][0];
+    else if (rto > timeoutLimits[wait][2])
+        rto = timeoutLimits[wait][2];
+    timeout[wait] = rto;
+}
+
+bool GSMSIM300::channelFree() {
+#ifndef GSM_NO_SMS_OUT
+    if (smsState > SMS_MODE)
+        return false;
+#endif
+#ifndef GSM_NO_SMS_IN
+    if (inboxState > INBOX_LIST && inboxState != INBOX_CLEAR)
+        return false;
+#endif
+    return true;
+}
+
+#ifndef GSM_NO_SMS_IN
+void GSMSIM300::updateInbox() {
+    if (lineComplete && inboxState != INBOX_MESSAGE && inboxState != INBOX_DIRECT && parseDirect())
+        return;
+    switch(inboxState) {
+        case INBOX_READ:
+        case INBOX_LIST:
+            if (!channelFree())
+                break;
+            inboxCount = 0;
+            if (queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeTextMode, URC_NONE, &GSMSIM300::inboxResponse))
+                inboxState = INBOX_MODE;
+            break;
+
+        case INBOX_HEADER:
+            if (lineComplete) {
+                commandTimer = clock->millis(); // A list can take a long time, so the timeout is from the last line instead
+                parseHeader();
+            }
+            break;
+
+        case INBOX_MESSAGE:
+            updateBody();
+            break;
+
+        case INBOX_CLEAR: // The delete was interrupted by error recovery
+            if (channelFree())
+                sendInboxDelete(false);
+            break;
+
+        case INBOX_DIRECT:
+            updateDirect();
+            break;
+
+        case INBOX_IDLE:
+            // The routing and text mode are set again after an error or after a message was sent in PDU mode, so +CMT stays in text mode
+            if (directSMS && commandCount == 0) {
+                if (!(modemConfig & CONFIG_DIRECT_SMS))
+                    queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeDirectSMS, URC_NONE, NULL);
+                else if (!(modemConfig & CONFIG_TEXT_MODE))
+                    queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeTextMode, URC_NONE, NULL);
+            }
+            break;
+
+        default: // The other states wait for inboxResponse()
+            break;
+    }
+}
+
+bool GSMSIM300::parseDirect() {
+    // In text mode the header is followed by the content:
+    // +CMT: "number","","13/06/16,15:01:58+08"
+    // In PDU mode it is followed by the PDU:
+    // +CMT: ,<length>
+    char *str, *fields[3];
+    if (!(str = checkLine(F("+CMT:"))))
+        return false;
+    directResume = inboxState;
+    directPDU = splitFields(str, fields, 3) != 3;
+    inboxState = INBOX_DIRECT;
+    bodyBreaks = 0;
+    bodyPartial = false;
+    commandBody = true; // The content is never a final response
+    if (directPDU) // The PDU is skipped and rejected, so the network delivers the message again once text mode is set
+        return true;
+    indexIn[0] = '\0'; // The message is not stored on the SIM card
+    strcpy_P(statusIn, PSTR("REC UNREAD"));
+    copyField(numberIn, sizeof(numberIn), fields[0]);
+    copyField(timestampIn, sizeof(timestampIn), fields[2]);
+    messageIn[0] = '\0';
+    if (bodyCallback && headerCallback)
+        headerCallback(indexIn, statusIn, numberIn, timestampIn);
+    return true;
+}
+
+void GSMSIM300::updateDirect() {
+    // Nothing ends the content except the line break, so the content is the next line. A line that does not fit in the buffer is passed on in parts.
+    if (lineComplete) {
+        if (!directPDU)
+            passBody(lineBuffer, strlen(lineBuffer));
+        finishDirect();
+    } else if (incomingChar == '\n' && lineLength == 0 && bodyPartial) // The end of a line passed on in parts
+        finishDirect();
+    else if (lineLength == sizeof(lineBuffer) - 1) {
+        if (!directPDU)
+            passBody(lineBuffer, lineLength);
+        lineLength = 0;
+        bodyPartial = true;
+    }
+}
+
+void GSMSIM300::finishDirect() {
+    inboxState = directResume;
+    // The acknowledgement is sent before anything else, as the network only waits a few seconds for it. It is queued by updateCommands() if the queue is full.
+    directAck = directPDU ? F("AT+CNMA=2") : F("AT+CNMA");
+    if (queueCommand(GSM_COMMAND_CNMA, GSM_WAIT_COMMAND, directAck, NULL, URC_NONE, NULL, true))
+        directAck = NULL;
+    if (!directPDU)
+        finishBody(true);
+}
+
+void GSMSIM300::setDirectSMS(bool enable) {
+    if (directSMS && !enable) // The routing is set back even if the setting is unknown after an error
+        queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeDirectSMS, URC_NONE, NULL);
+    directSMS = enable;
+}
+
+bool GSMSIM300::writeDirectSMS() {
+    if (!directSMS) {
+        out->print(F("AT+CNMI=2,1,0,0,0\r")); // Store new messages and announce them with +CMTI
+        modemConfig &= ~CONFIG_DIRECT_SMS;
+        return true;
+    }
+    if (modemConfig & CONFIG_DIRECT_SMS) {
+        skippedCommands++;
+        return false;
+    }
+#ifdef DEBUG
+    Serial.println(F("SMS setting direct delivery"));
+#endif
+    out->print(F("AT+CSMS=1;+CNMI=2,2,0,0,0\r")); // Phase 2+ makes the module wait for AT+CNMA before it acknowledges a message to the network
+    modemConfig |= CONFIG_DIRECT_SMS;
+    return true;
+}
+
+bool GSMSIM300::parseHeader() {
+    // Every message is returned as a header followed by the content:
+    // +CMGR: "REC UNREAD","number",,"13/06/16,15:01:58+08"
+    // +CMGL: 1,"REC READ","number",,"13/06/16,15:01:58+08"
+    char *str, *fields[5];
+    if ((str = checkLine(F("+CMGL:"))) && splitFields(str, fields, 5) == 5)
+        copyField(indexIn, sizeof(indexIn), fields[0]);
+    else if (!(str = checkLine(F("+CMGR:"))) || splitFields(str, fields + 1, 4) != 4) { // The index was set by readSMSAsync()
+        inboxState = INBOX_HEADER; // Wait for the next message or the final response
+        return false;
+    }
+    copyField(statusIn, sizeof(statusIn), fields[1]);
+    copyField(numberIn, sizeof(numberIn), fields[2]);
+    copyField(timestampIn, sizeof(timestampIn), fields[4]);
+    messageIn[0] = '\0';
+    bodyBreaks = 0;
+    bodyPartial = false;
+    commandBody = true;
+    inboxState = INBOX_MESSAGE;
+    if (bodyCallback && headerCallback)
+        headerCallback(indexIn, statusIn, numberIn, timestampIn);
+    return true;
+}
+
+void GSMSIM300::updateBody() {
+    // The content can span several lines and ends with the next header or the final response,
+    // so the line breaks are held back until it is known that the content continues
+    bool started = bodyBreaks > 0 && !bodyPartial; // The first line is always content
+    if (lineComplete) {
+        commandTimer = clock->millis();
+        if (started && (checkLine(F("+CMGL:")) || checkLine(F("+CMGR:")))) {
+            finishBody(true);
+            parseHeader();
+            return;
+        }
+        passBody(lineBuffer, strlen(lineBuffer));
+        bodyBreaks = 1;
+        bodyPartial = false;
+    } else if (incomingChar == '\n' && lineLength == 0) { // An empty line or the end of a line passed on in parts
+        if (bodyPartial) {
+            bodyPartial = false;
+            bodyBreaks = 1;
+        } else if (bodyBreaks < 0xFF)
+            bodyBreaks++;
+    } else if (lineLength == sizeof(lineBuffer) - 1 && !(started && strncmp_P(lineBuffer, PSTR("+CMG"), 4) == 0)) {
+        // The line does not fit in the buffer, so the part received so far is passed on and the buffer is reused
+        commandTimer = clock->millis();
+        passBody(lineBuffer, lineLength);
+        lineLength = 0;
+        bodyPartial = true;
+    }
+}
+
+void GSMSIM300::passBody(const char *data, uint8_t length) {
+    if (bodyBreaks > 0) {
+        uint8_t breaks = bodyBreaks;
+        bodyBreaks = 0;
+        while (breaks--)
+            passBody("\n", 1);
+    }
+    if (bodyCallback)
+        bodyCallback(SMS_BODY_DATA, data, length);
+    else {
+        uint8_t pos = strlen(messageIn);
+        if (length > sizeof(messageIn) - 1 - pos)
+            length = sizeof(messageIn) - 1 - pos; // The message is truncated
+        memcpy(messageIn + pos, data, length);
+        messageIn[pos + length] = '\0';
+    }
+}
+
+void GSMSIM300::finishBody(bool complete) {
+    if (!complete) {
+#ifdef DEBUG
+        Serial.println(F("Message was interrupted"));
+#endif
+        if (bodyCallback)
+            bodyCallback(SMS_BODY_ABORTED, NULL, 0);
+        return;
+    }
+#ifdef DEBUG
+    if (bodyCallback)
+        Serial.print(F("Streamed message"));
+    else {
+        Serial.print(F("Received: \""));
+        Serial.print(messageIn);
+        Serial.print(F("\""));
+    }
+    Serial.print(F(" From: "));
+    Serial.print(numberIn);
+    Serial.print(F(" At index: "));
+    Serial.println(indexIn);
+#endif
+    inboxCount++;
+    if (bodyCallback)
+        bodyCallback(SMS_BODY_END, NULL, 0);
+    else if (smsCallback)
+        smsCallback(indexIn, statusIn, numberIn, timestampIn, messageIn);
+}
+
+void GSMSIM300::inboxResponse(uint8_t result) {
+    if (inboxState == INBOX_MESSAGE) { // The final response ends the content of the last message
+        finishBody(result == GSM_RESULT_OK);
+        inboxState = INBOX_HEADER;
+    }
+    if (result != GSM_RESULT_OK) {
+#ifdef DEBUG
+        Serial.println(F("Inbox request failed"));
+#endif
+        inboxState = INBOX_IDLE;
+        return;
+    }
+
+    switch(inboxState) {
+        case INBOX_MODE:
+            sendInboxRequest();
+            break;
+
+        case INBOX_HEADER:
+#ifdef DEBUG
+            if (inboxCount == 0)
+                Serial.println(F("No messages were read"));
+#endif
+            if (!inboxDrain || inboxCount == 0 || !sendInboxDelete(true)) // All listed messages are now marked as read, so they can be deleted in one go
+                inboxState = INBOX_IDLE;
+            break;
+
+        case INBOX_DELETE:
+#ifdef DEBUG
+            Serial.print(F("Deleted messages: "));
+            Serial.println(inboxCount);
+#endif
+            inboxState = INBOX_IDLE;
+            break;
+
+        default:
+            break;
+    }
+}
+
+#endif
+
+#ifndef GSM_NO_CALLS
+bool GSMSIM300::call(const char *num) {
+    if (strlen(num) >= sizeof(numberOut)) { // A truncated number would call someone else
+#ifdef DEBUG
+        Serial.println(F("Number is too long"));
+#endif
+        return false;
+    }
+    copyField(numberOut, sizeof(numberOut), num);
+    callState = CALL_NUMBER;
+    return true;
+}
+
+void GSMSIM300::hangup() {
+    queueCommand(GSM_COMMAND_ATH, GSM_WAIT_COMMAND, F("ATH"), NULL, URC_NONE, NULL); // Response: 'OK'
+#ifdef DEBUG
+    Serial.println(F("Call hangup"));
+#endif
+    if (callState >= CALL_DIAL)
+        callEvent(CALL_IDLE, CALL_EVENT_ENDED);
+    else
+        callState = CALL_IDLE;
+}
+
+void GSMSIM300::answer() {
+#ifdef DEBUG
+    Serial.println(F("Incoming Call"));
+#endif
+    callEvent(CALL_INCOMING, CALL_EVENT_RINGING);
+    if (callState == CALL_INCOMING) // The callback might have hung up
+        queueCommand(GSM_COMMAND_ATA, GSM_WAIT_COMMAND, F("ATA"), NULL, URC_NONE, &GSMSIM300::callResponse);
+}
+
+#endif
+
+#ifndef GSM_NO_SMS_IN
+void GSMSIM300::sendInboxRequest() {
+    // The final response is matched by the transaction engine, while the lines before it are parsed by updateInbox()
+    queueCommand(listType == NULL ? GSM_COMMAND_CMGR : GSM_COMMAND_CMGL, GSM_WAIT_SIM, NULL, &GSMSIM300::writeInboxRequest, URC_NONE, &GSMSIM300::inboxResponse, true);
+    inboxState = INBOX_HEADER;
+}
+
+bool GSMSIM300::writeInboxRequest() {
+    if (listType == NULL) {
+        out->print(F("AT+CMGR="));
+        out->print(indexIn);
+        out->print(F("\r"));
+    } else {
+        out->print(F("AT+CMGL=\""));
+        out->print(listType);
+        out->print(F("\"\r"));
+    }
+    return true;
+}
+
+bool GSMSIM300::sendInboxDelete(bool urgent) {
+    if (!queueCommand(GSM_COMMAND_CMGD, GSM_WAIT_SIM, F("AT+CMGDA=\"DEL READ\""), NULL, URC_NONE, &GSMSIM300::inboxResponse, urgent))
+        return false;
+    inboxState = INBOX_DELETE;
+    return true;
+}
+
+bool GSMSIM300::listSMS(const char *type) {
+    if (inboxBusy())
+        return false;
+    listType = type;
+    inboxDrain = false;
+    inboxState = INBOX_LIST;
+    return true;
+}
+
+bool GSMSIM300::drainSMS(const char *type) {
+    if (inboxBusy() || (smsCallback == NULL && bodyCallback == NULL))
+        return false;
+    newSms = false; // Every message received so far is listed
+    listType = type;
+    inboxDrain = true;
+    inboxState = INBOX_LIST;
+    return true;
+}
+
+void GSMSIM300::deleteSMSAll(const char *type) {
+    // The type is only valid in text mode. The mode is set when the command is sent, so it is not changed in the middle of sending a message.
+    queueCommand(GSM_COMMAND_CONFIG, GSM_WAIT_COMMAND, NULL, &GSMSIM300::writeTextMode, URC_NONE, NULL);
+    GSMCommand *command = queueCommand(GSM_COMMAND_CMGD, GSM_WAIT_SIM, NULL, &GSMSIM300::writeDeleteAll, URC_NONE, NULL);
+    if (command)
+        command->text = type;
+}
+
+bool GSMSIM300::writeDeleteAll() {
+    GSMCommand *command = &commandQueue[commandHead];
+    out->print(F("AT+CMGDA=\""));
+    out->print(command->text);
+    out->print(F("\"\r"));
+#ifdef DEBUG
+    Serial.print(F("Deleted all messages of the following type: "));
+    Serial.println(command->text);
+#endif
+    return true;
+}
+
+void GSMSIM300::deleteSMS(char *index) {
     if (index == NULL) {
         if (strlen(lastIndex) == 0) {
 #ifdef DEBUG
             Serial.println(F("No index was set"));
 #endif
-            return false;
+            return;
         }
         index = lastIndex;
     }
-    newSms = false;
-    setSMSTextMode();
-    gsm->print(F("AT+CMGR="));
-    gsm->print(index);
-    gsm->print(F("\r"));
+    GSMCommand *command = queueCommand(GSM_COMMAND_CMGD, GSM_WAIT_SIM, NULL, &GSMSIM300::writeDelete, URC_NONE, NULL);
+    if (command)
+        copyField(command->arg, sizeof(command->arg), index); // The index is copied, as the message is deleted later
+}
 
-    // Read the sender's number and the message. The SMS is returned as:
-    // +CMGR: "REC UNREAD","number",,"date"
-    // message
+bool GSMSIM300::writeDelete() {
+    GSMCommand *command = &commandQueue[commandHead];
+    out->print(F("AT+CMGD="));
+    out->print(command->arg);
+    out->print(F("\r"));
+#ifdef DEBUG
+    Serial.print(F("Deleted SMS at index: "));
+    Serial.println(command->arg);
+#endif
+    return true;
+}
 
-    bool numberFound = extractContent(numberIn, sizeof(numberIn), ',', '"', 1);
-    bool messageFound = extractContent(messageIn, sizeof(messageIn), '\n', '\r', 0); // TODO: Take care of new line in a message
+#endif
+
+//out->print(F("ATS0=001\r")); // Activate auto answer - 'RING' will be received on an incoming call
+//out->print(F("AT+CSQ\r")); // Check signal strength - response: 'OK' and then the information
+
+#ifndef GSM_NO_SMS_OUT
+uint8_t GSMSIM300::sendSMS(const char *num, const char *mes) {
+    if (smsCount >= SMS_QUEUE_SIZE) {
 #ifdef DEBUG
-    if (numberFound) {
-        Serial.print(F("Extracted the following number: "));
-        Serial.println(numberIn);
+        Serial.println(F("SMS queue is full"));
+#endif
+        return 0;
     }
-    if (messageFound) {
-        Serial.print(F("Received message: "));
-        Serial.println(messageIn);
+    SMSQueueEntry *entry = &smsQueue[(smsHead + smsCount) % SMS_QUEUE_SIZE];
+    copyField(entry->number, sizeof(entry->number), num);
+    copyField(entry->message, sizeof(entry->message), mes);
+    entry->pduMode = false;
+    if (++smsHandle == 0) // 0 is used to indicate an error
+        smsHandle = 1;
+    entry->handle = smsHandle;
+    entry->status = SMS_STATUS_QUEUED;
+    entry->attempts = 0;
+    smsCount++;
+    return smsHandle;
+}
+
+uint8_t GSMSIM300::sendLongSMS(const char *num, const char *text) {
+    if (smsCount >= SMS_QUEUE_SIZE) {
+#ifdef DEBUG
+        Serial.println(F("SMS queue is full"));
+#endif
+        return 0;
     }
+    bool ucs2 = !GSMPDU::isGSM7(text);
+    uint8_t segments = GSMPDU::countSegments(text, ucs2);
+    if (segments == 0) {
+#ifdef DEBUG
+        Serial.println(F("SMS is too long"));
 #endif
-    return numberFound && messageFound;
+        return 0;
+    }
+    SMSQueueEntry *entry = &smsQueue[(smsHead + smsCount) % SMS_QUEUE_SIZE];
+    copyField(entry->number, sizeof(entry->number), num);
+    entry->pduMode = true;
+    entry->pdu.text = text;
+    entry->pdu.start = 0;
+    entry->pdu.end = GSMPDU::findSegment(text, 0, ucs2, segments > 1, &entry->pdu.units);
+    entry->pdu.segment = 1;
+    entry->pdu.segments = segments;
+    entry->pdu.reference = segments > 1 ? ++pduReference : 0;
+    entry->pdu.ucs2 = ucs2;
+    if (++smsHandle == 0) // 0 is used to indicate an error
+        smsHandle = 1;
+    entry->handle = smsHandle;
+    entry->status = SMS_STATUS_QUEUED;
+    entry->attempts = 0;
+    smsCount++;
+    return smsHandle;
 }
 
-// TODO: Replace with Stream implementation
-bool GSMSIM300::extractContent(char *buffer, uint8_t size, char beginChar, char endChar, uint8_t offset) {
-    uint32_t startTime = millis();
-    int8_t i = 0;
+uint8_t GSMSIM300::getSMSStatus(uint8_t handle) {
+    for (uint8_t i = 0; i < SMS_QUEUE_SIZE; i++) {
+        if (handle != 0 && smsQueue[i].handle == handle)
+            return smsQueue[i].status;
+    }
+    return SMS_STATUS_NONE;
+}
 
-    while (gsm->read() != beginChar) {
-        if (millis() - startTime > 1000)
-            return false;
+int16_t GSMSIM300::getSMSReference(uint8_t handle) {
+    for (uint8_t i = 0; i < SMS_QUEUE_SIZE; i++) {
+        if (handle != 0 && smsQueue[i].handle == handle)
+            return smsQueue[i].status == SMS_STATUS_SENT ? smsQueue[i].messageReference : -1;
     }
+    return -1;
+}
 
-    while (offset) { // Offset from beginChar to the actual string
-        if (gsm->read() != -1)
-            offset--;
-        if (millis() - startTime > 1000)
+#endif
+
+#ifndef GSM_NO_SMS_IN
+bool GSMSIM300::readSMS(char *index) {
+    if (gsmState != GSM_RUNNING || !readSMSAsync(index))
+        return false;
+    while (inboxBusy() && gsmState == GSM_RUNNING)
+        update();
+    return inboxCount > 0;
+}
+
+bool GSMSIM300::readSMSAsync(const char *index) {
+    if (inboxBusy())
+        return false;
+    if (index == NULL) {
+        if (strlen(lastIndex) == 0) {
+#ifdef DEBUG
+            Serial.println(F("No index was set"));
+#endif
             return false;
+        }
+        index = lastIndex;
     }
+    newSms = false;
+    copyField(indexIn, sizeof(indexIn), index);
+    listType = NULL;
+    inboxDrain = false;
+    inboxState = INBOX_READ;
+    return true;
+}
 
-    while (millis() - startTime < 1000) { // Only do this for 1s
-        char c;
-        do {
-            c = gsm->read();
-            if (millis() - startTime > 1000)
-                return false;
-        } while (c == -1);
+#endif
 
-#ifdef EXTRADEBUG
-        Serial.write(c);
+bool GSMSIM300::assembleLine(int input) {
+    if (input < 0 || input == '\r')
+        return false;
+    if (input == '\n') {
+        if (lineLength == 0) // Skip empty lines
+            return false;
+        if (lineLength > sizeof(lineBuffer) - 1) // The line was truncated
+            lineLength = sizeof(lineBuffer) - 1;
+        lineBuffer[lineLength] = '\0';
+        lineLength = 0;
+        return true;
+    }
+    if (lineLength < sizeof(lineBuffer) - 1)
+        lineBuffer[lineLength++] = (char)input;
+    else {
+#ifdef GSM_STATS
+        stats.droppedBytes++;
 #endif
-        if (c == endChar) {
-            buffer[i] = '\0';
-            return true;
-        }
-        buffer[i++] = c;
-        if (i >= size) {
 #ifdef DEBUG
-            Serial.println(F("String is too large for the buffer"));
-            return false;
+        if (lineLength == sizeof(lineBuffer) - 1)
+            Serial.println(F("Line is too large for the buffer"));
 #endif
-        }
+        lineLength = sizeof(lineBuffer); // Only print the warning once, the line is still terminated at the end of the buffer
     }
     return false;
 }
 
-void GSMSIM300::setSMSTextMode() {
-    gsm->print(F("AT+CMGF=1\r")); // Set SMS type to text mode
+char *GSMSIM300::checkLine(const __FlashStringHelper *prefix) {
+    const char *str = reinterpret_cast<const char *>(prefix);
+    uint8_t length = strlen_P(str);
+    if (strncmp_P(lineBuffer, str, length) != 0)
+        return NULL;
+    char *content = lineBuffer + length;
+    while (*content == ' ')
+        content++;
+    return content;
 }
 
-void GSMSIM300::powerOn() {
-    digitalWrite(powerPin,LOW);
-    delay(4000);
-    digitalWrite(powerPin,HIGH);
-    delay(2000);
+bool GSMSIM300::isLine(const __FlashStringHelper *response) {
+    return strcmp_P(lineBuffer, reinterpret_cast<const char *>(response)) == 0;
 }
 
-void GSMSIM300::powerOff() {
-    digitalWrite(powerPin,LOW);
-    delay(800);
-    digitalWrite(powerPin,HIGH);
-    delay(6000);
-}
\ No newline at end of file
+uint8_t GSMSIM300::splitFields(char *str, char **fields, uint8_t maxFields) {
+    uint8_t count = 0;
+    while (count < maxFields) {
+        bool quoted = *str == '"';
+        if (quoted)
+            str++;
+        fields[count++] = str;
+        if (quoted) {
+            char *end = strchr(str, '"');
+            if (end == NULL)
+                break;
+            *end = '\0';
+            str = end + 1;
+        }
+        char *comma = strchr(str, ',');
+        if (comma == NULL)
+            break;
+        *comma = '\0';
+        str = comma + 1;
+    }
+    return count;
+}
+
+void GSMSIM300::copyField(char *buffer, uint8_t size, const char *field) {
+    uint8_t i = 0;
+    while (i < size - 1 && field[i] != '\0') {
+        buffer[i] = field[i];
+        i++;
+    }
+    buffer[i] = '\0';
+}
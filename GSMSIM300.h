@@ -24,19 +24,127 @@
 #include <WProgram.h>
 #endif
 
+#include "GSMPDU.h"
+
+#ifndef GSM_NO_DEBUG // Defined by the host build, so debugging does not affect the benchmarks
 #define DEBUG // Print serial debugging
+#endif
 //#define EXTRADEBUG // Print every character received from the GSM module
+//#define LATENCYDEBUG // Record the worst-case time spent in update() for every state
+//#define GSM_STATS // Collect command latency and health statistics, see getStats()
+
+// Features that are not used can be removed, so they take neither RAM nor flash
+//#define GSM_NO_CALLS // Remove call(), hangup() and the automatic answering of incoming calls
+//#define GSM_NO_SMS_IN // Remove reading, listing and deleting the messages on the SIM card
+//#define GSM_NO_SMS_OUT // Remove sendSMS() and sendLongSMS()
+
+/** Size of the buffers holding a phone number including the terminator. */
+#ifndef GSM_NUMBER_SIZE
+#define GSM_NUMBER_SIZE           20
+#endif
+
+/** Size of the buffers holding a message including the terminator. Longer messages are truncated. */
+#ifndef GSM_MESSAGE_SIZE
+#define GSM_MESSAGE_SIZE          161
+#endif
+
+/** Number of messages that can be queued by sendSMS() and sendLongSMS(). Every entry uses GSM_NUMBER_SIZE + GSM_MESSAGE_SIZE + 5 bytes of RAM. */
+#ifndef SMS_QUEUE_SIZE
+#define SMS_QUEUE_SIZE            2
+#endif
+
+/** Number of times sending a message is started before it fails, when it is interrupted by error recovery. */
+#ifndef GSM_SMS_ATTEMPTS
+#define GSM_SMS_ATTEMPTS          3
+#endif
+
+/** Number of AT commands that must be answered at the new baud rate before it is used. See setBaudRate(). */
+#ifndef GSM_BAUD_CHECKS
+#define GSM_BAUD_CHECKS           3
+#endif
+
+/** Number of commands that can be queued by the transaction engine. One entry is reserved for commands continuing an exchange. Every entry uses 21 bytes of RAM. */
+#ifndef GSM_COMMAND_QUEUE_SIZE
+#define GSM_COMMAND_QUEUE_SIZE    4
+#endif
+
+/**
+ * Size of the buffer used to assemble the lines sent from the GSM module. It can be up to 255 bytes.
+ * The content of a message is passed on in parts when it does not fit, so only the header of a message must fit.
+ */
+#ifndef GSM_LINE_BUFFER_SIZE
+#ifdef GSM_NO_SMS_IN
+#define GSM_LINE_BUFFER_SIZE      64 // Only status lines, i.e. +CLCC, are parsed
+#else
+#define GSM_LINE_BUFFER_SIZE      96 // The header of a message can include the name of the sender from the phonebook
+#endif
+#endif
+
+/** Default maximum number of bytes processed per call to update(). */
+#ifndef GSM_RX_MAX_BYTES
+#define GSM_RX_MAX_BYTES          64
+#endif
+/**
+ * Default maximum time in us spent processing bytes per call to update(). The time is checked after every byte,
+ * so update() returns within this time plus the time it takes to process a single byte. Use 0 to only limit the number of bytes.
+ */
+#ifndef GSM_RX_MAX_TIME
+#define GSM_RX_MAX_TIME           200
+#endif
+/** Default size of the receive buffer of the serial instance. Both SoftwareSerial and HardwareSerial use 64 bytes. */
+#ifndef GSM_RX_BUFFER_SIZE
+#define GSM_RX_BUFFER_SIZE        64
+#endif
+
+/** Returned by getNextDeadline() when the library is only waiting for the GSM module. */
+#define GSM_NO_DEADLINE           0xFFFFFFFF
+
+/**
+ * Time in ms between the samples of the signal quality using AT+CSQ while the module is running. Use 0 to disable the sampling.
+ * The registration is polled at the same rate while the module is not registered, in case a +CREG URC is lost.
+ */
+#ifndef GSM_SIGNAL_INTERVAL
+#define GSM_SIGNAL_INTERVAL       30000
+#endif
+
+/** Network registration returned by getRegistration(). It is the <stat> of +CREG. */
+#define GSM_REG_NOT_SEARCHING     0
+#define GSM_REG_HOME              1
+#define GSM_REG_SEARCHING         2
+#define GSM_REG_DENIED            3
+#define GSM_REG_UNKNOWN           4
+#define GSM_REG_ROAMING           5
+
+/** Returned by getSignalQuality() until the signal quality is known or when it can not be measured. */
+#define GSM_SIGNAL_UNKNOWN        99
 
 /** States used for the GSM state machine */
 #define GSM_POWER_ON              0
-#define GSM_POWER_ON_WAIT         1
-#define GSM_SET_PIN               2
-#define GSM_CHECK_CONNECTION      3
-#define GSM_CHECK_CONNECTION_WAIT 5
-#define GSM_CONNECTION_RESPONSE   6
-#define GSM_RUNNING               7
-#define GSM_POWER_OFF             8
-#define GSM_POWER_OFF_WAIT        9
+#define GSM_POWER_ON_SHUTDOWN     1
+#define GSM_POWER_ON_PULSE        2
+#define GSM_POWER_ON_RELEASE      3
+#define GSM_POWER_ON_SETTLE       4
+#define GSM_POWER_ON_SYNC         5
+#define GSM_POWER_ON_WAIT         6
+#define GSM_BAUD                  7 // Switching the module to the higher baud rate using AT+IPR
+#define GSM_BAUD_SETTLE           8
+#define GSM_BAUD_VERIFY           9 // Checking the link at the higher baud rate using AT
+#define GSM_SET_PIN               10
+#define GSM_CHECK_CONNECTION      11
+#define GSM_CHECK_CONNECTION_URC  12 // Enabling the +CREG URC
+#define GSM_CHECK_CONNECTION_WAIT 13
+#define GSM_CONNECTION_RESPONSE   14
+#define GSM_CHECK_CONNECTION_DELAY 15
+#define GSM_RUNNING               16
+#define GSM_POWER_OFF             17
+#define GSM_POWER_OFF_WAIT        18
+#define GSM_POWER_OFF_PULSE       19
+#define GSM_POWER_OFF_RELEASE     20
+#define GSM_RESYNC                21
+#define GSM_RESYNC_WAIT           22
+#define GSM_RESET                 23
+#define GSM_SIM_ERROR             24 // The pin code was rejected. Nothing is done until setState() is called, so the SIM card is not locked by trying the same pin code again
+#define GSM_STATE_COUNT           25
 
 /** States used for the SMS state machine */
 #define SMS_IDLE                  0
@@ -45,14 +153,266 @@
 #define SMS_NUMBER                3
 #define SMS_CONTENT               4
 #define SMS_WAIT                  5
+#define SMS_STATE_COUNT           6
 
 /** States used for the call state machine */
 #define CALL_IDLE                 0
-#define CALL_NUMBER               1
-#define CALL_SETUP                2
-#define CALL_SETUP_WAIT           3
-#define CALL_RESPONSE             4
+#define CALL_NUMBER               1 // Waiting for the network before dialing
+#define CALL_DIAL                 2 // ATD is being sent
+#define CALL_SETUP                3 // Dialed, waiting for the other end
+#define CALL_ALERTING             4 // The other end is ringing
 #define CALL_ACTIVE               5
+#define CALL_INCOMING             6 // An incoming call is being answered
+#define CALL_STATE_COUNT          7
+
+/** Events passed to CallCallback */
+#define CALL_EVENT_RINGING        0 // The other end is ringing or an incoming call is ringing
+#define CALL_EVENT_CONNECTED      1
+#define CALL_EVENT_BUSY           2
+#define CALL_EVENT_NO_ANSWER      3
+#define CALL_EVENT_FAILED         4 // NO DIALTONE or the module returned an error
+#define CALL_EVENT_ENDED          5 // Either end hung up or the call was lost
+#define CALL_EVENT_NONE           0xFF
+
+/** Status of a message queued by sendSMS() */
+#define SMS_STATUS_NONE           0
+#define SMS_STATUS_QUEUED         1
+#define SMS_STATUS_SENDING        2
+#define SMS_STATUS_SENT           3
+#define SMS_STATUS_FAILED         4
+
+/** States used for the inbox state machine */
+#define INBOX_IDLE                0
+#define INBOX_READ                1
+#define INBOX_LIST                2
+#define INBOX_MODE                3
+#define INBOX_HEADER              4
+#define INBOX_MESSAGE             5
+#define INBOX_DELETE              6
+#define INBOX_CLEAR               7
+#define INBOX_DIRECT              8 // The content of a message delivered by +CMT
+
+/** Types of commands used as keys for the latency histogram */
+#define GSM_COMMAND_AT            0 // AT, ATE and AT+CPOWD
+#define GSM_COMMAND_CPIN          1
+#define GSM_COMMAND_CREG          2 // AT+CREG? and AT+CREG=1
+#define GSM_COMMAND_CONFIG        3 // AT+CMGF, AT+CSCS and AT+CNMI
+#define GSM_COMMAND_CMGS          4
+#define GSM_COMMAND_CMGR          5
+#define GSM_COMMAND_CMGL          6
+#define GSM_COMMAND_CMGD          7 // AT+CMGD and AT+CMGDA
+#define GSM_COMMAND_ATD           8
+#define GSM_COMMAND_CLCC          9 // AT+CLCC=1
+#define GSM_COMMAND_ATH           10
+#define GSM_COMMAND_ATA           11
+#define GSM_COMMAND_CSQ           12
+#define GSM_COMMAND_CNMA          13
+#define GSM_COMMAND_COUNT         14
+#define GSM_COMMAND_NONE          0xFF
+
+/** Number of buckets in the latency histogram. Bucket i counts the responses received in less than 16 << i ms and the last bucket counts the rest. */
+#define GSM_STATS_BUCKETS         10
+
+/** Classes of responses. Every class has its own adaptive timeout, which is derived from the response times like the retransmission timeout of TCP */
+#define GSM_WAIT_COMMAND          0 // Answered by the module itself, i.e. AT+CMGF, AT+CLCC and the > prompt
+#define GSM_WAIT_SIM              1 // Reads or writes the SIM card, i.e. AT+CMGR, AT+CMGL and AT+CMGDA
+#define GSM_WAIT_NETWORK          2 // Depends on the network, i.e. sending a message
+#define GSM_WAIT_BOOT             3 // Power on, SIM card initialisation and power off
+#define GSM_WAIT_COUNT            4
+
+/** Results passed to the callback of a command */
+#define GSM_RESULT_OK             0 // The final response or the expected response was received
+#define GSM_RESULT_ERROR          1 // ERROR, +CME ERROR or +CMS ERROR was received
+
+/** Tiers of error recovery. A tier is only used if the tiers below it did not help */
+#define GSM_RECOVERY_NONE         0 // Only the request failed, i.e. a message was rejected
+#define GSM_RECOVERY_RETRY        1 // Send the command again
+#define GSM_RECOVERY_RESYNC       2 // Check that the module responds to AT and then send the command again
+#define GSM_RECOVERY_RESET        3 // Reset the module using AT+CFUN=1,1
+#define GSM_RECOVERY_POWER        4 // Turn the module off and on again
+#define GSM_RECOVERY_COUNT        5
+
+/** Settings of the GSM module that are cached by the library */
+#define CONFIG_TEXT_MODE          0x01
+#define CONFIG_GSM_ALPHABET       0x02
+#define CONFIG_PDU_MODE           0x04
+#define CONFIG_REGISTRATION_URC   0x08
+#define CONFIG_CALL_URC           0x10
+#define CONFIG_DIRECT_SMS         0x20
+
+/** Events returned when an unsolicited result code or a response that completes a command is received */
+#define URC_NONE                  0
+#define URC_RECEIVE_SMS           1
+#define URC_INCOMING_CALL         2
+#define URC_POWER_DOWN            3
+#define URC_PROMPT                4 // Prompt for the content of a message
+#define URC_CALL_READY            5
+#define URC_COUNT                 5
+#define URC_SIZE                  18 // Size of the longest code including the terminator
+
+/**
+ * Callback used to deliver messages read by readSMSAsync(), listSMS() and drainSMS().
+ * @param index     Index of the message on the SIM card.
+ * @param status    Status of the message, i.e. "REC UNREAD".
+ * @param number    Number of the sender.
+ * @param timestamp Time the message was received, i.e. "13/06/16,15:01:58+08".
+ * @param message   Content of the message.
+ */
+typedef void (*SMSCallback)(const char *index, const char *status, const char *number, const char *timestamp, const char *message);
+
+/**
+ * Callback used to deliver the header of a message read by readSMSAsync(), listSMS() and drainSMS() when the content is streamed.
+ * @param index     Index of the message on the SIM card.
+ * @param status    Status of the message, i.e. "REC UNREAD".
+ * @param number    Number of the sender.
+ * @param timestamp Time the message was received, i.e. "13/06/16,15:01:58+08".
+ */
+typedef void (*SMSHeaderCallback)(const char *index, const char *status, const char *number, const char *timestamp);
+
+/** Events passed to SMSBodyCallback. */
+#define SMS_BODY_DATA             0 // The next part of the content
+#define SMS_BODY_END              1 // The content is complete
+#define SMS_BODY_ABORTED          2 // The message was interrupted by an error. It is read again from the start if the module was restarted
+
+/**
+ * Callback used to deliver the content of a message in parts as it is received from the GSM module.
+ * @param event  One of the SMS_BODY_* events.
+ * @param data   Part of the content. It is not terminated and is only valid during the call. Line breaks are passed on as "\n".
+ * @param length Number of bytes in data. It is 0 for SMS_BODY_END and SMS_BODY_ABORTED.
+ */
+typedef void (*SMSBodyCallback)(uint8_t event, const char *data, uint8_t length);
+
+/**
+ * Callback used to report the progress of a call.
+ * @param event  One of the CALL_EVENT_* events.
+ * @param number Number of the other end. It is empty if the number of an incoming call is unknown.
+ */
+typedef void (*CallCallback)(uint8_t event, const char *number);
+
+/**
+ * Callback used to change the baud rate of the serial instance, i.e. by calling Serial1.begin(baud).
+ * @param baud New baud rate.
+ */
+typedef void (*BaudCallback)(uint32_t baud);
+
+/**
+ * Time source of the library. Every timer of the library uses it instead of millis() and micros(),
+ * i.e. to include the time the MCU slept in power-down, where millis() does not advance, or to run the library under virtual time.
+ */
+class GSMClock {
+public:
+	/**
+	 * Used to get the time in ms. It is allowed to wrap around.
+	 * @return Returns the time in ms.
+	 */
+	virtual uint32_t millis() = 0;
+
+	/**
+	 * Used to get the time in us. It is allowed to wrap around.
+	 * @return Returns the time in us.
+	 */
+	virtual uint32_t micros() = 0;
+};
+
+/** Clock using millis() and micros() of the Arduino core. It is used unless another clock is given to the library. */
+class GSMArduinoClock : public GSMClock {
+public:
+	uint32_t millis() {
+		return ::millis();
+	};
+	uint32_t micros() {
+		return ::micros();
+	};
+};
+
+/** Instance of the default clock shared by every instance of the library. */
+extern GSMArduinoClock gsmArduinoClock;
+
+#ifdef GSM_STATS
+/** Statistics collected when GSM_STATS is defined. Every counter saturates instead of wrapping around. */
+struct GSMStats {
+	/** Latency histogram from a command is sent until the final response is received for every GSM_COMMAND_* type. */
+	uint16_t latency[GSM_COMMAND_COUNT][GSM_STATS_BUCKETS];
+	/** Worst-case latency in ms for every GSM_COMMAND_* type. */
+	uint16_t maxLatency[GSM_COMMAND_COUNT];
+	/** Number of responses that timed out, number of +CME ERROR and +CMS ERROR responses and the number of times the module was turned on. */
+	uint16_t timeouts, cmeErrors, cmsErrors, powerCycles;
+	/** Number of times every GSM_RECOVERY_* tier has been used. */
+	uint16_t recoveries[GSM_RECOVERY_COUNT];
+	/** Last error code returned by +CME ERROR and +CMS ERROR. */
+	uint16_t lastCmeError, lastCmsError;
+	/** Bytes received and sent and bytes dropped, because a line did not fit in the line buffer. Bytes lost by the serial instance are counted by getRxOverruns(). */
+	uint32_t rxBytes, txBytes, droppedBytes;
+	/** Time in ms spent in every GSM state. */
+	uint32_t stateTime[GSM_STATE_COUNT];
+	/** Baud rate in use and the number of times the higher baud rate was found unreliable. */
+	uint32_t baudRate;
+	uint16_t baudFallbacks;
+};
+
+/** Used to count the bytes sent to the GSM module. */
+class GSMStatsPrint : public Print {
+public:
+	GSMStatsPrint(Stream *stream, uint32_t *bytes) : stream(stream), bytes(bytes) {};
+	virtual size_t write(uint8_t c) {
+		(*bytes)++;
+		return stream->write(c);
+	};
+private:
+	Stream *stream;
+	uint32_t *bytes;
+};
+#endif
+
+#ifndef GSM_NO_SMS_OUT
+/** Entry in the outgoing message queue. */
+struct SMSQueueEntry {
+	char number[GSM_NUMBER_SIZE];
+	union {
+		/** Copy of the message queued by sendSMS(). */
+		char message[GSM_MESSAGE_SIZE];
+		/** Message queued by sendLongSMS(). The text is not copied and the segment being sent is given by start and end. */
+		struct {
+			const char *text;
+			uint16_t start, end;
+			uint8_t units, segment, segments, reference;
+			bool ucs2;
+		} pdu;
+	};
+	/** Handle returned by sendSMS() or sendLongSMS(). */
+	uint8_t handle;
+	/** One of the SMS_STATUS_* values. */
+	uint8_t status;
+	/** True if the message is sent in PDU mode. */
+	bool pduMode;
+	/** Number of times sending was interrupted by error recovery. */
+	uint8_t attempts;
+	/** Message reference given by the network in "+CMGS: <mr>". It is the one of the last segment for a message sent by sendLongSMS(). */
+	uint8_t messageReference;
+};
+#endif
+
+class GSMSIM300;
+
+/** Entry in the command queue of the transaction engine. */
+struct GSMCommand {
+	/** One of the GSM_COMMAND_* types. */
+	uint8_t type;
+	/** GSM_WAIT_* class of the timeout. */
+	uint8_t wait;
+	/** URC_* code that completes the command instead of the final response, i.e. URC_PROMPT or URC_CALL_READY. It must not be followed by a final response. URC_NONE to wait for the final response. */
+	uint8_t response;
+	/** Request written followed by a carriage return if write is NULL. */
+	const __FlashStringHelper *request;
+	/** Used to write a request that is built when it is sent. It returns false if nothing needs to be sent, i.e. if the setting is already set. */
+	bool (GSMSIM300::*write)();
+	/** Called with one of the GSM_RESULT_* values when the command completes. NULL if nobody waits for the result. */
+	void (GSMSIM300::*callback)(uint8_t result);
+	/** Argument copied when the command is queued, i.e. the index of the message to delete. */
+	char arg[5];
+	/** Argument that is not copied, i.e. the type of the messages to delete. */
+	const char *text;
+};
 
 /** The GSMSIM300 class is able to call and answer calls, send messages and receive messages and some other useful features. */
 class GSMSIM300 {
@@ -65,21 +425,91 @@ public:
 	 *                 If argument is omitted then it will be set to 4.
 	 * @param running  Set this to true to if the GSM module is already powered on and configured. Useful when developing.
 	 *                 If argument is omitted then it will be set to false.
+	 * @param clock    Time source of the library. If argument is omitted then millis() and micros() are used.
 	 */
-	GSMSIM300(Stream *p, const char *pinCode, uint8_t powerPin = 4, bool running = false);
+	GSMSIM300(Stream *p, const char *pinCode, uint8_t powerPin = 4, bool running = false, GSMClock *clock = NULL);
 
-	/** Used to update the state machine in the library. */
+	/** Used to update the state machine in the library. Every byte available from the GSM module is processed, up to the budget set by setRxBudget(). */
 	void update();
 
+	/**
+	 * Used to limit how much work a single call to update() is allowed to do.
+	 * @param maxBytes Maximum number of bytes to process per call. Defaults to GSM_RX_MAX_BYTES.
+	 * @param maxTime  Maximum time in us to spend processing bytes per call. Set to 0 to only limit the number of bytes. Defaults to GSM_RX_MAX_TIME.
+	 */
+	void setRxBudget(uint8_t maxBytes, uint16_t maxTime = GSM_RX_MAX_TIME);
+
+	/**
+	 * Used to get the time until update() has to be called again if no bytes are received, so the caller can sleep until then.
+	 * The value is set by update(), so update() must be called after a new request, i.e. sendSMS(), before sleeping.
+	 * @return Returns the time in ms, 0 if update() has more to do right away or GSM_NO_DEADLINE if the library is only waiting for the GSM module.
+	 */
+	uint32_t getNextDeadline();
+
+	/**
+	 * Used to get the time source of the library, so code driving the library uses the same time.
+	 * @return Returns the clock given to the constructor or the default clock.
+	 */
+	GSMClock *getClock() {
+		return clock;
+	};
+
+	/**
+	 * Used to tell the library the size of the receive buffer of the serial instance, so overruns can be detected.
+	 * @param size Size of the receive buffer. Defaults to GSM_RX_BUFFER_SIZE.
+	 */
+	void setRxBufferSize(uint16_t size) {
+		rxBufferSize = size;
+	};
+
+	/**
+	 * Used to get the number of times the receive buffer was found full, meaning bytes from the GSM module were dropped.
+	 * @return Returns the number of receive buffer overruns.
+	 */
+	uint16_t getRxOverruns() {
+		return rxOverruns;
+	};
+
+	/**
+	 * Used to switch the link to a higher baud rate once the module has booted. The module detects the initial rate from the first AT (autobaud),
+	 * is switched using AT+IPR and the new rate is checked using GSM_BAUD_CHECKS AT commands. If the link is unreliable at the new rate,
+	 * the module is turned off and on again and the initial rate is kept until this is called again.
+	 * The module goes back to autobaud when it is reset or turned off, so the callback is used to go back to the initial rate as well.
+	 * @param initial  Baud rate the serial instance was started at.
+	 * @param target   Baud rate to switch to, i.e. 115200.
+	 * @param callback Function that changes the baud rate of the serial instance or NULL to stay at the initial rate.
+	 */
+	void setBaudRate(uint32_t initial, uint32_t target, BaudCallback callback);
+
+	/**
+	 * Used to get the baud rate of the link.
+	 * @return Returns the baud rate in use or 0 if setBaudRate() has not been called.
+	 */
+	uint32_t getBaudRate() {
+		return baudRate;
+	};
+
+#ifndef GSM_NO_CALLS
 	/**
 	 * Use this to call a number.
-	 * @param num Number to call.
+	 * @param  num Number to call. Maximum is GSM_NUMBER_SIZE - 1 characters.
+	 * @return     Returns false if the number is too long.
 	 */
-	void call(const char *num);
+	bool call(const char *num);
 
 	/** Use this to hangup a conversation. */
 	void hangup();
 
+	/**
+	 * Used to set the function called when a call is ringing, connected or ends. The progress is tracked from the +CLCC URCs and the final result codes, so the module is never polled.
+	 * @param callback Function to call or NULL to disable it.
+	 */
+	void setCallCallback(CallCallback callback) {
+		callCallback = callback;
+	};
+#endif
+
+#ifndef GSM_NO_SMS_IN
 	/**
 	 * Used to check if a new SMS has been received.
 	 * @return Returns true if a new message has been received.
@@ -87,21 +517,67 @@ public:
 	bool newSMS() {
 		return newSms;
 	};
+#endif
+
+#ifndef GSM_NO_SMS_OUT
+	/**
+	 * Used to send a SMS. The message is copied into a queue and sent by update(), so several messages can be queued at once.
+	 * @param  num Number to send message to.
+	 * @param  mes Message to send. Maximum is GSM_MESSAGE_SIZE - 1 characters, which defaults to 160.
+	 * @return     Returns a handle used to check the status of the message with getSMSStatus() or 0 if the queue is full.
+	 */
+	uint8_t sendSMS(const char *num, const char *mes);
+
+	/**
+	 * Used to send a message of any length in PDU mode. The GSM 7-bit default alphabet is used if possible and UCS2 otherwise,
+	 * and the message is split into concatenated segments if it does not fit in a single message.
+	 * The text is not copied, so it must not be changed until getSMSStatus() returns SMS_STATUS_SENT or SMS_STATUS_FAILED.
+	 * @param  num  Number to send message to.
+	 * @param  text Message to send as UTF-8.
+	 * @return      Returns a handle used to check the status of the message with getSMSStatus() or 0 if the queue is full or the message needs more than 255 segments.
+	 */
+	uint8_t sendLongSMS(const char *num, const char *text);
+
+	/**
+	 * Used to check the status of a message queued by sendSMS() or sendLongSMS().
+	 * @param  handle Handle returned by sendSMS() or sendLongSMS().
+	 * @return        Returns one of the SMS_STATUS_* values. SMS_STATUS_NONE is returned if the entry has been reused by a newer message.
+	 */
+	uint8_t getSMSStatus(uint8_t handle);
+
+	/**
+	 * Used to get the reference the network gave a message when it accepted it.
+	 * @param  handle Handle returned by sendSMS() or sendLongSMS().
+	 * @return        Returns the message reference or -1 if the message has not been sent or the entry has been reused.
+	 */
+	int16_t getSMSReference(uint8_t handle);
 
 	/**
-	 * Used to send a SMS.
-	 * @param num Number to send message to.
-	 * @param mes Message to send. Maximum is 160 characters.
+	 * Used to get the number of messages waiting to be sent, including the one being sent.
+	 * @return Returns the number of messages in the queue.
 	 */
-	void sendSMS(const char *num, const char *mes);
+	uint8_t getSMSQueueCount() {
+		return smsCount;
+	};
+#endif
 
+#ifndef GSM_NO_SMS_IN
 	/**
 	 * Read SMS at a specific index. If no index is set the last received SMS will be read.
+	 * This will call update() until the message is read. Use readSMSAsync() to avoid blocking.
 	 * @param  index SMS index to read. If argument is omitted then the last received SMS will be read.
 	 * @return       Returns true if both number and message is successfully extracted.
 	 */
 	bool readSMS(char *index = NULL);
 
+	/**
+	 * Read SMS at a specific index without blocking. The message is read by update() and passed to the callback set by setSMSCallback().
+	 * It is also available in numberIn, messageIn, timestampIn and statusIn once inboxBusy() returns false and getInboxCount() is not 0.
+	 * @param  index SMS index to read. If argument is omitted then the last received SMS will be read.
+	 * @return       Returns true if the request is started.
+	 */
+	bool readSMSAsync(const char *index = NULL);
+
 	/**
 	 * Used to delete a SMS at a specific index. If no index is set the last received SMS will be read.
 	 * @param index SMS index to delete. If argument is omitted then the last received SMS will be read.
@@ -116,10 +592,95 @@ public:
 	void deleteSMSAll(const char *type = "DEL ALL");
 
 	/**
-	 * List all messages stored on the SIM card.
-	 * @param type  Available ones are: "REC UNREAD", "REC READ", "STO UNSENT", "STO SENT", and "ALL". Default to "ALL".
+	 * List all messages stored on the SIM card. The messages are read by update() and passed one at a time to the callback set by setSMSCallback().
+	 * @param  type Available ones are: "REC UNREAD", "REC READ", "STO UNSENT", "STO SENT", and "ALL". Default to "ALL".
+	 *              The string must remain valid until the request is sent.
+	 * @return      Returns true if the request is started.
+	 */
+	bool listSMS(const char *type = "ALL");
+
+	/**
+	 * Used to read and delete all messages on the SIM card using only two commands. The messages are listed like listSMS() and passed one at a time to the callback set by setSMSCallback().
+	 * Once the list is complete all read messages are deleted using AT+CMGDA="DEL READ". Every received message has been marked as read by the list,
+	 * while messages received after the list are still unread and are kept.
+	 * @param  type Type of messages to list. See listSMS(). Default to "ALL".
+	 *              Note that read messages are deleted even if they are not of this type.
+	 * @return      Returns true if the request is started. A callback or a stream must be set, as the messages are deleted afterwards.
+	 */
+	bool drainSMS(const char *type = "ALL");
+
+	/**
+	 * Used to set the function called for every message read by readSMSAsync(), listSMS() and drainSMS().
+	 * @param callback Function to call or NULL to disable it.
+	 */
+	void setSMSCallback(SMSCallback callback) {
+		smsCallback = callback;
+	};
+
+	/**
+	 * Used to stream the messages read by readSMSAsync(), listSMS() and drainSMS() instead of copying them to messageIn.
+	 * The header is passed to the header callback, and the content is passed to the body callback in parts as it is received,
+	 * so a message can be of any length and span several lines. The callback set by setSMSCallback() is not called while streaming.
+	 * A content line only consisting of "OK" or "ERROR" ends the message, as it can not be told apart from the final response.
+	 * @param header Function to call when a message starts or NULL.
+	 * @param body   Function to call with the content or NULL to stop streaming.
+	 */
+	void setSMSStream(SMSHeaderCallback header, SMSBodyCallback body) {
+		headerCallback = header;
+		bodyCallback = body;
+	};
+
+	/**
+	 * Used to have new messages delivered directly by +CMT instead of being stored on the SIM card and announced by +CMTI.
+	 * The messages are passed to the callback or the stream like a read message with an empty index and acknowledged using AT+CNMA,
+	 * so a message costs a single command and the SIM card never fills up. Only the first line of the content is delivered.
+	 * Messages stored on the SIM card while it was disabled or while the module was restarting are still announced by +CMTI.
+	 * @param enable True to route new messages directly using AT+CNMI=2,2 and false to store them using AT+CNMI=2,1.
+	 */
+	void setDirectSMS(bool enable);
+
+	/**
+	 * Used to check if a read, list or drain request is in progress.
+	 * @return Returns true until the final response is received.
+	 */
+	bool inboxBusy() {
+		return inboxState != INBOX_IDLE;
+	};
+
+	/**
+	 * Used to get the number of messages delivered by the last read or list request.
+	 * @return Returns the number of messages.
+	 */
+	uint8_t getInboxCount() {
+		return inboxCount;
+	};
+#endif
+
+	/**
+	 * Used to get the number of configuration commands that were not sent, because the GSM module was already configured.
+	 * @return Returns the number of commands skipped.
+	 */
+	uint16_t getSkippedCommands() {
+		return skippedCommands;
+	};
+
+	/**
+	 * Used to get the current timeout of a class of responses.
+	 * The timeout is the smoothed response time plus four times its variation, bounded by the limits of the class, and it is doubled every time it expires.
+	 * @param  wait One of the GSM_WAIT_* classes.
+	 * @return      Returns the timeout in ms.
 	 */
-	void listSMS(const char *type = "ALL");
+	uint16_t getTimeout(uint8_t wait) {
+		return wait < GSM_WAIT_COUNT ? timeout[wait] : 0;
+	};
+
+	/**
+	 * Used to get the tier of the last error recovery.
+	 * @return Returns one of the GSM_RECOVERY_* tiers. GSM_RECOVERY_NONE is returned once a command has succeeded after the recovery while the module is running.
+	 */
+	uint8_t getRecoveryTier() {
+		return recoveryTier;
+	};
 
 	/**
 	 * Used to get the state of the GSM module.
@@ -129,6 +690,49 @@ public:
 		return gsmState;
 	}
 
+	/**
+	 * Used to get the state of every state machine at once, i.e. to record the state transitions.
+	 * @return Returns the GSM state, the SMS state << 8, the call state << 16 and the inbox state << 24. A removed feature is 0.
+	 */
+	uint32_t getStates() {
+		return packStates();
+	}
+
+	/**
+	 * Used to get the network registration. It is updated by the +CREG URC, so no command is sent.
+	 * Messages and calls are held while the module is not registered.
+	 * @return Returns one of the GSM_REG_* values. GSM_REG_UNKNOWN is returned until the registration is known after power on.
+	 */
+	uint8_t getRegistration() {
+		return registration;
+	}
+
+	/**
+	 * Used to check if the module is registered to the home network or roaming.
+	 * @return Returns true if the module is registered.
+	 */
+	bool isRegistered() {
+		return registration == GSM_REG_HOME || registration == GSM_REG_ROAMING;
+	}
+
+	/**
+	 * Used to get the last sample of the signal quality. It is sampled every GSM_SIGNAL_INTERVAL ms while the module is running.
+	 * @return Returns the <rssi> of +CSQ from 0 (-113 dBm or less) to 31 (-51 dBm or more) in steps of 2 dBm or GSM_SIGNAL_UNKNOWN.
+	 */
+	uint8_t getSignalQuality() {
+		return signalQuality;
+	}
+
+#ifndef GSM_NO_CALLS
+	/**
+	 * Used to get the state of the call state machine.
+	 * @return Returns one of the CALL_* states.
+	 */
+	uint8_t getCallState() {
+		return callState;
+	}
+#endif
+
 	/**
 	 * Used to set the state of the GSM module.
 	 * @param newState The new state for the GSM state machine.
@@ -137,69 +741,371 @@ public:
 		gsmState = newState;
 	}
 
-	/** Buffer for the last ingoing and outgoing number. */
-	char numberIn[20], numberOut[20];
+#ifdef LATENCYDEBUG
+	/** Print the worst-case time in us spent in update() for every state of the GSM, SMS and call state machines. */
+	void printLatency();
+#endif
+
+	/**
+	 * Used to copy a field into a buffer. The field is truncated if it is too large, and unlike strncpy() the buffer is always terminated and not padded.
+	 * @param buffer Buffer to copy into.
+	 * @param size   Size of buffer.
+	 * @param field  Field to copy.
+	 */
+	static void copyField(char *buffer, uint8_t size, const char *field);
+
+#ifdef GSM_STATS
+	/**
+	 * Used to get the statistics collected since the library was started or resetStats() was called.
+	 * @return Returns the statistics. The time spent in the current state is included.
+	 */
+	const GSMStats &getStats();
+
+	/** Used to reset the statistics. */
+	void resetStats();
 
-	/** Buffer for the last ingoing and outgoing message. */
-	char messageIn[161], messageOut[161];
+	/** Print the statistics. */
+	void printStats();
+#endif
+
+#ifndef GSM_NO_CALLS
+	/** Buffer for the number being called or the number of the incoming call. */
+	char numberOut[GSM_NUMBER_SIZE];
+#endif
+
+#ifndef GSM_NO_SMS_IN
+	/** Buffer for the last ingoing number. */
+	char numberIn[GSM_NUMBER_SIZE];
+
+	/** Buffer for the last ingoing message. Line breaks are stored as "\n" and longer messages are truncated. It is not used while streaming. */
+	char messageIn[GSM_MESSAGE_SIZE];
+
+	/** Buffers for the index, status and timestamp of the last ingoing message. */
+	char indexIn[5], statusIn[11], timestampIn[21];
+#endif
 private:
 
 	/** Pointer to the serial instance. */
 	Stream *gsm;
 
-	/** Used by the library to check for ingoing messages. */
-	void checkSMS();
+	/** Time source used instead of millis() and micros(). */
+	GSMClock *clock;
+
+	/** Used to send commands to the GSM module. This is the serial instance unless GSM_STATS is defined. */
+	Print *out;
+
+	/**
+	 * Used to record the type and time of the command being sent, so the latency of the final response can be recorded.
+	 * @param command One of the GSM_COMMAND_* types.
+	 */
+#ifdef GSM_STATS
+	void startCommand(uint8_t command);
+
+	/** Used to update the statistics with the last line. */
+	void updateStats();
+
+	/** Used to add the time spent in the last GSM state. */
+	void updateStateTime();
+#else
+	void startCommand(uint8_t) {};
+#endif
+
+	/** Used to update the GSM state machine with the last incoming character. */
+	void updateGSM();
+
+	/**
+	 * Used to detect state changes in update().
+	 * @return Returns the state of every state machine packed into one value.
+	 */
+	uint32_t packStates();
+
+	/**
+	 * Used to advance the GSM state machine when a command completes.
+	 * @param result One of the GSM_RESULT_* values.
+	 */
+	void gsmResponse(uint8_t result);
 
+	/** Used to check the SIM card once the module responds. */
+	void startSIM();
+
+	/**
+	 * Used to change the baud rate of the serial instance. The bytes written at the old rate are sent first.
+	 * @param baud New baud rate.
+	 */
+	void changeBaud(uint32_t baud);
+
+#ifndef GSM_NO_SMS_OUT
 	/** Used to update the SMS state machine. */
 	void updateSMS();
 
+	/**
+	 * Used to queue the mode needed by the message at the head of the queue. AT+CMGS is sent once the mode is set.
+	 * @param  urgent True if the command continues an exchange.
+	 * @return        Returns true if the command was queued.
+	 */
+	bool configureSMS(bool urgent);
+
+	/** Used to queue the alphabet if the message is sent in text mode and then AT+CMGS. */
+	void sendSMSAlphabet();
+
+	/** Used to queue AT+CMGS for the message at the head of the queue. */
+	void sendSMSNumber();
+
+	/**
+	 * Used to advance the SMS state machine when a command completes.
+	 * @param result One of the GSM_RESULT_* values.
+	 */
+	void smsResponse(uint8_t result);
+
+	/**
+	 * Used to remove the message at the head of the queue.
+	 * @param status The final status of the message.
+	 */
+	void finishSMS(uint8_t status);
+#endif
+
+#ifndef GSM_NO_CALLS
 	/** Used to update the call state machine. */
 	void updateCall();
 
-	/** Used to set the SMS mode to normal text. */
-	void setSMSTextMode();
+	/**
+	 * Used to advance the call state machine when a command completes.
+	 * @param result One of the GSM_RESULT_* values.
+	 */
+	void callResponse(uint8_t result);
+
+	/** Used by the library to automatically pick up incoming calls. */
+	void answer();
 
 	/**
-	 * Used to set the next string the GSM state machine should wait for.
-	 * @param str String to wait for.
+	 * Used to track the call from the last line, i.e. +CLCC: 1,0,3,0,0,"0123456789",129.
+	 * @param str Content of the line after "+CLCC:".
 	 */
-	void setGsmWaitingString(const char *str);
+	void parseCall(char *str);
 
 	/**
-	 * Used to set the next string the SMS or call state machine should wait for.
-	 * @param str String to wait for.
+	 * Used to check if the last line is one of the final result codes ending a call.
+	 * @return Returns the CALL_EVENT_* event of the result code or CALL_EVENT_NONE.
 	 */
-	void setOutWaitingString(const char *str);
+	uint8_t callResult();
 
-	/** Used to check if the desired string has been received. */
-	bool checkWaitingString(char input, const char *str, char **pStr);
+	/**
+	 * Used to set the state of the call state machine and report the event.
+	 * @param newState The new state for the call state machine.
+	 * @param event    One of the CALL_EVENT_* events.
+	 */
+	void callEvent(uint8_t newState, uint8_t event);
+#endif
+
+#ifndef GSM_NO_SMS_IN
+	/** Used by the library to check for ingoing messages. */
+	void checkSMS();
+
+	/** Used to update the inbox state machine, which reads and lists messages. */
+	void updateInbox();
 
 	/**
-	 * Used to check if a specific sentence has been received.
-	 * @param  input     The input from the GSM module.
-	 * @param  cmpString Sentence to compare too.
-	 * @param  pString   Pointer to the sentence.
-	 * @return           Returns true if the sentence has been received.
+	 * Used to parse the header of a message returned by AT+CMGR or AT+CMGL.
+	 * @return Returns true if the line is a header. The content of the message follows.
 	 */
-	bool checkString(char input, const char *cmpString, char **pString);
+	bool parseHeader();
+
+	/** Used to pass the content of a message on as it is received. It is called for every byte while the content is read. */
+	void updateBody();
 
 	/**
-	 * Used to extract content two characters. Not including those.
-	 * @param  buffer    Buffer to read into.
-	 * @param  size      Size of buffer.
-	 * @param  beginChar First character to look for.
-	 * @param  endChar   Last character to look for.
-	 * @param  offset    Offset after first character to the actual string.
-	 * @return           Returns true if the content is successfully extracted.
+	 * Used to pass a part of the content of a message to the body callback or to append it to messageIn.
+	 * The line breaks held back are passed on first, as the content continues.
+	 * @param data   Part of the content.
+	 * @param length Number of bytes.
 	 */
-	bool extractContent(char *buffer, uint8_t size, char beginChar, char endChar, uint8_t offset);
+	void passBody(const char *data, uint8_t length);
 
-	/** Used by the library to automatically pick up incoming calls. */
-	void answer();
+	/**
+	 * Used to deliver a message once the next header or the final response is received.
+	 * @param complete False if the message was interrupted.
+	 */
+	void finishBody(bool complete);
+
+	/**
+	 * Used to parse the header of a message delivered directly, i.e. +CMT: "number","","13/06/16,15:01:58+08".
+	 * @return Returns true if the line is a header. The content of the message follows.
+	 */
+	bool parseDirect();
+
+	/** Used to pass the content of a message delivered directly on as it is received. The content is a single line. */
+	void updateDirect();
+
+	/** Used to acknowledge a message delivered directly and deliver it. */
+	void finishDirect();
+
+	/**
+	 * Used to advance the inbox state machine when a command completes.
+	 * @param result One of the GSM_RESULT_* values.
+	 */
+	void inboxResponse(uint8_t result);
+
+	/** Used to queue AT+CMGR or AT+CMGL. */
+	void sendInboxRequest();
 
-	/** Used to power the on or off respectively using the power pin set in the constructor. */
-	void powerOn();
-	void powerOff();
+	/**
+	 * Used to queue AT+CMGDA once the messages have been listed by drainSMS().
+	 * @param  urgent True if the command continues an exchange.
+	 * @return        Returns true if the command was queued.
+	 */
+	bool sendInboxDelete(bool urgent);
+#endif
+
+	/**
+	 * Messages are sent in PDU mode and read in text mode, so the SMS and inbox state machines take turns.
+	 * A turn lasts from the first command that depends on the mode until the final response of the request.
+	 * @return Returns true if neither of them is in the middle of a turn.
+	 */
+	bool channelFree();
+
+	/**
+	 * Used to queue a command. The transaction engine sends the commands one at a time and is the only one matching the responses.
+	 * @param  type     One of the GSM_COMMAND_* types.
+	 * @param  wait     GSM_WAIT_* class of the timeout.
+	 * @param  request  Request to send or NULL if write is used.
+	 * @param  write    Used to write a request that is built when it is sent or NULL.
+	 * @param  response URC_* code that completes the command instead of the final response or URC_NONE.
+	 * @param  callback Called when the command completes or NULL.
+	 * @param  urgent   True to send the command before the queued commands. This is used to continue an exchange and can use the reserved entry.
+	 * @return          Returns the queued command or NULL if the queue is full.
+	 */
+	GSMCommand *queueCommand(uint8_t type, uint8_t wait, const __FlashStringHelper *request, bool (GSMSIM300::*write)(), uint8_t response, void (GSMSIM300::*callback)(uint8_t), bool urgent = false);
+
+	/** Used to match the response of the command being sent, check its timeout and send the next command. */
+	void updateCommands();
+
+	/**
+	 * Used to remove the command being sent from the queue and call its callback.
+	 * @param result One of the GSM_RESULT_* values.
+	 */
+	void completeCommand(uint8_t result);
+
+	/**
+	 * Used to handle ERROR, +CME ERROR and +CMS ERROR received for the command being sent.
+	 * The command fails or the module is recovered.
+	 * @param tier The GSM_RECOVERY_* tier needed by the error.
+	 */
+	void handleError(uint8_t tier);
+
+	/** Used to remove the command being sent and the queued commands that belong to a state machine, as the state machines restart their requests after a recovery. */
+	void flushCommands();
+
+	/** Used to update the registration and signal quality from +CREG and +CSQ, whether they are URCs or responses. */
+	void checkNetwork();
+
+	/** Used to sample the signal quality and to poll the registration while it is lost. It is only done when no commands are queued. */
+	void updateNetwork();
+
+	/**
+	 * Called when a sample completes. The sample is parsed by checkNetwork(), but a callback makes the transaction engine recover the module
+	 * if the sample times out, so a module that stops responding while it is idle is detected.
+	 * @param result One of the GSM_RESULT_* values.
+	 */
+	void networkResponse(uint8_t result);
+
+	/**
+	 * Used by the transaction engine to write the requests that are built when they are sent.
+	 * @return Returns false if nothing needs to be sent.
+	 */
+	bool writePin();
+	bool writeBaudRate();
+	bool writeRegistrationURC();
+#if !defined(GSM_NO_SMS_IN) || !defined(GSM_NO_SMS_OUT)
+	bool writeTextMode();
+#endif
+#ifndef GSM_NO_SMS_OUT
+	bool writePDUMode();
+	bool writeAlphabet();
+	bool writeSMSNumber();
+	bool writeSMSContent();
+#endif
+#ifndef GSM_NO_SMS_IN
+	bool writeInboxRequest();
+	bool writeDirectSMS();
+	bool writeDelete();
+	bool writeDeleteAll();
+#endif
+#ifndef GSM_NO_CALLS
+	bool writeCallURC();
+	bool writeDial();
+#endif
+
+	/**
+	 * Used to get the tier of recovery needed by an error code.
+	 * @param  code Error code.
+	 * @param  cms  True if the code was returned by +CMS ERROR and false if it was returned by +CME ERROR.
+	 * @return      Returns one of the GSM_RECOVERY_* tiers.
+	 */
+	static uint8_t errorTier(uint16_t code, bool cms);
+
+	/**
+	 * Used to recover the module after an error or timeout. The tier is escalated if the last recovery did not help.
+	 * @param tier The lowest GSM_RECOVERY_* tier to use.
+	 */
+	void recover(uint8_t tier);
+
+	/**
+	 * Used to restart the requests that were waiting for a response, so they are sent again once the module is running.
+	 * Queued messages are kept and the message being sent is sent again, unless it has used all of its attempts.
+	 * @param reset True if the module is reset or turned off, so an ongoing call is lost.
+	 */
+	void restartRequests(bool reset);
+
+	/**
+	 * Used to update the timeout of a class of responses.
+	 * @param wait One of the GSM_WAIT_* classes.
+	 * @param rtt  Response time in ms.
+	 */
+	void updateTimeout(uint8_t wait, uint32_t rtt);
+
+	/**
+	 * Used to advance the automaton matching every code in urcStrings by one character.
+	 * @param  input The input from the GSM module or -1 if no byte was received.
+	 * @return       Returns the URC_* event if a code has been received or URC_NONE otherwise.
+	 */
+	uint8_t matchURC(int input);
+
+	/**
+	 * Used to assemble the incoming characters into lines. Empty lines are skipped.
+	 * @param  input The input from the GSM module or -1 if no byte was received.
+	 * @return       Returns true if a complete line is available in lineBuffer. It is valid until the next character is assembled.
+	 */
+	bool assembleLine(int input);
+
+	/**
+	 * Used to check if the last line starts with a specific prefix.
+	 * @param  prefix Prefix stored in flash to look for, i.e. F("+CMGR:").
+	 * @return        Returns a pointer to the content after the prefix and any spaces or NULL if the line does not start with the prefix.
+	 */
+	char *checkLine(const __FlashStringHelper *prefix);
+
+	/**
+	 * Used to check if the last line is a specific response.
+	 * @param  response Response stored in flash, i.e. F("OK").
+	 * @return          Returns true if the whole line matches.
+	 */
+	bool isLine(const __FlashStringHelper *response);
+
+	/**
+	 * Used to split comma separated fields in place. Quotes around a field are removed.
+	 * @param  str       String to split. This is modified.
+	 * @param  fields    Pointers to the start of every field.
+	 * @param  maxFields Maximum number of fields to split.
+	 * @return           Returns the number of fields found.
+	 */
+	uint8_t splitFields(char *str, char **fields, uint8_t maxFields);
+
+	/**
+	 * Used to step through the timed power sequences without blocking.
+	 * @param  ms Time in ms since the last step.
+	 * @return    Returns true and restarts the timer when the time has elapsed.
+	 */
+	bool powerDelay(uint16_t ms);
 
 	/** Pin code for the SIM card. */
 	const char *pinCode;
@@ -207,30 +1113,142 @@ private:
 	/** Power pin connected to the module's status pin. */
 	const uint8_t powerPin;
 
-	/** Sentences to look for in the incoming characters sent from the GSM module. */
-	static const char *receiveSmsString, *incomingCallString, *hangupCallString, *powerDownString, *errorString;
+	/** Unsolicited result codes and responses to look for in the incoming characters sent from the GSM module. They are stored in flash. */
+	static const char urcStrings[URC_COUNT][URC_SIZE];
 
-	/** Pointers to the sentence to look for. */
-	char *pReceiveSmsString, *pIncomingCallString, *pHangupCallString, *pPowerDownString, *pErrorString;
+	/** State to fall back to on a mismatch for every number of characters matched of every code. It is calculated by the compiler and stored in flash. */
+	static const uint8_t urcFail[URC_COUNT][URC_SIZE];
 
-	/** Last incoming character received from the GSM module. */
-	char incomingChar;
+	/** State of the automaton: the code in the upper 3 bits and the number of characters matched in the lower 5 bits. 0 if nothing is matched. */
+	uint8_t urcState;
 
-	/** Buffers used set sentences to look for. */
-	char gsmString[20], outString[20];
+	/** Event matched by the last incoming character. */
+	uint8_t urcEvent;
 
-	/** Pointers to those buffers. */
-	char *pGsmString, *pOutString;
+	/**
+	 * Last incoming character received from the GSM module or -1 if no byte was received.
+	 * It is kept as returned by read(), so a 0xFF byte is not mistaken for -1 when char is signed and the other way around when it is unsigned.
+	 */
+	int incomingChar;
 
-	/** Timer used to reset the GSM module if it does not respond. */
-	uint32_t gsmTimer;
+	/** Commands queued for the transaction engine. The command at the head is the one being sent. */
+	GSMCommand commandQueue[GSM_COMMAND_QUEUE_SIZE];
+	uint8_t commandHead, commandCount;
+
+	/** True if the command at the head has been sent and is waiting for its response. */
+	bool commandActive;
+
+	/** Time the command was sent or the last line of a list was received and the timeout in ms. */
+	uint32_t commandTimer;
+	uint16_t commandTimeout;
+
+	/** Code of the last +CME ERROR or +CMS ERROR. 0 if ERROR was received. */
+	uint16_t commandError;
+	/** True if the last code was a +CMS ERROR, as some codes mean something else for +CME ERROR. */
+	bool commandErrorCms;
+
+	/** True if the next line is the content of a message, so it is not mistaken for a final response. */
+	bool commandBody;
+
+	/** True if +CPIN: READY was received. */
+	bool simReady;
+
+	/** Last network registration and signal quality and the time of the last sample. */
+	uint8_t registration, signalQuality;
+	uint32_t signalTimer;
+
+	/** Smoothed response time scaled by 8, the variation scaled by 4 and the timeout of every GSM_WAIT_* class. The response time is 0 until the first response. */
+	uint32_t srtt[GSM_WAIT_COUNT], rttvar[GSM_WAIT_COUNT];
+	uint16_t timeout[GSM_WAIT_COUNT];
+
+	/** Timer used to time the power sequences and the pauses between polls. */
+	uint32_t powerTimer;
+	/** Time the state machine was waiting for using powerDelay() during the last update() or 0 if it was not waiting. */
+	uint16_t powerWait;
+	/** True if the state changed or bytes were left unprocessed during the last update(). */
+	bool updateBusy;
 
 	/** State variables for the states machines. */
-	uint8_t gsmState, smsState, callState;
+	uint8_t gsmState;
+#ifndef GSM_NO_SMS_OUT
+	uint8_t smsState;
+#endif
+#ifndef GSM_NO_CALLS
+	uint8_t callState;
+#endif
+
+	/** CONFIG_* bits of the settings known to be set on the GSM module. Cleared when the module is turned off or returns an error. */
+	uint8_t modemConfig;
+
+	/** Number of configuration commands that were not sent. */
+	uint16_t skippedCommands;
 
+	/** GSM_RECOVERY_* tier of the last recovery and the state to return to after GSM_RESYNC. */
+	uint8_t recoveryTier, resumeState;
+
+	/** Function changing the baud rate of the serial instance, the initial and higher baud rate and the rate in use. */
+	BaudCallback baudCallback;
+	uint32_t baudInitial, baudTarget, baudRate;
+	/** Number of AT commands answered at the higher baud rate. */
+	uint8_t baudChecks;
+	/** True if the link was unreliable at the higher baud rate. */
+	bool baudFailed;
+
+	/** Buffer used to assemble the lines sent from the GSM module. */
+	char lineBuffer[GSM_LINE_BUFFER_SIZE];
+
+	/** Number of characters in the line being assembled. */
+	uint8_t lineLength;
+
+	/** True if the last incoming character completed a line. */
+	bool lineComplete;
+
+#ifndef GSM_NO_SMS_OUT
+	/** Queue of outgoing messages. */
+	SMSQueueEntry smsQueue[SMS_QUEUE_SIZE];
+
+	/** Index of the next message to send, number of messages in the queue and the last handle returned. */
+	uint8_t smsHead, smsCount, smsHandle;
+
+	/** Reference number of the last concatenated message. */
+	uint8_t pduReference;
+#endif
+
+#ifndef GSM_NO_SMS_IN
 	/** Buffer for last index received. */
 	char lastIndex[5];
 
+	/** State of the inbox state machine and the number of messages delivered by the last request. */
+	uint8_t inboxState, inboxCount;
+
+	/** Type of messages to list. */
+	const char *listType;
+
+	/** True if the listed messages should be deleted afterwards. */
+	bool inboxDrain;
+
+	/** True if new messages are delivered directly and true if the message being delivered is a PDU, which is rejected. */
+	bool directSMS, directPDU;
+
+	/** State of the inbox state machine to return to once a message delivered directly is complete. */
+	uint8_t directResume;
+
+	/** AT+CNMA or AT+CNMA=2 waiting for room in the command queue, or NULL. */
+	const __FlashStringHelper *directAck;
+
+	/** Function called for every message read. */
+	SMSCallback smsCallback;
+
+	/** Functions called with the header and the content of every message read, when the content is streamed. */
+	SMSHeaderCallback headerCallback;
+	SMSBodyCallback bodyCallback;
+
+	/** Number of line breaks in the content not passed on yet, since the content might end with them. */
+	uint8_t bodyBreaks;
+
+	/** True if the start of the current line of the content has been passed on, because it did not fit in the line buffer. */
+	bool bodyPartial;
+
 	/** Counter used to extract index from a received SMS. */
 	uint8_t indexCounter;
 
@@ -239,6 +1257,46 @@ private:
 
 	/** True if a new SMS has been received, but not yet read. */
 	bool newSms;
+#endif
+
+#ifndef GSM_NO_CALLS
+	/** Function called when the call progresses. */
+	CallCallback callCallback;
+#endif
+
+	/** Budget for a single call to update(). */
+	uint8_t rxMaxBytes;
+	uint16_t rxMaxTime;
+
+	/** Size of the receive buffer and the number of times it was found full. */
+	uint16_t rxBufferSize, rxOverruns;
+
+#ifdef LATENCYDEBUG
+	/** Worst-case time in us spent in update() while in each state. */
+	uint16_t gsmLatency[GSM_STATE_COUNT];
+#ifndef GSM_NO_SMS_OUT
+	uint16_t smsLatency[SMS_STATE_COUNT];
+#endif
+#ifndef GSM_NO_CALLS
+	uint16_t callLatency[CALL_STATE_COUNT];
+#endif
+#endif
+
+#ifdef GSM_STATS
+	GSMStats stats;
+	GSMStatsPrint statsPrint;
+
+	/** Type and time of the command waiting for a final response. */
+	uint8_t statsCommand;
+	uint32_t statsCommandTime;
+
+	/** True if the line being received when the command was sent has already been handled. */
+	bool statsSkipLine;
+
+	/** GSM state and the time it was entered. */
+	uint8_t statsState;
+	uint32_t statsStateTime;
+#endif
 };
 
 #endif
\ No newline at end of file
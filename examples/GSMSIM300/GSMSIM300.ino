@@ -13,9 +13,16 @@ GSMSIM300 GSM(&gsmSerial, pinCode, 4); // Pointer to serial instance, pin code,
 // You can also use a Hardware UART if you like:
 //GSMSIM300 GSM(&Serial1, pinCode, 4); // Pointer to serial instance, pin code, power pin
 
+// The library only queues SMS_QUEUE_SIZE messages, so responses to a batch of messages are kept here until there is room
+#define REPLY_QUEUE_SIZE 4
+char replyQueue[REPLY_QUEUE_SIZE][GSM_NUMBER_SIZE];
+uint8_t replyCount;
+
 void setup() {
   Serial.begin(115200);
   gsmSerial.begin(9600); // Start the communication with the GSM module
+  GSM.setRxBufferSize(256); // Let the library know the size of the receive buffer, so overruns can be detected
+  GSM.setSMSCallback(smsReceived); // This is called every time a message is read
   while (!Serial); // Wait for serial port to connect - used on Leonardo, Teensy and other boards with built-in USB CDC serial connection
   Serial.println(F("GSMSIM300 library is running!"));
 }
@@ -32,18 +39,31 @@ void loop() {
       else if (c == 'S')
         GSM.sendSMS(number, "You just received a SMS from a SIM300 GSM module :)"); // Send SMS
       else if (c == 'R')
-        GSM.readSMS(); // Read the last received SMS
+        GSM.readSMSAsync(); // Read the last received SMS
       else if (c == 'L')
         GSM.listSMS("ALL"); // List all messages
       else if (c == 'D')
         GSM.deleteSMSAll(); // Deletes all messages on the SIM card - this is useful as the SIM card has very limited storage capability
     }
-    if (GSM.newSMS()) { // Check if a new SMS is received
-      if (GSM.readSMS()) { // Returns true if the number and message of the sender is successfully extracted from the SMS
-        GSM.sendSMS(GSM.numberIn, "Automatic response from SIM300 GSM module"); // Sends a response to that number
-        Serial.println(GSM.messageIn);
-      }
-      GSM.deleteSMS(); // Delete the SMS again, as the SIM card has very limited storage capability
+    if (GSM.newSMS()) // Check if a new SMS is received
+      GSM.drainSMS(); // Read all messages without blocking and then delete them, as the SIM card has very limited storage capability - smsReceived() is called for every message
+    if (replyCount > 0 && sendReply(replyQueue[0])) { // Send the oldest response that did not fit in the queue
+      replyCount--;
+      memmove(replyQueue[0], replyQueue[1], replyCount * GSM_NUMBER_SIZE);
     }
   }
 }
+
+bool sendReply(const char *number) {
+  return GSM.sendSMS(number, "Automatic response from SIM300 GSM module") != 0; // 0 is returned if the queue is full
+}
+
+void smsReceived(const char *index, const char *status, const char *number, const char *timestamp, const char *message) {
+  Serial.println(message);
+  if (strcmp(status, "REC UNREAD") == 0 && !sendReply(number)) { // Only respond to new messages
+    if (replyCount < REPLY_QUEUE_SIZE)
+      GSMSIM300::copyField(replyQueue[replyCount++], GSM_NUMBER_SIZE, number); // Sent from loop() once the queue has room
+    else
+      Serial.println(F("Response could not be queued"));
+  }
+}
@@ -0,0 +1,170 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "Arduino.h"
+
+HostSerial Serial;
+
+static uint64_t virtualTime;
+static bool realTime;
+static uint64_t realTimeBase; // Monotonic time when the real time was enabled minus the virtual time at that point
+
+static uint64_t monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void sleepMicros(uint64_t us) {
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+#define MAX_PIN_HOOKS 16
+static struct {
+    uint8_t pin;
+    HostPinHook hook;
+    void *arg;
+} pinHooks[MAX_PIN_HOOKS];
+static uint8_t pinHookCount;
+
+uint32_t millis() {
+    return hostMicros() / 1000;
+}
+
+uint32_t micros() {
+    return hostMicros();
+}
+
+void delay(uint32_t ms) {
+    if (realTime)
+        sleepMicros((uint64_t)ms * 1000);
+    else
+        virtualTime += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(uint32_t us) {
+    hostAdvance(us);
+}
+
+void hostAdvance(uint32_t us) {
+    if (realTime)
+        sleepMicros(us);
+    else
+        virtualTime += us;
+}
+
+uint64_t hostMicros() {
+    if (realTime)
+        return monotonicMicros() - realTimeBase;
+    return virtualTime;
+}
+
+void hostUseRealTime(bool enable) {
+    if (enable == realTime)
+        return;
+    if (enable)
+        realTimeBase = monotonicMicros() - virtualTime;
+    else
+        virtualTime = monotonicMicros() - realTimeBase;
+    realTime = enable;
+}
+
+void hostAttachPin(uint8_t pin, HostPinHook hook, void *arg) {
+    if (pinHookCount < MAX_PIN_HOOKS) {
+        pinHooks[pinHookCount].pin = pin;
+        pinHooks[pinHookCount].hook = hook;
+        pinHooks[pinHookCount].arg = arg;
+        pinHookCount++;
+    }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    (void)pin;
+    (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    for (uint8_t i = 0; i < pinHookCount; i++) {
+        if (pinHooks[i].pin == pin)
+            pinHooks[i].hook(pin, value, pinHooks[i].arg);
+    }
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--)
+        n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(const __FlashStringHelper *str) {
+    return write(reinterpret_cast<const char *>(str));
+}
+
+size_t Print::print(const char *str) {
+    return write(str);
+}
+
+size_t Print::print(char c) {
+    return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char n, int base) {
+    return print((unsigned long)n, base);
+}
+
+size_t Print::print(int n, int base) {
+    return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+    return print((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base) {
+    if (base == DEC && n < 0)
+        return print('-') + print((unsigned long)-n, base);
+    return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), base == HEX ? "%lX" : "%lu", n);
+    return write(buffer);
+}
+
+size_t Print::print(double n, int digits) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+    return write(buffer);
+}
+
+size_t Print::println() {
+    return write("\r\n");
+}
+
+size_t HostSerial::write(uint8_t c) {
+    if (enabled)
+        putchar(c);
+    return 1;
+}
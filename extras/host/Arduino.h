@@ -0,0 +1,154 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _host_arduino_h_
+#define _host_arduino_h_
+
+// The subset of the Arduino API used by the library, so it can be built and benchmarked on a Linux host
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define DEC 10
+#define HEX 16
+
+class __FlashStringHelper;
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define PSTR(s) (s)
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcpy_P strcpy
+
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+/** The time is virtual and only advances when hostAdvance() or delay() is called, unless hostUseRealTime() is used. */
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+/**
+ * Used to advance the virtual time.
+ * @param us Time in us to advance.
+ */
+void hostAdvance(uint32_t us);
+
+/**
+ * Used to get the virtual time without wrapping.
+ * @return Returns the virtual time in us.
+ */
+uint64_t hostMicros();
+
+/**
+ * Used to make the time follow the monotonic clock of the host, i.e. when the library talks to a real module through PosixSerial.
+ * The time starts at the current virtual time, and delay() and hostAdvance() sleep. Processes forked afterwards share the same time.
+ * @param enable True to use the real time and false to use the virtual time.
+ */
+void hostUseRealTime(bool enable);
+
+/** Function called when a pin attached with hostAttachPin() is written. */
+typedef void (*HostPinHook)(uint8_t pin, uint8_t value, void *arg);
+
+/**
+ * Used to get notified when a pin is written, i.e. by an emulated module connected to the power pin.
+ * @param pin  Pin to attach to.
+ * @param hook Function to call.
+ * @param arg  Argument passed to the function.
+ */
+void hostAttachPin(uint8_t pin, HostPinHook hook, void *arg);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+class Print {
+public:
+	virtual ~Print() {};
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size);
+	size_t write(const char *str) {
+		return write((const uint8_t *)str, strlen(str));
+	};
+
+	size_t print(const __FlashStringHelper *str);
+	size_t print(const char *str);
+	size_t print(char c);
+	size_t print(unsigned char n, int base = DEC);
+	size_t print(int n, int base = DEC);
+	size_t print(unsigned int n, int base = DEC);
+	size_t print(long n, int base = DEC);
+	size_t print(unsigned long n, int base = DEC);
+	size_t print(double n, int digits = 2);
+
+	size_t println();
+	template <typename T> size_t println(T value) {
+		size_t n = print(value);
+		return n + println();
+	};
+	template <typename T> size_t println(T value, int format) {
+		size_t n = print(value, format);
+		return n + println();
+	};
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() {};
+};
+
+/** Serial port used for debugging. The output is discarded unless it is enabled. */
+class HostSerial : public Stream {
+public:
+	using Print::write;
+	HostSerial() : enabled(false) {};
+	void begin(unsigned long) {};
+	operator bool() {
+		return true;
+	};
+	void enable(bool enable) {
+		enabled = enable;
+	};
+	size_t write(uint8_t c);
+	int available() {
+		return 0;
+	};
+	int read() {
+		return -1;
+	};
+	int peek() {
+		return -1;
+	};
+private:
+	bool enabled;
+};
+
+extern HostSerial Serial;
+
+#endif
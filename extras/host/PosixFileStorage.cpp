@@ -0,0 +1,72 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "PosixFileStorage.h"
+
+PosixFileStorage::PosixFileStorage() :
+writeCalls(0),
+syncCalls(0),
+fd(-1),
+length(0)
+{
+}
+
+PosixFileStorage::~PosixFileStorage() {
+    end();
+}
+
+bool PosixFileStorage::begin(const char *path, uint32_t size) {
+    end();
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return false;
+    off_t current = lseek(fd, 0, SEEK_END);
+    if (current < 0 || ((uint32_t)current < size && ftruncate(fd, size) != 0)) { // New bytes read as zero, which is never a valid record
+        end();
+        return false;
+    }
+    length = size;
+    return true;
+}
+
+void PosixFileStorage::end() {
+    if (fd < 0)
+        return;
+    close(fd);
+    fd = -1;
+}
+
+bool PosixFileStorage::read(uint32_t address, uint8_t *data, uint16_t count) {
+    return fd >= 0 && address + count <= length && pread(fd, data, count, address) == count;
+}
+
+bool PosixFileStorage::write(uint32_t address, const uint8_t *data, uint16_t count) {
+    if (fd < 0 || address + count > length)
+        return false;
+    writeCalls++;
+    return pwrite(fd, data, count, address) == count;
+}
+
+bool PosixFileStorage::commit() {
+    if (fd < 0)
+        return false;
+    syncCalls++;
+    return fdatasync(fd) == 0;
+}
@@ -0,0 +1,58 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _posixfilestorage_h_
+#define _posixfilestorage_h_
+
+// Storage of the outbox log in a file on a Linux gateway
+
+#include "GSMOutbox.h"
+
+/** Log storage in a file. The file is extended to the size of the log and every commit is made durable by fdatasync(). */
+class PosixFileStorage : public GSMLogStorage {
+public:
+	PosixFileStorage();
+	~PosixFileStorage();
+
+	/**
+	 * Used to open the file. It is created if it does not exist.
+	 * @param  path   Path of the file.
+	 * @param  length Size of the log in bytes.
+	 * @return        Returns true if the file was opened.
+	 */
+	bool begin(const char *path, uint32_t length);
+
+	/** Used to close the file. */
+	void end();
+
+	/** GSMLogStorage implementation. */
+	uint32_t size() {
+		return length;
+	};
+	bool read(uint32_t address, uint8_t *data, uint16_t count);
+	bool write(uint32_t address, const uint8_t *data, uint16_t count);
+	bool commit();
+
+	/** Number of write() and fdatasync() calls. */
+	uint32_t writeCalls, syncCalls;
+
+private:
+	int fd;
+	uint32_t length;
+};
+
+#endif
@@ -0,0 +1,194 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "PosixSerial.h"
+
+/** Number of times update() is called in a row while the library has more to do, before the driver sleeps anyway. */
+#define POSIX_DRIVER_MAX_UPDATES  16
+
+static speed_t baudConstant(uint32_t baud) {
+    switch (baud) {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        default: return B0;
+    }
+}
+
+PosixSerial::PosixSerial() :
+rxBytes(0),
+txBytes(0),
+readCalls(0),
+writeCalls(0),
+fd(-1),
+rxPos(0),
+rxLength(0),
+txLength(0)
+{
+}
+
+PosixSerial::~PosixSerial() {
+    end();
+}
+
+bool PosixSerial::begin(const char *path, uint32_t baud) {
+    speed_t speed = baudConstant(baud);
+    if (speed == B0)
+        return false;
+    end();
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        return false;
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0) {
+        end();
+        return false;
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        end();
+        return false;
+    }
+    tcflush(fd, TCIOFLUSH);
+    rxPos = rxLength = txLength = 0;
+    return true;
+}
+
+void PosixSerial::end() {
+    if (fd < 0)
+        return;
+    flush();
+    close(fd);
+    fd = -1;
+}
+
+size_t PosixSerial::write(uint8_t c) {
+    if (txLength >= sizeof(txBuffer))
+        flush();
+    txBuffer[txLength++] = c;
+    return 1;
+}
+
+size_t PosixSerial::write(const uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        write(buffer[i]);
+    return size;
+}
+
+void PosixSerial::flush() {
+    uint16_t pos = 0;
+    while (fd >= 0 && pos < txLength) {
+        ssize_t n = ::write(fd, txBuffer + pos, txLength - pos);
+        writeCalls++;
+        if (n > 0) {
+            pos += n;
+            txBytes += n;
+        } else if (n < 0 && errno == EAGAIN) { // The output buffer of the port is full
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            ::poll(&pfd, 1, -1);
+        } else if (n < 0 && errno != EINTR)
+            break; // The port is gone, so the bytes are dropped
+    }
+    txLength = 0;
+}
+
+bool PosixSerial::fill() {
+    if (fd < 0)
+        return false;
+    ssize_t n = ::read(fd, rxBuffer, sizeof(rxBuffer));
+    readCalls++;
+    if (n <= 0)
+        return false;
+    rxPos = 0;
+    rxLength = n;
+    rxBytes += n;
+    return true;
+}
+
+int PosixSerial::available() {
+    if (rxPos >= rxLength)
+        fill();
+    return rxLength - rxPos;
+}
+
+int PosixSerial::read() {
+    if (rxPos >= rxLength && !fill())
+        return -1;
+    return rxBuffer[rxPos++];
+}
+
+int PosixSerial::peek() {
+    if (rxPos >= rxLength && !fill())
+        return -1;
+    return rxBuffer[rxPos];
+}
+
+PosixDriver::PosixDriver(GSMSIM300 *gsm, PosixSerial *serial) :
+wakeups(0),
+updates(0),
+gsm(gsm),
+serial(serial)
+{
+    gsm->setRxBufferSize(0xFFFF); // The kernel buffers the incoming bytes, so the receive buffer can not overrun
+}
+
+void PosixDriver::update() {
+    gsm->update();
+    serial->flush();
+    updates++;
+}
+
+bool PosixDriver::poll(uint32_t maxWait /*= GSM_NO_DEADLINE*/) {
+    // Requests made since the last call are started before sleeping
+    uint8_t count = 0;
+    do
+        update();
+    while ((gsm->getNextDeadline() == 0 || serial->buffered()) && ++count < POSIX_DRIVER_MAX_UPDATES);
+
+    uint32_t wait = serial->buffered() ? 0 : gsm->getNextDeadline();
+    if (wait > maxWait)
+        wait = maxWait;
+    struct pollfd pfd = { serial->getFd(), POLLIN, 0 };
+    int ret = ::poll(&pfd, 1, wait == GSM_NO_DEADLINE ? -1 : (int)(wait > 0x7FFFFFFF ? 0x7FFFFFFF : wait));
+    if (ret < 0 && errno != EINTR)
+        return false;
+    if (ret > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+        return false;
+    wakeups++;
+    update();
+    return true;
+}
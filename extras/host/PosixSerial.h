@@ -0,0 +1,123 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _posixserial_h_
+#define _posixserial_h_
+
+// Serial port and event loop used to run the library on a Linux gateway
+// Use hostUseRealTime(true) before the library is created, so millis() follows the real time
+
+#include "Arduino.h"
+#include "GSMSIM300.h"
+
+/** Size of the receive and transmit buffers. Bytes are read and written in batches of up to this size. */
+#ifndef POSIX_SERIAL_BUFFER_SIZE
+#define POSIX_SERIAL_BUFFER_SIZE  256
+#endif
+
+/** Stream implementation using a non-blocking termios file descriptor, i.e. /dev/ttyUSB0 or the slave side of a pseudo-terminal. */
+class PosixSerial : public Stream {
+public:
+	PosixSerial();
+	~PosixSerial();
+
+	/**
+	 * Used to open and configure a serial port. The port is set to raw mode with 8 data bits, no parity and one stop bit.
+	 * @param  path Path of the serial port.
+	 * @param  baud Baud rate.
+	 * @return      Returns true if the port was opened and the baud rate is supported.
+	 */
+	bool begin(const char *path, uint32_t baud);
+
+	/** Used to close the serial port. Bytes waiting to be sent are written first. */
+	void end();
+
+	/**
+	 * Used to get the file descriptor, so it can be polled.
+	 * @return Returns the file descriptor or -1 if the port is closed.
+	 */
+	int getFd() {
+		return fd;
+	};
+
+	/** Stream implementation. The bytes are buffered, so a whole command is written by one system call. */
+	using Print::write;
+	size_t write(uint8_t c);
+	size_t write(const uint8_t *buffer, size_t size);
+	int available();
+	int read();
+	int peek();
+
+	/** Used to write the buffered bytes. It waits until the port accepts them. */
+	void flush();
+
+	/**
+	 * Used to get the number of bytes waiting in the receive buffer without reading the port.
+	 * @return Returns the number of bytes.
+	 */
+	uint16_t buffered() {
+		return rxLength - rxPos;
+	};
+
+	/** Number of bytes transferred and system calls used to transfer them. */
+	uint32_t rxBytes, txBytes, readCalls, writeCalls;
+
+private:
+	/**
+	 * Used to fill the receive buffer using a single read().
+	 * @return Returns true if any bytes were read.
+	 */
+	bool fill();
+
+	int fd;
+	uint8_t rxBuffer[POSIX_SERIAL_BUFFER_SIZE], txBuffer[POSIX_SERIAL_BUFFER_SIZE];
+	uint16_t rxPos, rxLength, txLength;
+};
+
+/**
+ * Event loop that only updates the library when bytes are received or one of its timers expires.
+ * The caller sleeps in poll() in between, so an idle modem uses close to no CPU time.
+ */
+class PosixDriver {
+public:
+	/**
+	 * Constructor for the driver.
+	 * @param gsm    Instance of the library.
+	 * @param serial Serial port used by the library.
+	 */
+	PosixDriver(GSMSIM300 *gsm, PosixSerial *serial);
+
+	/**
+	 * Used to update the library, sleep until bytes are received, the next deadline of the library expires or the time runs out, and update it again.
+	 * Call this in a loop. Requests, i.e. sendSMS(), can be made between the calls.
+	 * @param  maxWait Maximum time in ms to sleep. Use GSM_NO_DEADLINE to sleep until something happens.
+	 * @return         Returns false if the serial port could not be polled.
+	 */
+	bool poll(uint32_t maxWait = GSM_NO_DEADLINE);
+
+	/** Number of times the driver woke up and the number of calls to update(). */
+	uint32_t wakeups, updates;
+
+private:
+	/** Used to update the library and write the bytes it sent. */
+	void update();
+
+	GSMSIM300 *gsm;
+	PosixSerial *serial;
+};
+
+#endif
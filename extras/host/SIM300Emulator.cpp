@@ -0,0 +1,552 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "SIM300Emulator.h"
+
+#define CALL_NONE 0xFF
+
+SIM300Emulator::SIM300Emulator(uint8_t powerPin /*= 4*/, uint32_t baud /*= 9600*/) :
+directAcknowledged(0),
+directRejected(0),
+commandCount(0),
+rxBytes(0),
+txBytes(0),
+bootCount(0),
+hostBaud(baud),
+moduleBaud(0),
+lockedBaud(0),
+baudLimit(0),
+wireBytes(0),
+rxFreeAt(0),
+txFreeAt(0),
+messageInput(false),
+pduMode(false),
+pduLength(0),
+powered(false),
+echo(true),
+pinEntered(false),
+hung(false),
+rejectCount(0),
+powerOnTime(0),
+powerKeyTime(0),
+registrationDelay(3000),
+commandLatency(20),
+networkLatency(1500),
+answerDelay(3000),
+cregMode(0),
+reportedRegistration(0),
+messageReference(0),
+nextIndex(1),
+cnmiMode(1),
+outageStart(0),
+outageEnd(0),
+callState(CALL_NONE),
+clccMode(0),
+reportedCall(CALL_NONE),
+callIncoming(false),
+callTime(0) {
+    hostAttachPin(powerPin, pinHook, this);
+}
+
+void SIM300Emulator::setBaud(uint32_t baud) {
+    hostBaud = baud;
+}
+
+bool SIM300Emulator::garbled() {
+    if (getModuleBaud() != hostBaud)
+        return true;
+    return baudLimit && hostBaud > baudLimit && ++wireBytes % 16 == 0;
+}
+
+void SIM300Emulator::pinHook(uint8_t pin, uint8_t value, void *arg) {
+    (void)pin;
+    static_cast<SIM300Emulator *>(arg)->powerKey(value);
+}
+
+// Pulling the power key low for at least 500 ms toggles the power
+void SIM300Emulator::powerKey(uint8_t value) {
+    if (value == LOW)
+        powerKeyTime = hostMicros();
+    else if (powerKeyTime && hostMicros() - powerKeyTime >= 500000) {
+        powerKeyTime = 0;
+        if (powered) {
+            powered = false;
+            hung = false;
+            rxQueue.clear();
+        } else
+            powerOn();
+    } else
+        powerKeyTime = 0;
+}
+
+void SIM300Emulator::powerOn() {
+    bootCount++;
+    powered = true;
+    echo = true;
+    pinEntered = pinCode.empty();
+    cregMode = 0;
+    cnmiMode = 1;
+    unacknowledged.clear();
+    callState = reportedCall = CALL_NONE;
+    clccMode = 0;
+    messageInput = false;
+    pduMode = true; // PDU mode is the default after power on
+    moduleBaud = lockedBaud = 0; // The rate set by AT+IPR is not saved, so the module starts in autobaud
+    input.clear();
+    powerOnTime = hostMicros();
+    respond("RDY", 500);
+    respond(pinEntered ? "+CPIN: READY" : "+CPIN: SIM PIN", 1000);
+    if (pinEntered)
+        respond("Call Ready", 2000);
+}
+
+// The +CLCC URC is sent when the state of the call changes if it is enabled using AT+CLCC=1
+void SIM300Emulator::reportCall() {
+    if (clccMode != 1 || callState == reportedCall)
+        return;
+    char urc[64];
+    snprintf(urc, sizeof(urc), "+CLCC: 1,%u,%u,0,0,\"%s\",129", callIncoming ? 1 : 0, callState == CALL_NONE ? 6 : callState, callNumber.c_str());
+    reportedCall = callState;
+    respond(urc);
+}
+
+uint8_t SIM300Emulator::registration() {
+    if (!pinEntered || hostMicros() - powerOnTime < (uint64_t)registrationDelay * 1000)
+        return 2; // Searching
+    if (hostMicros() >= outageStart && hostMicros() < outageEnd)
+        return 2; // The network is lost
+    return 1; // Registered to the home network
+}
+
+void SIM300Emulator::scheduleURC(uint32_t ms, const char *urc) {
+    Event event;
+    event.time = (uint64_t)ms * 1000;
+    event.urc = urc;
+    event.sms = false;
+    events.push_back(event);
+}
+
+void SIM300Emulator::receiveSMS(uint32_t ms, const char *number, const char *message) {
+    Event event;
+    event.time = (uint64_t)ms * 1000;
+    event.number = number;
+    event.message = message;
+    event.sms = true;
+    events.push_back(event);
+}
+
+void SIM300Emulator::process() {
+    for (size_t i = 0; i < events.size();) {
+        if (events[i].time > hostMicros()) {
+            i++;
+            continue;
+        }
+        Event event = events[i];
+        events.erase(events.begin() + i);
+        if (!powered || hung)
+            continue;
+        if (event.sms) {
+            SIM300Message m;
+            m.status = "REC UNREAD";
+            m.number = event.number;
+            m.timestamp = "13/06/16,15:01:58+08";
+            m.message = event.message;
+            if (cnmiMode == 2) {
+                char header[128];
+                if (pduMode) { // The content is sent as a PDU, which is not encoded by the emulator
+                    snprintf(header, sizeof(header), "+CMT: ,%u", (unsigned)(m.message.size() + 20));
+                    respond(header);
+                    send(std::string((m.message.size() + 28) * 2, '0') + "\r\n", 0);
+                } else {
+                    snprintf(header, sizeof(header), "+CMT: \"%s\",\"\",\"%s\"", m.number.c_str(), m.timestamp.c_str());
+                    respond(header);
+                    send(m.message + "\r\n", 0);
+                }
+                unacknowledged.push_back(std::make_pair(hostMicros() + 10000000ULL, m));
+                continue;
+            }
+            m.index = nextIndex++;
+            storedMessages.push_back(m);
+            char urc[32];
+            snprintf(urc, sizeof(urc), "+CMTI: \"SM\",%u", m.index);
+            respond(urc);
+        } else {
+            if (event.urc == "NO CARRIER" || event.urc == "BUSY" || event.urc == "NO ANSWER") {
+                callState = CALL_NONE;
+                reportCall(); // The call is reported as disconnected before the result code
+            }
+            if (event.urc == "RING" && callState == CALL_NONE) {
+                callState = 4; // Incoming
+                callIncoming = true;
+                callNumber = "0123456789";
+                reportCall(); // The number is reported before the first RING
+            }
+            respond(event.urc);
+        }
+    }
+    if (!unacknowledged.empty() && unacknowledged.front().first <= hostMicros()) {
+        SIM300Message m = unacknowledged.front().second;
+        unacknowledged.pop_front();
+        m.index = nextIndex++;
+        storedMessages.push_back(m); // Not announced, since the routing is turned off
+        cnmiMode = 0;
+    }
+    if (powered && !hung && !callIncoming && callState == 2 && hostMicros() - callTime >= 500000)
+        callState = 3; // The other end is ringing
+    if (powered && !hung && !callIncoming && callState == 3 && hostMicros() - callTime >= (uint64_t)answerDelay * 1000) {
+        if (callOutcome.empty())
+            callState = 0; // The other end answered the call
+        else {
+            callState = CALL_NONE;
+            reportCall();
+            respond(callOutcome);
+        }
+    }
+    if (powered && !hung)
+        reportCall();
+    if (powered && !hung && cregMode == 1 && registration() != reportedRegistration) {
+        reportedRegistration = registration();
+        char urc[16];
+        snprintf(urc, sizeof(urc), "+CREG: %u", reportedRegistration);
+        respond(urc);
+    }
+}
+
+uint64_t SIM300Emulator::getNextEvent() {
+    uint64_t next = SIM300_NO_EVENT, now = hostMicros();
+    if (!rxQueue.empty())
+        next = rxQueue.front().first;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].time < next)
+            next = events[i].time;
+    }
+    if (!unacknowledged.empty() && unacknowledged.front().first < next)
+        next = unacknowledged.front().first;
+    if (!powered || hung)
+        return next;
+    if (!callIncoming && callState == 2 && callTime + 500000 < next)
+        next = callTime + 500000;
+    else if (!callIncoming && callState == 3 && callTime + (uint64_t)answerDelay * 1000 < next)
+        next = callTime + (uint64_t)answerDelay * 1000;
+    if (cregMode == 1) { // The changes of the registration are reported by +CREG
+        uint64_t registered = powerOnTime + (uint64_t)registrationDelay * 1000;
+        if (registered > now && registered < next)
+            next = registered;
+        if (outageStart > now && outageStart < next)
+            next = outageStart;
+        if (outageEnd > now && outageEnd < next)
+            next = outageEnd;
+    }
+    return next;
+}
+
+int SIM300Emulator::available() {
+    process();
+    int count = 0;
+    for (size_t i = 0; i < rxQueue.size() && rxQueue[i].first <= hostMicros(); i++)
+        count++;
+    return count;
+}
+
+int SIM300Emulator::read() {
+    process();
+    if (rxQueue.empty() || rxQueue.front().first > hostMicros())
+        return -1;
+    char c = rxQueue.front().second;
+    rxQueue.pop_front();
+    rxBytes++;
+    return (uint8_t)c;
+}
+
+int SIM300Emulator::peek() {
+    process();
+    if (rxQueue.empty() || rxQueue.front().first > hostMicros())
+        return -1;
+    return (uint8_t)rxQueue.front().second;
+}
+
+size_t SIM300Emulator::write(uint8_t c) {
+    txBytes++;
+    if (txFreeAt < hostMicros())
+        txFreeAt = hostMicros();
+    txFreeAt += 10000000UL / hostBaud; // 10 bits per byte
+    if (!powered || hung)
+        return 1;
+    if (!moduleBaud && !lockedBaud && (c == 'A' || c == 'a'))
+        lockedBaud = hostBaud; // Autobaud locks on the first AT
+    if (garbled())
+        c |= 0x80;
+
+    if (messageInput) {
+        if (c == 26) { // CTRL-Z
+            messageInput = false;
+            if (pduMode && input.size() != (size_t)(pduLength + 1) * 2) { // The length does not include the service centre address
+                input.clear();
+                finalResponse("+CMS ERROR: 304"); // Invalid PDU mode parameter
+                return 1;
+            }
+            if (rejectCount > 0) {
+                rejectCount--;
+                input.clear();
+                finalResponse(rejectResponse, networkLatency);
+                return 1;
+            }
+            SIM300Message m;
+            m.index = 0;
+            m.status = "STO SENT";
+            m.number = messageNumber;
+            m.message = input;
+            sentMessages.push_back(m);
+            input.clear();
+            char response[32];
+            snprintf(response, sizeof(response), "+CMGS: %u", ++messageReference);
+            respond(response, networkLatency);
+            finalResponse("OK", networkLatency);
+        } else if (c == 27) { // ESC
+            messageInput = false;
+            input.clear();
+            finalResponse("OK");
+        } else {
+            input += (char)c;
+            if (echo)
+                send(std::string(1, c), txFreeAt);
+        }
+        return 1;
+    }
+
+    if (echo)
+        send(std::string(1, c), txFreeAt);
+    if (c == '\r') {
+        std::string cmd = input;
+        input.clear();
+        if (!cmd.empty())
+            command(cmd);
+    } else if (c != '\n')
+        input += (char)c;
+    return 1;
+}
+
+void SIM300Emulator::send(const std::string &str, uint64_t time) {
+    uint64_t t = time > rxFreeAt ? time : rxFreeAt;
+    for (size_t i = 0; i < str.size(); i++) {
+        t += 10000000UL / getModuleBaud();
+        rxQueue.push_back(std::make_pair(t, garbled() ? (char)(str[i] | 0x80) : str[i]));
+    }
+    rxFreeAt = t;
+}
+
+void SIM300Emulator::respond(const std::string &line, uint32_t latency /*= 0*/) {
+    uint64_t time = txFreeAt > hostMicros() ? txFreeAt : hostMicros();
+    send("\r\n" + line + "\r\n", time + (uint64_t)latency * 1000);
+}
+
+void SIM300Emulator::finalResponse(const std::string &line, uint32_t latency /*= 0*/) {
+    respond(line, latency ? latency : commandLatency);
+}
+
+void SIM300Emulator::listMessage(const SIM300Message &m, bool list) {
+    char header[128];
+    if (list)
+        snprintf(header, sizeof(header), "+CMGL: %u,\"%s\",\"%s\",\"\",\"%s\"", m.index, m.status.c_str(), m.number.c_str(), m.timestamp.c_str());
+    else
+        snprintf(header, sizeof(header), "+CMGR: \"%s\",\"%s\",\"\",\"%s\"", m.status.c_str(), m.number.c_str(), m.timestamp.c_str());
+    respond(header, commandLatency);
+    send(m.message + "\r\n", 0);
+}
+
+void SIM300Emulator::command(const std::string &cmd) {
+    commandCount++;
+    char buffer[64];
+
+    if (!failResponse.empty()) {
+        finalResponse(failResponse);
+        failResponse.clear();
+        return;
+    }
+
+    if (cmd == "AT" || cmd == "ATE1" || cmd == "ATE0") {
+        if (cmd == "ATE0")
+            echo = false;
+        else if (cmd == "ATE1")
+            echo = true;
+        finalResponse("OK");
+    } else if (cmd == "AT+IPR?") {
+        snprintf(buffer, sizeof(buffer), "+IPR: %u", moduleBaud);
+        respond(buffer, commandLatency);
+        finalResponse("OK");
+    } else if (cmd.compare(0, 7, "AT+IPR=") == 0) {
+        uint32_t baud = strtoul(cmd.c_str() + 7, NULL, 10);
+        if (baud != 0 && baud != 1200 && baud != 2400 && baud != 4800 && baud != 9600 && baud != 19200 && baud != 38400 && baud != 57600 && baud != 115200) {
+            finalResponse("ERROR");
+            return;
+        }
+        finalResponse("OK"); // The response is sent at the old rate
+        moduleBaud = baud;
+        lockedBaud = 0;
+    } else if (cmd == "AT+CPOWD=0") { // Urgent power off without a response
+        powered = false;
+        rxQueue.clear();
+    } else if (cmd == "AT+CPOWD=1") {
+        respond("NORMAL POWER DOWN", commandLatency);
+        powered = false;
+    } else if (cmd.compare(0, 8, "AT+CPIN=") == 0) {
+        std::string pin = cmd.substr(8);
+        if (pinEntered)
+            finalResponse("+CME ERROR: 3"); // Operation not allowed
+        else if (pin == pinCode) {
+            pinEntered = true;
+            powerOnTime = hostMicros();
+            finalResponse("OK");
+            respond("+CPIN: READY", 100);
+            respond("Call Ready", 2000);
+        } else
+            finalResponse("+CME ERROR: 16"); // Incorrect password
+    } else if (cmd == "AT+CFUN=1,1") { // Reset
+        finalResponse("OK");
+        powerOn();
+    } else if (cmd.compare(0, 8, "AT+CFUN=") == 0) {
+        finalResponse("OK");
+    } else if (cmd == "AT+CPIN?") {
+        respond(pinEntered ? "+CPIN: READY" : "+CPIN: SIM PIN", commandLatency);
+        finalResponse("OK");
+    } else if (cmd == "AT+CREG?") {
+        snprintf(buffer, sizeof(buffer), "+CREG: %u,%u", cregMode, registration());
+        respond(buffer, commandLatency);
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CREG=") == 0) {
+        cregMode = atoi(cmd.c_str() + 8);
+        reportedRegistration = registration();
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CNMI=") == 0 || cmd.compare(0, 8, "AT+CSMS=") == 0) {
+        size_t cnmi = cmd.find("+CNMI=");
+        if (cmd.compare(0, 8, "AT+CSMS=") == 0)
+            respond("+CSMS: 1,1,1", commandLatency);
+        if (cnmi != std::string::npos)
+            cnmiMode = atoi(cmd.c_str() + cmd.find(',', cnmi) + 1);
+        finalResponse("OK");
+    } else if (cmd == "AT+CNMA" || cmd == "AT+CNMA=2") {
+        if (unacknowledged.empty()) {
+            finalResponse("+CMS ERROR: 340"); // No acknowledgement expected
+            return;
+        }
+        SIM300Message m = unacknowledged.front().second;
+        unacknowledged.pop_front();
+        if (cmd == "AT+CNMA")
+            directAcknowledged++;
+        else { // The network delivers the message again
+            directRejected++;
+            receiveSMS(hostMicros() / 1000 + 5000, m.number.c_str(), m.message.c_str());
+        }
+        finalResponse("OK");
+    } else if (cmd == "AT+CSQ") {
+        respond(registration() == 1 ? "+CSQ: 20,0" : "+CSQ: 99,99", commandLatency);
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CMGF=") == 0) {
+        pduMode = atoi(cmd.c_str() + 8) == 0;
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CSCS=") == 0 || cmd.compare(0, 8, "AT+CNMI=") == 0) {
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CMGS=") == 0) {
+        if (registration() != 1) {
+            finalResponse("+CMS ERROR: 331"); // No network service
+            return;
+        }
+        if (pduMode) {
+            messageNumber.clear();
+            pduLength = atoi(cmd.c_str() + 8);
+        } else {
+            messageNumber = cmd.substr(8);
+            if (messageNumber.size() >= 2 && messageNumber[0] == '"')
+                messageNumber = messageNumber.substr(1, messageNumber.size() - 2);
+        }
+        messageInput = true;
+        send("\r\n> ", txFreeAt + (uint64_t)commandLatency * 1000);
+    } else if (cmd.compare(0, 8, "AT+CMGR=") == 0) {
+        uint8_t index = atoi(cmd.c_str() + 8);
+        for (size_t i = 0; i < storedMessages.size(); i++) {
+            if (storedMessages[i].index == index) {
+                listMessage(storedMessages[i], false);
+                if (storedMessages[i].status == "REC UNREAD")
+                    storedMessages[i].status = "REC READ";
+                break;
+            }
+        }
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CMGL=") == 0) {
+        std::string type = cmd.substr(9, cmd.size() - 10);
+        for (size_t i = 0; i < storedMessages.size(); i++) {
+            if (type == "ALL" || type == storedMessages[i].status) {
+                listMessage(storedMessages[i], true);
+                if (storedMessages[i].status == "REC UNREAD")
+                    storedMessages[i].status = "REC READ";
+            }
+        }
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CMGD=") == 0) {
+        uint8_t index = atoi(cmd.c_str() + 8);
+        for (size_t i = 0; i < storedMessages.size(); i++) {
+            if (storedMessages[i].index == index) {
+                storedMessages.erase(storedMessages.begin() + i);
+                break;
+            }
+        }
+        finalResponse("OK");
+    } else if (cmd.compare(0, 9, "AT+CMGDA=") == 0) {
+        std::string type = cmd.substr(10, cmd.size() - 11);
+        for (size_t i = 0; i < storedMessages.size();) {
+            if (type == "DEL ALL" || (type == "DEL READ" && storedMessages[i].status == "REC READ") || (type == "DEL UNREAD" && storedMessages[i].status == "REC UNREAD"))
+                storedMessages.erase(storedMessages.begin() + i);
+            else
+                i++;
+        }
+        finalResponse("OK");
+    } else if (cmd.compare(0, 3, "ATD") == 0) {
+        if (registration() != 1) {
+            finalResponse("NO DIALTONE");
+            return;
+        }
+        callNumber = cmd.substr(3, cmd.find(';') - 3);
+        callState = 2; // Dialing
+        callIncoming = false;
+        callTime = hostMicros();
+        finalResponse("OK");
+    } else if (cmd == "AT+CLCC") {
+        if (callState != CALL_NONE) {
+            snprintf(buffer, sizeof(buffer), "+CLCC: 1,%u,%u,0,0,\"%s\",129", callIncoming ? 1 : 0, callState, callNumber.c_str());
+            respond(buffer, commandLatency);
+        }
+        finalResponse("OK");
+    } else if (cmd.compare(0, 8, "AT+CLCC=") == 0) {
+        clccMode = atoi(cmd.c_str() + 8);
+        reportedCall = callState;
+        finalResponse("OK");
+    } else if (cmd == "ATH") {
+        callState = CALL_NONE;
+        finalResponse("OK");
+    } else if (cmd == "ATA") {
+        if (callState != 4) {
+            finalResponse("NO CARRIER");
+            return;
+        }
+        callState = 0;
+        finalResponse("OK");
+    } else
+        finalResponse("ERROR");
+}
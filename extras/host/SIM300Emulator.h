@@ -0,0 +1,251 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+#ifndef _sim300emulator_h_
+#define _sim300emulator_h_
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+
+/** Returned by SIM300Emulator::getNextEvent() when the module is only waiting for the Arduino. */
+#define SIM300_NO_EVENT 0xFFFFFFFFFFFFFFFFULL
+
+/** Stored message on the emulated SIM card. */
+struct SIM300Message {
+	uint8_t index;
+	std::string status, number, timestamp, message;
+};
+
+/**
+ * In-process emulation of a SIM300 GSM module connected to a serial port and a power pin.
+ * The bytes are delivered with the timing of the configured baud rate, using the virtual time of the host build.
+ */
+class SIM300Emulator : public Stream {
+public:
+	/**
+	 * Constructor for the emulator. The module starts powered off.
+	 * @param powerPin Pin connected to the power key of the module.
+	 * @param baud     Baud rate of the serial link.
+	 */
+	SIM300Emulator(uint8_t powerPin = 4, uint32_t baud = 9600);
+
+	/** Stream implementation used by the library. */
+	using Print::write;
+	size_t write(uint8_t c);
+	int available();
+	int read();
+	int peek();
+
+	/**
+	 * Used to set the pin code of the SIM card.
+	 * @param pin Pin code or NULL if the SIM card is not protected.
+	 */
+	void setPinCode(const char *pin) {
+		pinCode = pin ? pin : "";
+	};
+
+	/** Used to turn command echo on or off. It is on by default like the real module. */
+	void setEcho(bool enable) {
+		echo = enable;
+	};
+
+	/** Used to set the time in ms from power on until the module is registered to the network. */
+	void setRegistrationDelay(uint32_t ms) {
+		registrationDelay = ms;
+	};
+
+	/** Used to set the time in ms it takes the module to respond to a local command. */
+	void setCommandLatency(uint32_t ms) {
+		commandLatency = ms;
+	};
+
+	/** Used to set the time in ms it takes to send a message through the network. */
+	void setNetworkLatency(uint32_t ms) {
+		networkLatency = ms;
+	};
+
+	/** Used to set the time in ms from dialing until the call is answered. */
+	void setAnswerDelay(uint32_t ms) {
+		answerDelay = ms;
+	};
+
+	/**
+	 * Used to make the calls end with a final result code instead of being answered.
+	 * @param result The result code sent after the answer delay, i.e. "BUSY" or "NO ANSWER". Use "" to answer the calls.
+	 */
+	void setCallOutcome(const char *result) {
+		callOutcome = result;
+	};
+
+	/**
+	 * Used to make the module lose the network for a while. It is reported with +CREG if enabled using AT+CREG=1.
+	 * @param ms       Virtual time in ms the network is lost.
+	 * @param duration Time in ms until the module is registered again.
+	 */
+	void loseNetwork(uint32_t ms, uint32_t duration) {
+		outageStart = (uint64_t)ms * 1000;
+		outageEnd = outageStart + (uint64_t)duration * 1000;
+	};
+
+	/** Used to make the module stop responding until it is turned off, like a module with crashed firmware. */
+	void hang() {
+		hung = true;
+	};
+
+	/**
+	 * Used to answer the next command with an error instead of processing it.
+	 * @param response The final response, i.e. "+CME ERROR: 100".
+	 */
+	void failNextCommand(const char *response) {
+		failResponse = response;
+	};
+
+	/**
+	 * Used to make the network reject the next messages. The content is accepted, but the message is answered with an error.
+	 * @param count    Number of messages to reject.
+	 * @param response The final response, i.e. "+CMS ERROR: 500".
+	 */
+	void rejectMessages(uint8_t count, const char *response) {
+		rejectCount = count;
+		rejectResponse = response;
+	};
+
+	/**
+	 * Used to change the baud rate of the Arduino side of the serial link, like Serial1.begin(baud).
+	 * The module detects the rate from the first AT after it is turned on and keeps it until it is changed using AT+IPR.
+	 * Bytes are garbled in both directions while the two sides use different rates.
+	 */
+	void setBaud(uint32_t baud);
+
+	/**
+	 * Used to make the link unreliable above a baud rate, i.e. for SoftwareSerial. Every 16th byte is garbled above the rate.
+	 * @param baud Highest reliable baud rate or 0 for no limit.
+	 */
+	void setBaudLimit(uint32_t baud) {
+		baudLimit = baud;
+	};
+
+	/**
+	 * Used to get the baud rate of the module.
+	 * @return Returns the rate set by AT+IPR, the rate detected by autobaud or the rate of the Arduino if nothing has been detected yet.
+	 */
+	uint32_t getModuleBaud() {
+		return moduleBaud ? moduleBaud : lockedBaud ? lockedBaud : hostBaud;
+	};
+
+	/**
+	 * Used to send an unsolicited result code at a specific time.
+	 * @param ms  Virtual time in ms.
+	 * @param urc The result code, i.e. "RING". It is framed by "\r\n". RING starts an incoming call from 0123456789 and NO CARRIER ends the call.
+	 */
+	void scheduleURC(uint32_t ms, const char *urc);
+
+	/**
+	 * Used to receive a message at a specific time. It is stored on the SIM card and announced with +CMTI,
+	 * unless AT+CNMI=2,2 has been set. Then it is delivered by +CMT and has to be acknowledged using AT+CNMA within 10 s,
+	 * or it is stored on the SIM card and the direct routing is turned off like the real module does.
+	 * @param ms      Virtual time in ms.
+	 * @param number  Number of the sender.
+	 * @param message Content of the message.
+	 */
+	void receiveSMS(uint32_t ms, const char *number, const char *message);
+
+	/**
+	 * Used to get the time of the next byte or event of the module, so the virtual time can be advanced straight to it.
+	 * @return Returns the virtual time in us or SIM300_NO_EVENT if the module is only waiting for the Arduino.
+	 */
+	uint64_t getNextEvent();
+
+	/** Used to check if the module is powered on. */
+	bool isPowered() {
+		return powered;
+	};
+
+	/** Messages sent by the library. In PDU mode the message is the PDU as hexadecimal characters and the number is empty. */
+	std::vector<SIM300Message> sentMessages;
+
+	/** Messages stored on the SIM card. */
+	std::vector<SIM300Message> storedMessages;
+
+	/** Number of messages delivered by +CMT and acknowledged and the number rejected using AT+CNMA=2, which are delivered again 5 s later. */
+	uint32_t directAcknowledged, directRejected;
+
+	/** Number of commands received and bytes transferred. */
+	uint32_t commandCount, rxBytes, txBytes;
+
+	/** Number of times the module has been turned on or reset. */
+	uint32_t bootCount;
+
+private:
+	struct Event {
+		uint64_t time;
+		std::string urc, number, message;
+		bool sms;
+	};
+
+	static void pinHook(uint8_t pin, uint8_t value, void *arg);
+	void powerKey(uint8_t value);
+	void powerOn();
+	void process();
+	void command(const std::string &cmd);
+	void respond(const std::string &line, uint32_t latency = 0);
+	void send(const std::string &str, uint64_t time);
+	void finalResponse(const std::string &line, uint32_t latency = 0);
+	void listMessage(const SIM300Message &m, bool list);
+	uint8_t registration();
+	void reportCall();
+
+	/**
+	 * Used to check if a byte is garbled on the wire.
+	 * @return Returns true if the two sides use different rates or the rate is above the limit.
+	 */
+	bool garbled();
+
+	/** Baud rate of the Arduino, the rate set by AT+IPR or 0 for autobaud, the rate detected by autobaud and the highest reliable rate. */
+	uint32_t hostBaud, moduleBaud, lockedBaud, baudLimit;
+	uint32_t wireBytes;
+	std::deque<std::pair<uint64_t, char> > rxQueue;
+	uint64_t rxFreeAt, txFreeAt;
+	std::vector<Event> events;
+
+	std::string input;
+	bool messageInput, pduMode;
+	std::string messageNumber;
+	int pduLength;
+
+	bool powered, echo, pinEntered, hung;
+	std::string pinCode, failResponse, rejectResponse;
+	uint8_t rejectCount;
+	uint64_t powerOnTime, powerKeyTime;
+	uint32_t registrationDelay, commandLatency, networkLatency, answerDelay;
+	uint8_t cregMode, reportedRegistration, messageReference, nextIndex;
+	uint8_t cnmiMode; // <mt> of AT+CNMI. 1 announces stored messages using +CMTI and 2 delivers them using +CMT
+	std::deque<std::pair<uint64_t, SIM300Message> > unacknowledged; // Messages delivered by +CMT and the deadline of their acknowledgement
+	uint64_t outageStart, outageEnd;
+
+	uint8_t callState; // 0xFF when there is no call, otherwise the +CLCC status
+	uint8_t clccMode, reportedCall;
+	bool callIncoming;
+	uint64_t callTime;
+	std::string callNumber, callOutcome;
+};
+
+#endif
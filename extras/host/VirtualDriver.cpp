@@ -0,0 +1,49 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#include "VirtualDriver.h"
+
+/** Number of times update() is called in a row while the library has more to do, before the time is advanced anyway. */
+#define VIRTUAL_DRIVER_MAX_UPDATES  16
+
+void VirtualDriver::poll(uint32_t maxWait /*= GSM_NO_DEADLINE*/) {
+    // Requests made since the last call are started before the time is advanced
+    uint8_t count = 0;
+    do
+        update();
+    while (gsm->getNextDeadline() == 0 && ++count < VIRTUAL_DRIVER_MAX_UPDATES);
+
+    uint64_t now = hostMicros();
+    uint64_t wake = maxWait == GSM_NO_DEADLINE ? SIM300_NO_EVENT : now + (uint64_t)maxWait * 1000;
+    uint32_t deadline = gsm->getNextDeadline();
+    if (deadline != GSM_NO_DEADLINE && (now / 1000 + deadline) * 1000 < wake)
+        wake = (now / 1000 + deadline) * 1000; // The timers of the library expire at a whole ms
+    uint64_t event = emulator->getNextEvent();
+    if (event < wake)
+        wake = event;
+    if (wake == SIM300_NO_EVENT)
+        return; // Nothing will ever happen
+    if (wake <= now)
+        wake = now + VIRTUAL_DRIVER_MIN_STEP; // A byte is waiting or the library is still busy
+    while (wake - now > 0xFFFFFFFF) {
+        hostAdvance(0xFFFFFFFF);
+        now += 0xFFFFFFFF;
+    }
+    hostAdvance(wake - now);
+    wakeups++;
+    update();
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+#ifndef _virtualdriver_h_
+#define _virtualdriver_h_
+
+// Event loop used to run the library against the emulated SIM300 module as fast as possible
+// The virtual time is advanced straight to the next timer of the library or the next byte of the module, so idle time costs nothing
+
+#include "GSMSIM300.h"
+#include "SIM300Emulator.h"
+
+/** Time in us the virtual time is advanced when the library has more to do after VIRTUAL_DRIVER_MAX_UPDATES calls, so it can not stall the time. */
+#ifndef VIRTUAL_DRIVER_MIN_STEP
+#define VIRTUAL_DRIVER_MIN_STEP  100
+#endif
+
+/**
+ * Event loop with the same interface as PosixDriver, but instead of sleeping until something happens the virtual time is
+ * advanced to the next deadline of the library or the next event of the emulated module. The library is never updated without
+ * a reason, so simulated hours of an idle modem only take a few thousand calls to update().
+ */
+class VirtualDriver {
+public:
+	/**
+	 * Constructor for the driver.
+	 * @param gsm      Instance of the library.
+	 * @param emulator Emulated module used as the Stream of the library.
+	 */
+	VirtualDriver(GSMSIM300 *gsm, SIM300Emulator *emulator) : wakeups(0), updates(0), gsm(gsm), emulator(emulator) {};
+
+	/**
+	 * Used to update the library, advance the virtual time to the next deadline of the library, the next event of the module
+	 * or until the time runs out, and update it again. Call this in a loop. Requests, i.e. sendSMS(), can be made between the calls.
+	 * @param maxWait Maximum time in ms to advance. Use GSM_NO_DEADLINE to advance until something happens.
+	 */
+	void poll(uint32_t maxWait = GSM_NO_DEADLINE);
+
+	/** Number of times the virtual time was advanced and the number of calls to update(). */
+	uint32_t wakeups, updates;
+
+private:
+	void update() {
+		gsm->update();
+		updates++;
+	};
+
+	GSMSIM300 *gsm;
+	SIM300Emulator *emulator;
+};
+
+#endif
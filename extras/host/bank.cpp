@@ -0,0 +1,154 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+// Benchmark of a bank of modems against several emulated SIM300 modules sharing the virtual time
+
+#include <stdio.h>
+
+#include "GSMBank.h"
+#include "SIM300Emulator.h"
+
+#define STEP_US 100 // Virtual time between calls to update()
+#define MODEMS  3
+
+static GSMBank *bank;
+static uint8_t received[MODEMS];
+
+static void step() {
+    bank->update();
+    hostAdvance(STEP_US);
+}
+
+static void smsReceived(const char *index, const char *status, const char *number, const char *timestamp, const char *message) {
+    (void)index;
+    (void)status;
+    (void)number;
+    (void)timestamp;
+    (void)message;
+    received[bank->getCurrentModem()]++;
+}
+
+static bool boot() {
+    uint32_t start = millis();
+    while (bank->getRunningCount() != MODEMS) {
+        if (millis() - start > 60000) {
+            printf("Boot timed out with %u modems running\n", bank->getRunningCount());
+            return false;
+        }
+        step();
+    }
+    printf("%u modems in GSM_RUNNING after %u ms\n", MODEMS, millis() - start);
+    return true;
+}
+
+// More messages are queued than the bank can hold, so the bank is kept full and every modem is kept busy
+static bool sendMessages(uint8_t count) {
+    bank->resetCounters();
+    uint32_t start = millis();
+    uint8_t queued = 0;
+    while (bank->getSentCount() + bank->getFailedCount() < count) {
+        if (millis() - start > 600000) {
+            printf("Sending timed out after %u messages\n", bank->getSentCount());
+            return false;
+        }
+        if (queued < count && bank->sendSMS("0123456789", "Benchmark message from a bank of modems"))
+            queued++;
+        step();
+    }
+    printf("Sent %u messages in %u ms: %.2f SMS/s (", bank->getSentCount(), millis() - start, bank->getThroughput());
+    for (uint8_t i = 0; i < MODEMS; i++)
+        printf(i ? ", %u" : "%u", bank->getSentCount(i));
+    printf(" per modem)\n");
+    return bank->getFailedCount() == 0;
+}
+
+// One module stops responding while messages are being sent, so the other modems take over the queued messages
+static bool deadModem(SIM300Emulator &emulator, uint8_t dead, uint8_t count) {
+    bank->resetCounters();
+    emulator.hang();
+    uint32_t start = millis();
+    uint8_t handles[GSM_BANK_QUEUE_SIZE], queued = 0;
+    bool recovered = false;
+    memset(handles, 0, sizeof(handles));
+    while (queued < count || bank->getSentCount() + bank->getFailedCount() < count) {
+        if (millis() - start > 600000) {
+            printf("Sending with a dead modem timed out after %u messages\n", bank->getSentCount());
+            return false;
+        }
+        if (queued < count) {
+            uint8_t handle = bank->sendSMS("0123456789", "Benchmark message with a dead modem");
+            if (handle) {
+                handles[queued % GSM_BANK_QUEUE_SIZE] = handle;
+                queued++;
+            }
+        }
+        if (!recovered && bank->getRunningCount() == MODEMS - 1) {
+            printf("Modem %u stopped after %u ms with %u messages sent by the others\n", dead, millis() - start, bank->getSentCount());
+            recovered = true;
+        }
+        step();
+    }
+    uint8_t last = handles[(count - 1) % GSM_BANK_QUEUE_SIZE];
+    printf("Sent %u messages in %u ms with a dead modem: %.2f SMS/s, %u sent by the dead modem, last message by modem %u\n", bank->getSentCount(), millis() - start, bank->getThroughput(), bank->getSentCount(dead), bank->getSMSModem(last));
+    return recovered && bank->getFailedCount() == 0;
+}
+
+// Every module receives messages at the same time, so the modems take turns draining them
+static bool readMessages(SIM300Emulator **emulators, uint8_t count) {
+    bank->resetCounters();
+    memset(received, 0, sizeof(received));
+    for (uint8_t i = 0; i < MODEMS; i++) {
+        for (uint8_t j = 0; j < count; j++)
+            emulators[i]->receiveSMS(millis() + 10 + j * 10, "0123456789", "Incoming benchmark message");
+    }
+    uint32_t start = millis();
+    while (bank->getReceivedCount() < (uint32_t)count * MODEMS) {
+        if (millis() - start > 600000) {
+            printf("Reading timed out after %u messages\n", bank->getReceivedCount());
+            return false;
+        }
+        step();
+    }
+    printf("Read %u messages in %u ms (", bank->getReceivedCount(), millis() - start);
+    for (uint8_t i = 0; i < MODEMS; i++)
+        printf(i ? ", %u" : "%u", received[i]);
+    printf(" per modem)\n");
+    for (uint8_t i = 0; i < MODEMS; i++) {
+        if (received[i] != bank->getReceivedCount(i) || !emulators[i]->storedMessages.empty())
+            return false;
+    }
+    return true;
+}
+
+int main() {
+    SIM300Emulator emulator0(4, 9600), emulator1(5, 9600), emulator2(6, 9600);
+    SIM300Emulator *emulators[MODEMS] = { &emulator0, &emulator1, &emulator2 };
+    GSMSIM300 GSM0(&emulator0, NULL, 4), GSM1(&emulator1, NULL, 5), GSM2(&emulator2, NULL, 6);
+    GSMSIM300 *modems[MODEMS] = { &GSM0, &GSM1, &GSM2 };
+    GSMBank modemBank(modems, MODEMS);
+    bank = &modemBank;
+    bank->setSMSCallback(smsReceived);
+
+    bool success = boot() && sendMessages(30) && readMessages(emulators, 10) && deadModem(emulator1, 1, 30);
+
+#ifdef GSM_STATS
+    Serial.enable(true);
+    bank->printStats();
+#endif
+    return success ? 0 : 1;
+}
@@ -0,0 +1,634 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+// End-to-end benchmark of the library against the emulated SIM300 module
+// The modem timing uses virtual time, while the cost of update() is measured in real time
+
+#include <stdio.h>
+#include <time.h>
+
+#include "GSMSIM300.h"
+#include "SIM300Emulator.h"
+
+#define STEP_US 100 // Virtual time between calls to update()
+
+static uint64_t updateCalls, updateTime, updateWorst;
+static uint8_t received;
+static char streamed[1024];
+static size_t streamedLength;
+static uint16_t streamedParts;
+static bool streamEnded;
+static char callEvents[16]; // Every call event as a character, i.e. "RCE"
+static uint8_t callEventCount;
+
+static uint64_t nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef LATENCYDEBUG
+// The timers use the virtual time, while micros() is the CPU time of the thread, so the budget of update() and the latency per state are measured on the host
+// The CPU time leaves out the time the thread is preempted. micros() is only used by update() to measure itself, so the simulation is not affected.
+class LatencyClock : public GSMClock {
+public:
+    uint32_t millis() {
+        return ::millis();
+    };
+    uint32_t micros() {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    };
+};
+
+static LatencyClock latencyClock;
+#endif
+
+static void step(GSMSIM300 &GSM) {
+    uint64_t start = nanos();
+    GSM.update();
+    uint64_t time = nanos() - start;
+    updateCalls++;
+    updateTime += time;
+    if (time > updateWorst)
+        updateWorst = time;
+    hostAdvance(STEP_US);
+}
+
+static void smsReceived(const char *index, const char *status, const char *number, const char *timestamp, const char *message) {
+    (void)index;
+    (void)status;
+    (void)number;
+    (void)timestamp;
+    (void)message;
+    received++;
+}
+
+static void bodyReceived(uint8_t event, const char *data, uint8_t length) {
+    if (event == SMS_BODY_DATA && streamedLength + length < sizeof(streamed)) {
+        memcpy(streamed + streamedLength, data, length);
+        streamedLength += length;
+        streamedParts++;
+    } else if (event == SMS_BODY_END)
+        streamEnded = true;
+}
+
+// The messages are delivered by +CMT and acknowledged, so they are never stored on the SIM card
+// One message arrives while a long message is sent in PDU mode, so it is rejected and delivered again once text mode is set
+static bool directMessages(SIM300Emulator &emulator, GSMSIM300 &GSM, uint8_t count) {
+    static char text[301];
+    for (uint16_t i = 0; i < sizeof(text) - 1; i++)
+        text[i] = 'a' + i % 26;
+    GSM.setDirectSMS(true);
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount, acknowledged = emulator.directAcknowledged;
+    received = 0;
+    for (uint8_t i = 0; i < count; i++)
+        emulator.receiveSMS(start + 500 + i * 500, "0123456789", "Incoming benchmark message"); // The routing is set first
+    while (received < count) {
+        if (millis() - start > 600000) {
+            printf("Direct delivery timed out after %u messages\n", received);
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t time = millis() - start;
+    printf("Received %u messages directly in %u ms, %.1f commands per message, %u stored on the SIM card\n", count, time, (double)(emulator.commandCount - commands) / count, (unsigned)emulator.storedMessages.size());
+
+    start = millis();
+    received = 0;
+    uint8_t handle = GSM.sendLongSMS("+4512345678", text);
+    while (GSM.getSMSStatus(handle) != SMS_STATUS_SENDING)
+        step(GSM);
+    emulator.receiveSMS(millis() + 100, "0123456789", "Message received in PDU mode");
+    while (received < 1 || GSM.getSMSStatus(handle) != SMS_STATUS_SENT) {
+        if (millis() - start > 60000) {
+            printf("The message received in PDU mode was not delivered again\n");
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Message received in PDU mode rejected %u times and delivered after %u ms\n", emulator.directRejected, millis() - start);
+    GSM.setDirectSMS(false);
+    commands = emulator.commandCount;
+    while (emulator.commandCount == commands)
+        step(GSM);
+    for (uint16_t i = 0; i < 1000; i++) // Wait for the response
+        step(GSM);
+    return emulator.directAcknowledged - acknowledged == count + 1U && emulator.storedMessages.empty() && GSM.indexIn[0] == '\0';
+}
+
+static void callProgress(uint8_t event, const char *number) {
+    (void)number;
+    if (callEventCount < sizeof(callEvents) - 1) {
+        callEvents[callEventCount++] = "RCBNFE"[event];
+        callEvents[callEventCount] = '\0';
+    }
+}
+
+static bool boot(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t start = millis();
+    while (GSM.getState() != GSM_RUNNING) {
+        if (millis() - start > 60000) {
+            printf("Boot timed out in state %u\n", GSM.getState());
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Boot to GSM_RUNNING: %u ms, %u commands\n", millis() - start, emulator.commandCount);
+    while (GSM.getSignalQuality() == GSM_SIGNAL_UNKNOWN && millis() - start < 60000)
+        step(GSM);
+    printf("Registration: %u, signal quality: %u\n", GSM.getRegistration(), GSM.getSignalQuality());
+    return true;
+}
+
+static bool sendMessages(SIM300Emulator &emulator, GSMSIM300 &GSM, uint8_t count) {
+    uint32_t start = millis();
+    uint8_t queued = 0;
+    uint32_t commands = emulator.commandCount;
+    size_t sent = emulator.sentMessages.size();
+    while (emulator.sentMessages.size() - sent < count || GSM.getSMSQueueCount() > 0) {
+        if (millis() - start > 600000) {
+            printf("Sending timed out after %u messages\n", (unsigned)(emulator.sentMessages.size() - sent));
+            return false;
+        }
+        if (queued < count && GSM.sendSMS("0123456789", "Benchmark message from the GSMSIM300 library"))
+            queued++;
+        step(GSM);
+    }
+    uint32_t time = millis() - start;
+    printf("Sent %u messages in %u ms: %.2f SMS/s, %.1f commands per message\n", count, time, count * 1000.0 / time, (double)(emulator.commandCount - commands) / count);
+    return true;
+}
+
+// A GSM 7-bit and a UCS2 message are sent as concatenated segments with a text mode message in between, so the mode is switched twice
+static bool sendLongMessages(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    static char gsm7[401], ucs2[241];
+    for (uint16_t i = 0; i < sizeof(gsm7) - 1; i++)
+        gsm7[i] = 'a' + i % 26;
+    for (uint16_t i = 0; i < sizeof(ucs2) - 1; i += 3) // U+4E2D is encoded as 3 bytes
+        memcpy(ucs2 + i, "\xE4\xB8\xAD", 3);
+    uint8_t segments = GSMPDU::countSegments(gsm7, false) + 1 + GSMPDU::countSegments(ucs2, true);
+
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    size_t sent = emulator.sentMessages.size();
+    uint8_t handles[3] = { 0, 0, 0 };
+    while (handles[2] == 0 || GSM.getSMSQueueCount() > 0) {
+        if (millis() - start > 600000) {
+            printf("Sending long messages timed out after %u segments\n", (unsigned)(emulator.sentMessages.size() - sent));
+            return false;
+        }
+        if (handles[0] == 0)
+            handles[0] = GSM.sendLongSMS("+4512345678", gsm7);
+        else if (handles[1] == 0)
+            handles[1] = GSM.sendSMS("0123456789", "Benchmark message from the GSMSIM300 library");
+        else if (handles[2] == 0)
+            handles[2] = GSM.sendLongSMS("+4512345678", ucs2);
+        step(GSM);
+    }
+    uint32_t time = millis() - start;
+    printf("Sent %u segments in %u ms: %.2f SMS/s, %.1f commands per segment\n", segments, time, segments * 1000.0 / time, (double)(emulator.commandCount - commands) / segments);
+    if (GSM.getSMSStatus(handles[2]) != SMS_STATUS_SENT || emulator.sentMessages.size() - sent != segments) {
+        printf("Long messages were not sent\n");
+        return false;
+    }
+    return true;
+}
+
+// The library only remembers the last +CMTI index, so the messages are received 500 ms apart
+static bool readMessages(SIM300Emulator &emulator, GSMSIM300 &GSM, uint8_t count) {
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    received = 0;
+    for (uint8_t i = 0; i < count; i++)
+        emulator.receiveSMS(start + 10 + i * 500, "0123456789", "Incoming benchmark message");
+    while (received < count) {
+        if (millis() - start > 600000) {
+            printf("Reading timed out after %u messages\n", received);
+            return false;
+        }
+        if (GSM.newSMS() && !GSM.inboxBusy())
+            GSM.readSMSAsync();
+        step(GSM);
+    }
+    uint32_t time = millis() - start;
+    printf("Read %u messages in %u ms, %.1f commands per message\n", count, time, (double)(emulator.commandCount - commands) / count);
+    return true;
+}
+
+// The SIM card is filled before the module is told to drain it, so every stored message is read and deleted by one list and one delete
+static bool drainMessages(SIM300Emulator &emulator, GSMSIM300 &GSM, uint8_t count) {
+    for (uint8_t i = 0; i < count; i++)
+        emulator.receiveSMS(millis() + 10 + i * 10, "0123456789", "Stored benchmark message");
+    uint32_t wait = millis();
+    while (millis() - wait < 1000 || !GSM.newSMS())
+        step(GSM);
+
+    size_t stored = emulator.storedMessages.size(); // Including the messages left by readMessages()
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    received = 0;
+    GSM.drainSMS();
+    while (GSM.inboxBusy()) {
+        if (millis() - start > 600000) {
+            printf("Draining timed out after %u messages\n", received);
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t time = millis() - start;
+    printf("Drained %u messages in %u ms, %u commands\n", received, time, emulator.commandCount - commands);
+    if (received != stored || !emulator.storedMessages.empty()) {
+        printf("%u messages were left on the SIM card\n", (unsigned)emulator.storedMessages.size());
+        return false;
+    }
+    return true;
+}
+
+// A message longer than the line buffer and spanning several lines is streamed, and then read into messageIn where it is truncated
+static bool streamMessage(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    char text[600];
+    size_t length = 0;
+    for (uint8_t line = 0; length < sizeof(text) - 100; line++) {
+        length += snprintf(text + length, sizeof(text) - length, "Line %u of a long message streamed to the sink without a copy of the whole message.\n", line);
+        if (line == 2)
+            text[length++] = '\n'; // Empty line
+    }
+    text[--length] = '\0'; // The content ends without a line break
+    emulator.receiveSMS(millis() + 10, "0123456789", text);
+    uint32_t start = millis();
+    while (!GSM.newSMS())
+        step(GSM);
+
+    streamedLength = streamedParts = 0;
+    streamEnded = false;
+    GSM.setSMSStream(NULL, bodyReceived);
+    GSM.readSMSAsync();
+    while (GSM.inboxBusy()) {
+        if (millis() - start > 60000) {
+            printf("Streaming timed out\n");
+            return false;
+        }
+        step(GSM);
+    }
+    GSM.setSMSStream(NULL, NULL);
+    printf("Streamed a message of %u bytes in %u parts in %u ms\n", (unsigned)streamedLength, streamedParts, millis() - start);
+    if (!streamEnded || streamedLength != length || memcmp(streamed, text, length) != 0) {
+        printf("The streamed message does not match\n");
+        return false;
+    }
+
+    received = 0;
+    GSM.readSMSAsync();
+    while (GSM.inboxBusy())
+        step(GSM);
+    if (received != 1 || strncmp(GSM.messageIn, text, sizeof(GSM.messageIn) - 1) != 0 || strlen(GSM.messageIn) != sizeof(GSM.messageIn) - 1) {
+        printf("The buffered message does not match\n");
+        return false;
+    }
+    GSM.deleteSMS();
+    return true;
+}
+
+// The network is lost while a message is being sent and while another is queued, so both are held until the +CREG URC says the module is registered again
+static bool networkOutage(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t boots = emulator.bootCount, commands = emulator.commandCount;
+    uint32_t start = millis(), outage = 10000;
+    uint8_t first = GSM.sendSMS("0123456789", "Benchmark message sent as the network is lost");
+    emulator.loseNetwork(start, outage);
+    while (GSM.isRegistered() && millis() - start < 1000)
+        step(GSM);
+    uint8_t second = GSM.sendSMS("0123456789", "Benchmark message queued without a network");
+    while (GSM.getSMSStatus(first) != SMS_STATUS_SENT || GSM.getSMSStatus(second) != SMS_STATUS_SENT) {
+        if (GSM.getSMSStatus(first) == SMS_STATUS_FAILED || GSM.getSMSStatus(second) == SMS_STATUS_FAILED || millis() - start > 60000) {
+            printf("Messages were not sent after the network was lost\n");
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Held through a %u ms network outage and sent %u ms after the network returned, %u commands, %u restarts\n", outage, millis() - start - outage, emulator.commandCount - commands, emulator.bootCount - boots);
+    return emulator.bootCount == boots;
+}
+
+// A message is sent through a slow network, which must not be mistaken for a dead module
+static bool slowNetwork(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    emulator.setNetworkLatency(15000);
+    uint32_t start = millis();
+    uint8_t handle = GSM.sendSMS("0123456789", "Benchmark message through a slow network");
+    while (GSM.getSMSStatus(handle) != SMS_STATUS_SENT) {
+        if (GSM.getSMSStatus(handle) == SMS_STATUS_FAILED || millis() - start > 120000) {
+            printf("Message through a slow network failed after %u ms\n", millis() - start);
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Sent through a slow network in %u ms, network timeout: %u ms\n", millis() - start, GSM.getTimeout(GSM_WAIT_NETWORK));
+    emulator.setNetworkLatency(1500);
+    return true;
+}
+
+// A command fails with an error that only needs the command to be sent again, so the module is not reset
+static bool transientError(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t start = millis();
+    uint32_t boots = emulator.bootCount;
+    emulator.failNextCommand("+CME ERROR: 100");
+    uint8_t handle = GSM.sendSMS("0123456789", "Benchmark message after an error");
+    while (GSM.getSMSStatus(handle) != SMS_STATUS_SENT) {
+        if (GSM.getSMSStatus(handle) == SMS_STATUS_FAILED || millis() - start > 60000) {
+            printf("Message after an error failed in recovery tier %u\n", GSM.getRecoveryTier());
+            return false;
+        }
+        step(GSM);
+    }
+    if (emulator.bootCount != boots) {
+        printf("Module was restarted by a transient error\n");
+        return false;
+    }
+    printf("Sent after a transient error in %u ms without restarting the module\n", millis() - start);
+    return true;
+}
+
+// +CMS ERROR: 30 is an unknown subscriber, unlike +CME ERROR: 30, so the message fails straight away and the module stays registered
+static bool unknownSubscriber(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    emulator.rejectMessages(1, "+CMS ERROR: 30");
+    uint8_t handle = GSM.sendSMS("0123456789", "Benchmark message to an unknown subscriber");
+    while (GSM.getSMSStatus(handle) != SMS_STATUS_FAILED) {
+        if (GSM.getSMSStatus(handle) == SMS_STATUS_SENT || millis() - start > 60000) {
+            printf("Message to an unknown subscriber was not failed\n");
+            return false;
+        }
+        step(GSM);
+    }
+    if (!GSM.isRegistered() || GSM.getRecoveryTier() != GSM_RECOVERY_NONE) {
+        printf("Module was taken for unregistered by an unknown subscriber\n");
+        return false;
+    }
+    printf("Message to an unknown subscriber failed after %u ms, %u commands\n", millis() - start, emulator.commandCount - commands);
+    return true;
+}
+
+// The module stops responding while a message is sent, so the recovery escalates until it is turned off and on again
+static bool deadModule(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    emulator.hang();
+    uint32_t start = millis();
+    uint8_t handle = GSM.sendSMS("0123456789", "Benchmark message to a dead module");
+    while (GSM.getState() == GSM_RUNNING) {
+        if (millis() - start > 60000) {
+            printf("Dead module was not detected\n");
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t detected = millis() - start;
+    while (GSM.getState() != GSM_RUNNING) {
+        if (millis() - start > 180000) {
+            printf("Module did not recover in state %u\n", GSM.getState());
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t running = millis() - start;
+    while (GSM.getSMSStatus(handle) != SMS_STATUS_SENT) { // The queued message survives the recovery
+        if (GSM.getSMSStatus(handle) == SMS_STATUS_FAILED || millis() - start > 240000) {
+            printf("Message to a dead module was lost\n");
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Dead module detected after %u ms (command timeout: %u ms), running again after %u ms and message sent after %u ms\n", detected, GSM.getTimeout(GSM_WAIT_COMMAND), running, millis() - start);
+    return true;
+}
+
+// The module stops responding while nothing is sent, so it is detected by the sample of the signal quality
+static bool deadIdleModule(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t boots = emulator.bootCount;
+    emulator.hang();
+    uint32_t start = millis();
+    while (GSM.getState() == GSM_RUNNING) {
+        if (millis() - start > 2 * GSM_SIGNAL_INTERVAL + 60000) {
+            printf("Idle dead module was not detected\n");
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t detected = millis() - start;
+    while (GSM.getState() != GSM_RUNNING) {
+        if (millis() - start > 180000) {
+            printf("Idle module did not recover in state %u\n", GSM.getState());
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Idle dead module detected after %u ms (signal interval: %u ms) and running again after %u ms\n", detected, GSM_SIGNAL_INTERVAL, millis() - start);
+    return emulator.bootCount == boots + 1;
+}
+
+// The module is turned off using AT+CPOWD=1, so the whole power off sequence runs before it is turned on again
+static bool powerOff(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t boots = emulator.bootCount;
+    GSM.setState(GSM_POWER_OFF);
+    uint32_t start = millis(), released = 0;
+    while (GSM.getState() != GSM_RUNNING) {
+        if (millis() - start > 180000) {
+            printf("Power off timed out in state %u\n", GSM.getState());
+            return false;
+        }
+        step(GSM);
+        if (GSM.getState() == GSM_POWER_OFF_RELEASE && !released)
+            released = millis() - start;
+    }
+    if (!released) {
+        printf("Power off did not reach GSM_POWER_OFF_RELEASE\n");
+        return false;
+    }
+    printf("Power off released after %u ms and running again after %u ms\n", released, millis() - start);
+    return emulator.bootCount > boots;
+}
+
+static bool placeCall(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    callEventCount = 0;
+    if (GSM.call("0123456789012345678901234567890123456789") || GSM.getCallState() != CALL_IDLE) {
+        printf("A number that does not fit was called\n");
+        return false;
+    }
+    GSM.call("0123456789");
+    while (GSM.getCallState() != CALL_ACTIVE) {
+        if (millis() - start > 60000) {
+            printf("Call timed out in state %u\n", GSM.getCallState());
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Call active after %u ms, %u commands\n", millis() - start, emulator.commandCount - commands);
+    emulator.scheduleURC(millis() + 1000, "NO CARRIER");
+    while (GSM.getCallState() != CALL_IDLE)
+        step(GSM);
+    return strcmp(callEvents, "RCE") == 0;
+}
+
+// The outcome of a call is reported from the result codes, so a call that is never answered does not wait forever
+static bool callOutcome(SIM300Emulator &emulator, GSMSIM300 &GSM, const char *outcome, const char *expected) {
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    callEventCount = 0;
+    emulator.setCallOutcome(outcome);
+    GSM.call("0123456789");
+    while (GSM.getCallState() != CALL_IDLE || callEventCount < 2) {
+        if (millis() - start > 60000) {
+            printf("%s was not detected in call state %u, events %s\n", outcome, GSM.getCallState(), callEvents);
+            return false;
+        }
+        step(GSM);
+    }
+    emulator.setCallOutcome("");
+    printf("%s detected after %u ms, %u commands, events %s\n", outcome, millis() - start, emulator.commandCount - commands, callEvents);
+    return strcmp(callEvents, expected) == 0;
+}
+
+// An incoming call is answered and the caller hangs up
+static bool incomingCall(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    uint32_t start = millis();
+    callEventCount = 0;
+    emulator.scheduleURC(millis(), "RING");
+    while (GSM.getCallState() != CALL_ACTIVE) {
+        if (millis() - start > 10000) {
+            printf("Incoming call was not answered in state %u\n", GSM.getCallState());
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Incoming call from %s answered after %u ms\n", GSM.numberOut, millis() - start);
+    emulator.scheduleURC(millis() + 1000, "NO CARRIER");
+    while (GSM.getCallState() != CALL_IDLE)
+        step(GSM);
+    return strcmp(callEvents, "RCE") == 0;
+}
+
+// A call, a message and a delete are started at the same time, so their commands are interleaved by the transaction engine
+static bool concurrentWork(SIM300Emulator &emulator, GSMSIM300 &GSM) {
+    emulator.receiveSMS(millis() + 10, "0123456789", "Message to delete");
+    while (emulator.storedMessages.empty())
+        step(GSM);
+    char index[5];
+    snprintf(index, sizeof(index), "%u", emulator.storedMessages.back().index);
+
+    uint32_t start = millis();
+    uint32_t commands = emulator.commandCount;
+    GSM.call("0123456789");
+    uint8_t handle = GSM.sendSMS("0123456789", "Benchmark message during a call");
+    GSM.deleteSMS(index);
+    while (GSM.getCallState() != CALL_ACTIVE || GSM.getSMSStatus(handle) != SMS_STATUS_SENT || !emulator.storedMessages.empty()) {
+        if (GSM.getSMSStatus(handle) == SMS_STATUS_FAILED || millis() - start > 60000) {
+            printf("Concurrent work timed out in call state %u and message status %u\n", GSM.getCallState(), GSM.getSMSStatus(handle));
+            return false;
+        }
+        step(GSM);
+    }
+    printf("Call, message and delete done concurrently in %u ms, %u commands\n", millis() - start, emulator.commandCount - commands);
+    commands = emulator.commandCount;
+    GSM.hangup();
+    while (emulator.commandCount == commands)
+        step(GSM);
+    return true;
+}
+
+static SIM300Emulator *linkEmulator;
+
+// Changes the rate of the Arduino side of the emulated link, like Serial1.begin(baud)
+static void changeBaud(uint32_t baud) {
+    linkEmulator->setBaud(baud);
+}
+
+// A separate module is booted at 9600 baud and switched to the target rate, and its stored messages are drained to compare the wire time
+// The link is unreliable above the limit, so the library has to fall back to 9600 baud
+static bool linkRate(uint8_t pin, uint32_t target, uint32_t limit) {
+    SIM300Emulator emulator(pin, 9600);
+    emulator.setBaudLimit(limit);
+    linkEmulator = &emulator;
+    GSMSIM300 GSM(&emulator, NULL, pin);
+    GSM.setBaudRate(9600, target, changeBaud);
+    GSM.setSMSCallback(smsReceived);
+
+    uint32_t start = millis();
+    while (GSM.getState() != GSM_RUNNING) {
+        if (millis() - start > 120000) {
+            printf("Boot at %u baud timed out in state %u\n", target, GSM.getState());
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t bootTime = millis() - start;
+    if (GSM.getBaudRate() != emulator.getModuleBaud() || GSM.getBaudRate() != (limit && target > limit ? 9600 : target)) {
+        printf("Link at %u baud, while the module uses %u baud\n", GSM.getBaudRate(), emulator.getModuleBaud());
+        return false;
+    }
+
+    for (uint8_t i = 0; i < 30; i++)
+        emulator.receiveSMS(millis() + 10 + i * 10, "0123456789", "Stored benchmark message");
+    uint32_t wait = millis();
+    while (millis() - wait < 2000 || !GSM.newSMS()) // Every +CMTI is received before the messages are drained
+        step(GSM);
+    uint32_t bytes = emulator.rxBytes + emulator.txBytes;
+    received = 0;
+    start = millis();
+    GSM.drainSMS();
+    while (GSM.inboxBusy()) {
+        if (millis() - start > 600000) {
+            printf("Draining at %u baud timed out\n", GSM.getBaudRate());
+            return false;
+        }
+        step(GSM);
+    }
+    uint32_t time = millis() - start;
+    bytes = emulator.rxBytes + emulator.txBytes - bytes;
+    printf("Link at %u baud after %u ms and %u boots: drained %u messages in %u ms, %.0f bytes/s\n", GSM.getBaudRate(), bootTime, emulator.bootCount, received, time, bytes * 1000.0 / time);
+    return received == 30;
+}
+
+int main() {
+    SIM300Emulator emulator(4, 9600);
+    emulator.setPinCode("1234");
+#ifdef LATENCYDEBUG
+    GSMSIM300 GSM(&emulator, "1234", 4, false, &latencyClock);
+#else
+    GSMSIM300 GSM(&emulator, "1234", 4);
+#endif
+    GSM.setSMSCallback(smsReceived);
+    GSM.setCallCallback(callProgress);
+
+    bool success = boot(emulator, GSM) && sendMessages(emulator, GSM, 20) && sendLongMessages(emulator, GSM) && readMessages(emulator, GSM, 10) && drainMessages(emulator, GSM, 30) && streamMessage(emulator, GSM) && directMessages(emulator, GSM, 10) && placeCall(emulator, GSM) && callOutcome(emulator, GSM, "BUSY", "RB") && callOutcome(emulator, GSM, "NO ANSWER", "RN") && incomingCall(emulator, GSM) && concurrentWork(emulator, GSM) && slowNetwork(emulator, GSM) && transientError(emulator, GSM) && unknownSubscriber(emulator, GSM) && networkOutage(emulator, GSM) && deadModule(emulator, GSM) && deadIdleModule(emulator, GSM) && powerOff(emulator, GSM);
+    success = success && linkRate(5, 9600, 0) && linkRate(6, 115200, 0) && linkRate(7, 115200, 57600);
+
+    printf("update(): %llu calls, %.0f ns average, %llu ns worst case\n", (unsigned long long)updateCalls, (double)updateTime / updateCalls, (unsigned long long)updateWorst);
+    printf("Serial: %u bytes sent, %u bytes received, %u receive buffer overruns\n", emulator.txBytes, emulator.rxBytes, GSM.getRxOverruns());
+#ifdef GSM_STATS
+    Serial.enable(true);
+    GSM.printStats();
+#endif
+#ifdef LATENCYDEBUG
+    Serial.enable(true);
+    GSM.printLatency();
+#endif
+    return success ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+
+// Prints the RAM used by an instance of the library for the configuration it is compiled with, see "make footprint"
+// The size of the code of the library, measured by the Makefile, is passed as the second argument
+
+#include <stdio.h>
+
+#include "GSMSIM300.h"
+
+int main(int argc, char *argv[]) {
+    printf("%-80s %5u bytes of RAM, %6s bytes of code\n", argc > 1 ? argv[1] : "", (unsigned)sizeof(GSMSIM300), argc > 2 ? argv[2] : "?");
+    return 0;
+}
@@ -0,0 +1,173 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+// Benchmark of the outbox log against the emulated SIM300 module
+// Messages are rejected by the network and the MCU is reset while messages are being sent, so every message must still be sent
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "GSMOutbox.h"
+#include "PosixFileStorage.h"
+#include "SIM300Emulator.h"
+
+#define STEP_US   100 // Virtual time between calls to update()
+#define LOG_PATH  "outbox.log"
+#define MESSAGES  6
+
+static SIM300Emulator *emulator;
+static PosixFileStorage storage;
+static GSMSIM300 *GSM;
+static GSMOutbox *outbox;
+
+// Like a reset of the MCU, everything in RAM is lost, while the module and the log are kept
+static bool reset() {
+    delete outbox;
+    delete GSM;
+    if (!storage.begin(LOG_PATH, GSM_OUTBOX_SLOTS * GSM_OUTBOX_SLOT_SIZE)) {
+        perror(LOG_PATH);
+        return false;
+    }
+    GSM = new GSMSIM300(emulator, NULL, 4);
+    outbox = new GSMOutbox(GSM, &storage);
+    return outbox->begin();
+}
+
+static bool run(uint32_t ms, bool (*done)()) {
+    uint32_t start = millis();
+    while (!done()) {
+        if (millis() - start > ms)
+            return false;
+        outbox->update();
+        hostAdvance(STEP_US);
+    }
+    return true;
+}
+
+static bool running() {
+    return GSM->getState() == GSM_RUNNING && GSM->isRegistered();
+}
+
+static bool empty() {
+    return outbox->getQueueCount() == 0;
+}
+
+static uint8_t queued;
+
+// The messages staged in RAM are lost by a reset, so it is done once they have been written to the log
+static bool twoAcknowledged() {
+    return outbox->acknowledgements >= 2 && outbox->records >= queued - 1;
+}
+
+// The network rejects the first two attempts, so the first message is sent after two backoffs
+static bool rejected() {
+    uint32_t start = millis();
+    emulator->rejectMessages(2, "+CMS ERROR: 500");
+    uint16_t sequence = outbox->sendSMS("0123456789", "Alert 1");
+    if (sequence == 0 || !run(120000, empty))
+        return false;
+    printf("Message %u sent after %u ms with %u retries, reference %d\n", sequence, millis() - start, outbox->retries, outbox->getSMSReference(sequence));
+    return outbox->getSMSStatus(sequence) == SMS_STATUS_SENT;
+}
+
+// The MCU is reset after two of the messages have been acknowledged in the log, and the rest are sent after the reset
+static bool resetWhileSending() {
+    uint32_t start = millis();
+    uint16_t records = 0, acknowledgements = 0, commits = 0;
+    char message[GSM_MESSAGE_SIZE];
+    queued = 1;
+    outbox->records = outbox->acknowledgements = outbox->commits = 0;
+    storage.writeCalls = storage.syncCalls = 0;
+    while (queued < MESSAGES && outbox->acknowledgements < 2) {
+        snprintf(message, sizeof(message), "Alert %u", queued + 1);
+        if (outbox->sendSMS("0123456789", message))
+            queued++;
+        outbox->update();
+        hostAdvance(STEP_US);
+    }
+    if (!run(120000, twoAcknowledged))
+        return false;
+    records += outbox->records;
+    acknowledgements += outbox->acknowledgements;
+    commits += outbox->commits;
+    if (!reset())
+        return false;
+    printf("Reset after %u ms with %u messages queued, %u read back from the log\n", millis() - start, queued, outbox->replayed);
+    if (!run(60000, running)) {
+        printf("Boot after the reset timed out\n");
+        return false;
+    }
+    while (queued < MESSAGES) {
+        snprintf(message, sizeof(message), "Alert %u", queued + 1);
+        if (outbox->sendSMS("0123456789", message))
+            queued++;
+        outbox->update();
+        hostAdvance(STEP_US);
+    }
+    if (!run(120000, empty) || !outbox->flush())
+        return false;
+    // Every message sent after the reset is acknowledged in the log, even if its slot was reused before the batch was written
+    if (outbox->acknowledgements != outbox->sent) {
+        printf("%u messages sent after the reset, but %u acknowledgements written\n", outbox->sent, outbox->acknowledgements);
+        return false;
+    }
+    records += outbox->records;
+    acknowledgements += outbox->acknowledgements;
+    commits += outbox->commits;
+    printf("Log: %u records and %u acknowledgements written in %u commits, %u writes and %u fdatasync() calls\n", records, acknowledgements, commits, storage.writeCalls, storage.syncCalls);
+
+    // Only the message being sent when the MCU was reset may be sent twice
+    uint8_t duplicates = 0;
+    for (uint8_t i = 1; i <= MESSAGES; i++) {
+        snprintf(message, sizeof(message), "Alert %u", i);
+        uint8_t count = 0;
+        for (size_t j = 0; j < emulator->sentMessages.size(); j++) {
+            if (emulator->sentMessages[j].message == message)
+                count++;
+        }
+        if (count == 0) {
+            printf("%s was lost\n", message);
+            return false;
+        }
+        duplicates += count - 1;
+    }
+    printf("Sent %u messages in %u ms with %u duplicates\n", MESSAGES, millis() - start, duplicates);
+    return duplicates <= 1;
+}
+
+int main() {
+    unlink(LOG_PATH);
+    SIM300Emulator module(4, 9600);
+    emulator = &module;
+    bool success = reset();
+    uint32_t start = millis();
+    if (success && !run(60000, running)) {
+        printf("Boot timed out\n");
+        success = false;
+    }
+    if (success)
+        printf("Boot to GSM_RUNNING: %u ms\n", millis() - start);
+
+    success = success && rejected() && resetWhileSending();
+
+    delete outbox;
+    delete GSM;
+    storage.end();
+    unlink(LOG_PATH);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+// The library is run in real time through PosixSerial and PosixDriver against the emulated SIM300 module behind a pseudo-terminal
+// The emulator runs in a child process connected to the master side, while the power pin and the test events are sent through a pipe
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "PosixSerial.h"
+#include "SIM300Emulator.h"
+
+#define BAUD      115200
+#define POWER_PIN 4
+
+static int control = -1; // Write end of the pipe to the emulator
+static uint8_t received;
+
+// Events sent to the emulator
+#define EVENT_PIN_LOW  'L'
+#define EVENT_PIN_HIGH 'H'
+#define EVENT_RING     'R'
+#define EVENT_SMS      'S'
+
+static void sendEvent(char event) {
+    if (write(control, &event, 1) != 1)
+        perror("write");
+}
+
+static void forwardPin(uint8_t pin, uint8_t value, void *arg) {
+    (void)pin;
+    (void)arg;
+    sendEvent(value == LOW ? EVENT_PIN_LOW : EVENT_PIN_HIGH);
+}
+
+static void smsReceived(const char *index, const char *status, const char *number, const char *timestamp, const char *message) {
+    (void)index;
+    (void)status;
+    (void)number;
+    (void)timestamp;
+    (void)message;
+    received++;
+}
+
+// Forwards the bytes between the master side of the pseudo-terminal and the emulator until the pipe is closed
+static void runEmulator(int master, int events) {
+    SIM300Emulator emulator(POWER_PIN, BAUD);
+    emulator.setRegistrationDelay(500);
+    uint8_t buffer[256];
+    while (true) {
+        struct pollfd pfd[2] = { { master, POLLIN, 0 }, { events, POLLIN, 0 } };
+        poll(pfd, 2, 1); // The emulator delivers its bytes with the timing of the baud rate, so it is polled every ms
+        if (pfd[0].revents & POLLIN) {
+            ssize_t n = read(master, buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < n; i++)
+                emulator.write(buffer[i]);
+        }
+        if (pfd[1].revents & (POLLIN | POLLHUP)) {
+            char event;
+            if (read(events, &event, 1) != 1)
+                return; // The library is done
+            if (event == EVENT_PIN_LOW || event == EVENT_PIN_HIGH)
+                digitalWrite(POWER_PIN, event == EVENT_PIN_LOW ? LOW : HIGH);
+            else if (event == EVENT_RING)
+                emulator.scheduleURC(millis(), "RING");
+            else if (event == EVENT_SMS)
+                emulator.receiveSMS(millis(), "0123456789", "Message through a pseudo-terminal");
+        }
+        size_t length = 0;
+        int c;
+        while (length < sizeof(buffer) && (c = emulator.read()) != -1)
+            buffer[length++] = c;
+        if (length > 0 && write(master, buffer, length) != (ssize_t)length)
+            perror("write");
+    }
+}
+
+static uint32_t cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+}
+
+static bool boot(GSMSIM300 &GSM, PosixDriver &driver) {
+    uint32_t start = millis(), cpu = cpuTime(), wakeups = driver.wakeups;
+    while (GSM.getState() != GSM_RUNNING) {
+        if (millis() - start > 60000) {
+            printf("Boot timed out in state %u\n", GSM.getState());
+            return false;
+        }
+        if (!driver.poll(1000))
+            return false;
+    }
+    printf("Boot to GSM_RUNNING: %u ms, %u wakeups, %.1f ms CPU time\n", millis() - start, driver.wakeups - wakeups, (cpuTime() - cpu) / 1000.0);
+    return true;
+}
+
+static bool sendMessage(GSMSIM300 &GSM, PosixDriver &driver) {
+    uint32_t start = millis();
+    uint8_t handle = GSM.sendSMS("0123456789", "Message through a pseudo-terminal");
+    while (GSM.getSMSStatus(handle) != SMS_STATUS_SENT) {
+        if (GSM.getSMSStatus(handle) == SMS_STATUS_FAILED || millis() - start > 30000) {
+            printf("Message through a pseudo-terminal failed\n");
+            return false;
+        }
+        if (!driver.poll(1000))
+            return false;
+    }
+    printf("Message sent in %u ms\n", millis() - start);
+    return true;
+}
+
+static bool idle(PosixDriver &driver, uint32_t ms) {
+    uint32_t start = millis(), cpu = cpuTime(), wakeups = driver.wakeups;
+    while (millis() - start < ms) {
+        if (!driver.poll(ms - (millis() - start)))
+            return false;
+    }
+    printf("Idle for %u ms: %u wakeups, %.2f ms CPU time\n", millis() - start, driver.wakeups - wakeups, (cpuTime() - cpu) / 1000.0);
+    return true;
+}
+
+// The time from the URC being sent until the answer is written includes the time on the wire
+static bool ring(GSMSIM300 &GSM, PosixSerial &serial, PosixDriver &driver) {
+    uint32_t start = micros(), tx = serial.txBytes;
+    sendEvent(EVENT_RING);
+    while (serial.txBytes == tx) {
+        if (micros() - start > 5000000) {
+            printf("RING was not answered\n");
+            return false;
+        }
+        if (!driver.poll(1000))
+            return false;
+    }
+    printf("RING answered after %.2f ms\n", (micros() - start) / 1000.0);
+    GSM.hangup();
+    return driver.poll(100);
+}
+
+static bool newMessage(GSMSIM300 &GSM, PosixDriver &driver) {
+    uint32_t start = micros();
+    received = 0;
+    sendEvent(EVENT_SMS);
+    while (!GSM.newSMS()) {
+        if (micros() - start > 5000000) {
+            printf("+CMTI was not received\n");
+            return false;
+        }
+        if (!driver.poll(1000))
+            return false;
+    }
+    uint32_t notified = micros() - start;
+    GSM.readSMSAsync();
+    while (received == 0) {
+        if (micros() - start > 10000000) {
+            printf("Message was not read\n");
+            return false;
+        }
+        if (!driver.poll(1000))
+            return false;
+    }
+    printf("+CMTI seen after %.2f ms and message read after %.2f ms\n", notified / 1000.0, (micros() - start) / 1000.0);
+    return true;
+}
+
+int main() {
+    hostUseRealTime(true);
+    signal(SIGPIPE, SIG_IGN);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    PosixSerial serial;
+    if (!serial.begin(ptsname(master), BAUD)) { // The slave side is opened before the fork, so the master never sees a hangup
+        perror("PosixSerial");
+        return 1;
+    }
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(serial.getFd());
+        close(pipeFds[1]);
+        runEmulator(master, pipeFds[0]);
+        _exit(0);
+    }
+    close(master);
+    close(pipeFds[0]);
+    control = pipeFds[1];
+    hostAttachPin(POWER_PIN, forwardPin, NULL);
+
+    GSMSIM300 GSM(&serial, NULL, POWER_PIN);
+    GSM.setSMSCallback(smsReceived);
+    PosixDriver driver(&GSM, &serial);
+
+    bool success = boot(GSM, driver) && sendMessage(GSM, driver) && idle(driver, 5000) && ring(GSM, serial, driver) && newMessage(GSM, driver);
+
+    printf("Serial: %u bytes received in %u reads, %u bytes sent in %u writes, %u updates\n", serial.rxBytes, serial.readCalls, serial.txBytes, serial.writeCalls, driver.updates);
+    close(control);
+    waitpid(pid, NULL, 0);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,473 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+// Replays a capture written by GSMCapture::dump() through the library under virtual time without a module
+// The received bytes are delivered at the time they were read, and the library must send the same bytes and make the same state transitions
+// Without an argument a session against the emulated SIM300 module is captured to capture.bin first and then replayed
+//
+// The sketch around the library is the example sketch: the commands read from the serial monitor are recorded as marks using
+// GSMCapture::mark(), new messages are drained and every unread message is answered. Use the same sketch to capture in the field:
+//   ./replay-bench capture.bin [pin code]
+
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+#include "GSMCapture.h"
+#include "SIM300Emulator.h"
+
+#define STEP_US     100 // Virtual time between calls to update() while capturing
+#define NUMBER      "0123456789"
+#define PIN_CODE    "1234"
+#define MAX_UPDATES 16 // Number of calls to update() at the same time before the time is advanced anyway
+#define CAPTURE_PIN 4 // Power pin of the emulated module
+#define REPLAY_PIN  5 // Nothing is connected to the power pin during the replay
+
+static GSMSIM300 *gsm;
+static uint8_t received;
+
+static uint64_t nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void smsReceived(const char *index, const char *status, const char *number, const char *timestamp, const char *message) {
+    (void)index;
+    (void)timestamp;
+    (void)message;
+    received++;
+    if (strcmp(status, "REC UNREAD") == 0) // Only respond to new messages
+        gsm->sendSMS(number, "Automatic response from SIM300 GSM module");
+}
+
+// The commands of the example sketch
+static void request(uint8_t command) {
+    if (command == 'C')
+        gsm->call(NUMBER);
+    else if (command == 'H')
+        gsm->hangup();
+    else if (command == 'S')
+        gsm->sendSMS(NUMBER, "You just received a SMS from a SIM300 GSM module :)");
+    else if (command == 'R')
+        gsm->readSMSAsync();
+    else if (command == 'L')
+        gsm->listSMS("ALL");
+    else if (command == 'D')
+        gsm->deleteSMSAll();
+}
+
+static void loop() {
+    gsm->update();
+    if (gsm->getState() == GSM_RUNNING && gsm->newSMS())
+        gsm->drainSMS();
+}
+
+/** Entry of a decoded capture. The time is in ms since the oldest entry. */
+struct CaptureEntry {
+    uint32_t time;
+    uint8_t type; // GSM_CAPTURE_RX, GSM_CAPTURE_TX or GSM_CAPTURE_EVENT with the kind
+    uint8_t data;
+};
+
+struct Capture {
+    bool states;
+    uint32_t startStates, dropped;
+    std::vector<CaptureEntry> entries;
+};
+
+/** Used to collect the output of GSMCapture::dump(). */
+class BufferPrint : public Print {
+public:
+    using Print::write;
+    size_t write(uint8_t c) {
+        data.push_back(c);
+        return 1;
+    };
+    std::vector<uint8_t> data;
+};
+
+static uint32_t getLong(const uint8_t *buffer) {
+    return buffer[0] | (uint32_t)buffer[1] << 8 | (uint32_t)buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static bool decode(const std::vector<uint8_t> &data, Capture &capture) {
+    if (data.size() < GSM_CAPTURE_HEADER_SIZE || memcmp(&data[0], "GSMC", 4) != 0 || data[4] != GSM_CAPTURE_VERSION)
+        return false;
+    capture.states = data[5];
+    capture.startStates = getLong(&data[10]);
+    capture.dropped = getLong(&data[14]);
+    uint16_t count = data[18] | data[19] << 8;
+    if (data.size() != GSM_CAPTURE_HEADER_SIZE + count * 2U)
+        return false;
+    capture.entries.clear();
+    uint32_t time = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        uint8_t header = data[GSM_CAPTURE_HEADER_SIZE + i * 2], value = data[GSM_CAPTURE_HEADER_SIZE + i * 2 + 1];
+        CaptureEntry entry;
+        if ((header & 0xC0) == GSM_CAPTURE_TIME) {
+            time += (uint16_t)(header & 0x3F) << 8 | value;
+            continue;
+        } else if ((header & 0xC0) == GSM_CAPTURE_EVENT) {
+            time += header & 0x07;
+            entry.type = header & 0xF8;
+        } else {
+            time += header & 0x3F;
+            entry.type = header & 0xC0;
+        }
+        entry.time = time;
+        entry.data = value;
+        capture.entries.push_back(entry);
+    }
+    return true;
+}
+
+static bool isState(const CaptureEntry &entry) {
+    return (entry.type & 0xC0) == GSM_CAPTURE_EVENT && ((entry.type >> 3) & 0x07) != GSM_CAPTURE_MARK;
+}
+
+static bool isInput(const CaptureEntry &entry) {
+    return entry.type == GSM_CAPTURE_RX || entry.type == (GSM_CAPTURE_EVENT | GSM_CAPTURE_MARK << 3);
+}
+
+/** Clock of the replay starting at the oldest entry. It is separate from the virtual time of the host build, as no module is emulated. */
+class ReplayClock : public GSMClock {
+public:
+    ReplayClock() : time(0) {};
+    uint32_t millis() {
+        return time / 1000;
+    };
+    uint32_t micros() {
+        return time;
+    };
+    void advance(uint64_t us) {
+        time += us;
+    };
+
+private:
+    uint64_t time;
+};
+
+/**
+ * Stream delivering the received bytes of a capture at the time they were read, and comparing the sent bytes with the capture.
+ * The received bytes and the marks are inputs, and they are kept in the order they were captured.
+ */
+class ReplayStream : public Stream {
+public:
+    ReplayStream(const Capture &capture, ReplayClock *clock) : txPos(0), txMismatch(-1), rxBytes(0), clock(clock), inputPos(0) {
+        for (size_t i = 0; i < capture.entries.size(); i++) {
+            if (isInput(capture.entries[i]))
+                inputs.push_back(capture.entries[i]);
+            else if (capture.entries[i].type == GSM_CAPTURE_TX)
+                tx.push_back(capture.entries[i].data);
+        }
+    };
+
+    using Print::write;
+    size_t write(uint8_t c) {
+        if (txMismatch == -1 && (txPos >= tx.size() || tx[txPos] != c))
+            txMismatch = txPos;
+        txPos++;
+        return 1;
+    };
+    int available() {
+        int n = 0;
+        for (size_t i = inputPos; i < inputs.size() && inputs[i].type == GSM_CAPTURE_RX && inputs[i].time <= now(); i++)
+            n++;
+        return n;
+    };
+    int read() {
+        int c = peek();
+        if (c != -1) {
+            inputPos++;
+            rxBytes++;
+        }
+        return c;
+    };
+    int peek() {
+        if (inputPos >= inputs.size() || inputs[inputPos].type != GSM_CAPTURE_RX || inputs[inputPos].time > now())
+            return -1;
+        return inputs[inputPos].data;
+    };
+
+    /**
+     * Used to get the mark that is due, so the request is made in the same order with the received bytes as when it was captured.
+     * @return Returns the mark or -1 if the next input is not a mark that is due.
+     */
+    int nextMark() {
+        if (inputPos >= inputs.size() || inputs[inputPos].type == GSM_CAPTURE_RX || inputs[inputPos].time > now())
+            return -1;
+        return inputs[inputPos++].data;
+    };
+
+    /** Used to get the time in ms since the start of the capture of the next input or GSM_NO_DEADLINE if every input is used. */
+    uint32_t nextInput() {
+        return inputPos < inputs.size() ? inputs[inputPos].time : GSM_NO_DEADLINE;
+    };
+
+    /** Time in ms since the start of the capture. */
+    uint32_t now() {
+        return clock->millis();
+    };
+
+    std::vector<uint8_t> tx;
+    size_t txPos;
+    long txMismatch; // Index of the first sent byte that is different from the capture
+    uint32_t rxBytes;
+
+private:
+    ReplayClock *clock;
+    std::vector<CaptureEntry> inputs;
+    size_t inputPos;
+};
+
+static const char *kindName(uint8_t type) {
+    static const char *names[] = { "GSM", "SMS", "call", "inbox" };
+    return names[(type >> 3) & 0x03];
+}
+
+// Compares the state transitions of the replay with the capture, and prints the first difference
+static bool compareStates(const Capture &expected, const Capture &actual) {
+    std::vector<CaptureEntry> a, b;
+    for (size_t i = 0; i < expected.entries.size(); i++) {
+        if (isState(expected.entries[i]))
+            a.push_back(expected.entries[i]);
+    }
+    for (size_t i = 0; i < actual.entries.size(); i++) {
+        if (isState(actual.entries[i]))
+            b.push_back(actual.entries[i]);
+    }
+    for (size_t i = 0; i < a.size() || i < b.size(); i++) {
+        if (i >= a.size() || i >= b.size() || a[i].type != b[i].type || a[i].data != b[i].data) {
+            if (i < a.size())
+                printf("State transition %u: captured %s state %u at %u ms, ", (unsigned)i, kindName(a[i].type), a[i].data, a[i].time);
+            else
+                printf("State transition %u: nothing captured, ", (unsigned)i);
+            if (i < b.size())
+                printf("replayed %s state %u at %u ms\n", kindName(b[i].type), b[i].data, b[i].time);
+            else
+                printf("nothing replayed\n");
+            return false;
+        }
+    }
+    printf("%u state transitions are the same\n", (unsigned)a.size());
+    return true;
+}
+
+static bool replay(const Capture &capture, const char *pinCode) {
+    if (!capture.states) {
+        printf("The capture has no state transitions, use GSMCapture::setModem()\n");
+        return false;
+    }
+    // A capture that starts while the module is running is replayed from GSM_RUNNING, otherwise the library starts from the beginning
+    uint8_t startState = capture.startStates;
+    if (startState != GSM_POWER_ON && startState != GSM_RUNNING)
+        printf("The capture starts in state %u after %u entries were overwritten, so the library might not follow it\n", startState, capture.dropped);
+    uint32_t duration = capture.entries.empty() ? 0 : capture.entries.back().time;
+
+    ReplayClock clock;
+    ReplayStream stream(capture, &clock);
+    GSMCapture tap(&stream);
+    GSMSIM300 GSM(&tap, pinCode, REPLAY_PIN, startState == GSM_RUNNING, &clock);
+    GSM.setSMSCallback(smsReceived);
+    gsm = &GSM;
+    tap.setModem(&GSM);
+
+    uint64_t time = 0;
+    uint32_t updates = 0;
+    uint8_t busy = 0;
+    while (stream.now() <= duration || stream.nextInput() != GSM_NO_DEADLINE) {
+        int mark;
+        while ((mark = stream.nextMark()) != -1) {
+            tap.mark(mark);
+            request(mark);
+        }
+        uint64_t start = nanos();
+        loop();
+        time += nanos() - start;
+        updates++;
+
+        uint32_t now = stream.now(), next = stream.nextInput();
+        uint32_t deadline = GSM.getNextDeadline();
+        if (deadline != GSM_NO_DEADLINE && now + deadline < next)
+            next = now + deadline;
+        if (next > duration + 1)
+            next = duration + 1;
+        if (next > now || ++busy >= MAX_UPDATES) {
+            clock.advance(((next > now ? next : now + 1) - now) * 1000);
+            busy = 0;
+        }
+    }
+    uint32_t tx = stream.txPos;
+
+    BufferPrint output;
+    tap.dump(&output);
+    Capture replayed;
+    decode(output.data, replayed);
+    bool success = compareStates(capture, replayed);
+    if (stream.txMismatch != -1 || tx != stream.tx.size()) {
+        printf("Sent bytes differ from byte %ld: %u bytes captured and %u bytes replayed\n", stream.txMismatch == -1 ? (long)stream.tx.size() : stream.txMismatch, (unsigned)stream.tx.size(), tx);
+        success = false;
+    } else
+        printf("%u sent bytes are the same\n", tx);
+    printf("Replayed %.1f s in %.2f ms: %u bytes received, %u updates, %.2f MB/s, %.0f ns per byte\n", duration / 1000.0, time / 1e6, stream.rxBytes, updates,
+           time ? stream.rxBytes * 1e3 / time : 0, stream.rxBytes ? (double)time / stream.rxBytes : 0);
+    return success;
+}
+
+static bool waitFor(bool (*done)(SIM300Emulator &), SIM300Emulator &emulator, uint32_t timeout, const char *what) {
+    uint32_t start = millis();
+    while (!done(emulator)) {
+        if (millis() - start > timeout) {
+            printf("%s timed out in state %u, %u received, %u sent\n", what, gsm->getState(), received, (unsigned)emulator.sentMessages.size());
+            return false;
+        }
+        loop();
+        hostAdvance(STEP_US);
+    }
+    return true;
+}
+
+static size_t sentTarget;
+
+static bool running(SIM300Emulator &) {
+    return gsm->getState() == GSM_RUNNING;
+}
+
+static bool sent(SIM300Emulator &emulator) {
+    return emulator.sentMessages.size() >= sentTarget;
+}
+
+static bool callActive(SIM300Emulator &) {
+    return gsm->getCallState() == CALL_ACTIVE;
+}
+
+static bool callIdle(SIM300Emulator &) {
+    return gsm->getCallState() == CALL_IDLE;
+}
+
+static void command(GSMCapture &capture, uint8_t c) {
+    capture.mark(c);
+    request(c);
+}
+
+// A session with messages, calls, an error and a module that stops responding
+static bool captureSession(GSMCapture &capture, SIM300Emulator &emulator) {
+    if (!waitFor(running, emulator, 60000, "Boot"))
+        return false;
+    sentTarget = 1;
+    command(capture, 'S');
+    if (!waitFor(sent, emulator, 60000, "Message"))
+        return false;
+
+    for (uint8_t i = 0; i < SMS_QUEUE_SIZE; i++)
+        emulator.receiveSMS(millis() + 100 + i * 50, NUMBER, "Incoming message");
+    sentTarget += SMS_QUEUE_SIZE; // Every message is answered
+    if (!waitFor(sent, emulator, 120000, "Answers"))
+        return false;
+
+    emulator.scheduleURC(millis() + 100, "RING");
+    if (!waitFor(callActive, emulator, 10000, "Incoming call"))
+        return false;
+    emulator.scheduleURC(millis() + 1000, "NO CARRIER");
+    if (!waitFor(callIdle, emulator, 10000, "Hangup"))
+        return false;
+
+    command(capture, 'C');
+    if (!waitFor(callActive, emulator, 60000, "Call"))
+        return false;
+    command(capture, 'H');
+    if (!waitFor(callIdle, emulator, 10000, "Hangup"))
+        return false;
+
+    emulator.failNextCommand("+CME ERROR: 100");
+    sentTarget++;
+    command(capture, 'S');
+    if (!waitFor(sent, emulator, 60000, "Message after an error"))
+        return false;
+
+    emulator.hang();
+    sentTarget++;
+    command(capture, 'S');
+    if (!waitFor(sent, emulator, 240000, "Message to a dead module"))
+        return false;
+
+    uint32_t start = millis();
+    while (millis() - start < 5000) {
+        loop();
+        hostAdvance(STEP_US);
+    }
+    return true;
+}
+
+static bool record(const char *path) {
+    SIM300Emulator emulator(CAPTURE_PIN, 9600);
+    emulator.setPinCode(PIN_CODE);
+    GSMCapture capture(&emulator);
+    GSMSIM300 GSM(&capture, PIN_CODE, CAPTURE_PIN);
+    GSM.setSMSCallback(smsReceived);
+    gsm = &GSM;
+    capture.setModem(&GSM);
+
+    uint32_t start = millis();
+    if (!captureSession(capture, emulator))
+        return false;
+    if (capture.getDropped() != 0) {
+        printf("The capture overflowed, increase GSM_CAPTURE_SIZE\n");
+        return false;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    BufferPrint output;
+    capture.dump(&output);
+    bool success = fwrite(&output.data[0], 1, output.data.size(), file) == output.data.size();
+    success = fclose(file) == 0 && success;
+    printf("Captured %.1f s to %s: %u bytes received and %u bytes sent in %u entries of 2 bytes\n", (millis() - start) / 1000.0, path, emulator.rxBytes, emulator.txBytes, capture.getCount());
+    return success;
+}
+
+static bool load(const char *path, Capture &capture) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+        data.push_back(c);
+    fclose(file);
+    if (!decode(data, capture)) {
+        printf("%s is not a capture\n", path);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "capture.bin";
+    if (argc < 2 && !record(path))
+        return 1;
+    Capture capture;
+    if (!load(path, capture))
+        return 1;
+    return replay(capture, argc > 2 ? argv[2] : PIN_CODE) ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/* Copyright (C) 2013 Kristian Lauszus, TKJ Electronics. All rights reserved.
+
+ This software may be distributed and modified under the terms of the GNU
+ General Public License version 2 (GPL2) as published by the Free Software
+ Foundation and appearing in the file GPL2.TXT included in the packaging of
+ this file. Please note that GPL2 Section 2[b] requires that all works based
+ on this software must also be made publicly available under the terms of
+ the GPL2 ("Copyleft").
+
+ Contact information
+ -------------------
+
+ Kristian Lauszus, TKJ Electronics
+ Web      :  http://www.tkjelectronics.com
+ e-mail   :  kristianl@tkjelectronics.com
+ */
+
+
+// Long-running simulation of a modem under virtual time using VirtualDriver
+// Every simulated hour messages are received and sent and a call is answered, while the network is lost once a day and
+// the module stops responding every 100 hours. The same workload is run for one hour with fixed steps for comparison
+// Afterwards the modem is left idle, while a sample of the signal quality fails with a transient error every few hours
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "VirtualDriver.h"
+
+#define STEP_US      100 // Virtual time between calls to update() with fixed steps like the benchmark
+#define MINUTE       60000UL
+#define HOUR         (60 * MINUTE)
+#define MAX_HOURS    1000 // millis() wraps around after 1193 hours, while the emulator is scheduled in ms
+#define QUIET_HOURS  100 // Run after the workload, so the total stays below the wraparound
+#define ERROR_HOURS  5 // Time between the transient errors while the modem is idle
+
+static GSMSIM300 *gsm;
+static SIM300Emulator *emulator;
+static VirtualDriver *driver; // NULL to use fixed steps
+static uint32_t received, answered, updates;
+
+static uint64_t nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void smsReceived(const char *index, const char *status, const char *number, const char *timestamp, const char *message) {
+    (void)index;
+    (void)status;
+    (void)number;
+    (void)timestamp;
+    (void)message;
+    received++;
+}
+
+static void callProgress(uint8_t event, const char *number) {
+    (void)number;
+    if (event == CALL_EVENT_CONNECTED)
+        answered++;
+}
+
+// Runs the library until the virtual time reaches the time in ms
+static void runUntil(uint64_t ms) {
+    while (hostMicros() < ms * 1000) {
+        if (driver)
+            driver->poll(ms - hostMicros() / 1000);
+        else {
+            gsm->update();
+            updates++;
+            hostAdvance(STEP_US);
+        }
+        if (gsm->getState() == GSM_RUNNING && gsm->newSMS())
+            gsm->drainSMS();
+    }
+}
+
+// Returns false if a message or a call was lost
+static bool runHours(uint32_t hours, const char *name) {
+    uint64_t start = hostMicros() / 1000, wall = nanos();
+    uint32_t boots = emulator->bootCount;
+    size_t sent = emulator->sentMessages.size();
+    uint32_t outages = 0, hangs = 0;
+    received = answered = updates = 0;
+    for (uint32_t hour = 0; hour < hours; hour++) {
+        uint64_t t = start + (uint64_t)hour * HOUR;
+        emulator->receiveSMS(t + 5 * MINUTE, "0123456789", "Message received every 20 minutes");
+        emulator->receiveSMS(t + 25 * MINUTE, "0123456789", "Message received every 20 minutes");
+        emulator->receiveSMS(t + 45 * MINUTE, "0123456789", "Message received every 20 minutes");
+        emulator->scheduleURC(t + 30 * MINUTE, "RING");
+        emulator->scheduleURC(t + 30 * MINUTE + 20000, "NO CARRIER");
+        if (hour % 24 == 23) {
+            emulator->loseNetwork(t + 55 * MINUTE, 3 * MINUTE);
+            outages++;
+        }
+        runUntil(t + 10 * MINUTE);
+        gsm->sendSMS("0123456789", "Message sent every 30 minutes");
+        runUntil(t + 40 * MINUTE);
+        gsm->sendSMS("0123456789", "Message sent every 30 minutes");
+        runUntil(t + 50 * MINUTE);
+        if (hour % 100 == 99) { // Nothing is sent until the next hour, so the module is detected as dead by the samples of the signal quality
+            emulator->hang();
+            hangs++;
+        }
+        runUntil(t + HOUR);
+    }
+    double seconds = (nanos() - wall) / 1e9;
+    uint32_t calls = driver ? driver->updates : updates;
+    printf("%s: %u h in %.2f s, %.0f modem-hours per minute, %u updates, %u received, %u sent, %u calls, %u outages, %u restarts\n", name, hours, seconds,
+           hours / seconds * 60, calls, received, (unsigned)(emulator->sentMessages.size() - sent), answered, outages, emulator->bootCount - boots);
+    return received == hours * 3 && emulator->sentMessages.size() - sent == hours * 2 && answered == hours && emulator->bootCount - boots == hangs;
+}
+
+// Returns false if the isolated errors added up to a restart of the module
+static bool quietHours(uint32_t hours) {
+    uint64_t start = hostMicros() / 1000;
+    uint32_t boots = emulator->bootCount, errors = 0;
+    for (uint32_t hour = 0; hour < hours; hour++) {
+        runUntil(start + (uint64_t)hour * HOUR + 15 * MINUTE);
+        if (hour % ERROR_HOURS == 0) {
+            emulator->failNextCommand("+CME ERROR: 100");
+            errors++;
+        }
+    }
+    runUntil(start + (uint64_t)hours * HOUR);
+    printf("Idle: %u h with %u transient errors, %u restarts, recovery tier %u\n", hours, errors, emulator->bootCount - boots, gsm->getRecoveryTier());
+    return emulator->bootCount == boots && gsm->getRecoveryTier() == GSM_RECOVERY_NONE;
+}
+
+static bool boot() {
+    uint32_t start = millis();
+    while (gsm->getState() != GSM_RUNNING) {
+        if (millis() - start > 60000) {
+            printf("Boot timed out in state %u\n", gsm->getState());
+            return false;
+        }
+        if (driver)
+            driver->poll();
+        else {
+            gsm->update();
+            hostAdvance(STEP_US);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t hours = argc > 1 ? strtoul(argv[1], NULL, 10) : MAX_HOURS;
+    if (hours == 0 || hours > MAX_HOURS) {
+        printf("Use 1 to %u hours\n", MAX_HOURS);
+        return 1;
+    }
+
+    // Fixed steps
+    SIM300Emulator stepEmulator(4, 9600);
+    GSMSIM300 stepGSM(&stepEmulator, NULL, 4);
+    stepGSM.setSMSCallback(smsReceived);
+    stepGSM.setCallCallback(callProgress);
+    gsm = &stepGSM;
+    emulator = &stepEmulator;
+    if (!boot() || !runHours(1, "100 us steps"))
+        return 1;
+
+    // The virtual time is advanced to the next deadline
+    SIM300Emulator virtualEmulator(5, 9600);
+    GSMSIM300 virtualGSM(&virtualEmulator, NULL, 5);
+    virtualGSM.setSMSCallback(smsReceived);
+    virtualGSM.setCallCallback(callProgress);
+    VirtualDriver virtualDriver(&virtualGSM, &virtualEmulator);
+    gsm = &virtualGSM;
+    emulator = &virtualEmulator;
+    driver = &virtualDriver;
+    uint64_t start = hostMicros() / 1000;
+    if (!boot() || !runHours(hours, "VirtualDriver") || !quietHours(QUIET_HOURS))
+        return 1;
+    printf("%u wakeups in %.0f simulated hours, %.1f updates per wakeup\n", virtualDriver.wakeups, (hostMicros() / 1000 - start) / (double)HOUR, (double)virtualDriver.updates / virtualDriver.wakeups);
+    return 0;
+}